@@ -0,0 +1,132 @@
+/**
+ * bench-dirhash.c
+ *
+ * Compares fs-cat's linear scan (dirscan) with a dirhash table over
+ * synthetic directories of growing size. For each size it prints the cost
+ * of one linear lookup, of building the table and of one hashed lookup,
+ * and how many lookups in the same directory pay for the build.
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc
+#include <string.h>   // strlen
+#include <time.h>
+
+#include "dirhash.h"
+#include "dirscan.h"
+
+#define LOOKUPS 2000
+
+static volatile uintptr_t sink;
+
+static double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char *
+make_directory(size_t nentries, off_t *length, char (*names)[32]) {
+    /**
+     * Lays out nentries entries in DIRBLKSIZ chunks with mixed name
+     * lengths; every tenth entry is deleted and folded into its neighbour
+     */
+    size_t cap = (nentries + 2) * DIRECTSIZ(31) + DIRBLKSIZ;
+    char *data = calloc(1, cap);
+    if (!data) {
+        perror("calloc");
+        exit(1);
+    }
+
+    off_t offset = 0, chunk_used = 0;
+    struct direct *prev = NULL, *dir;
+    for (size_t i = 0; i < nentries; i++) {
+        int namlen = snprintf(names[i], 32, "entry%zu%.*s", i, (int)(i * 7 % 19), "_abcdefghijklmnopqr");
+        size_t reclen = DIRECTSIZ(namlen);
+        if (chunk_used + reclen > DIRBLKSIZ) {
+            prev->d_reclen += DIRBLKSIZ - chunk_used;
+            offset += DIRBLKSIZ - chunk_used;
+            chunk_used = 0;
+        }
+        dir = (struct direct *)(data + offset);
+        dir->d_ino = i % 10 == 9 ? 0 : i + 3;
+        dir->d_reclen = reclen;
+        dir->d_type = DT_REG;
+        dir->d_namlen = namlen;
+        memcpy(dir->d_name, names[i], namlen + 1);
+        prev = dir;
+        offset += reclen;
+        chunk_used += reclen;
+    }
+    prev->d_reclen += DIRBLKSIZ - chunk_used;
+    *length = offset + DIRBLKSIZ - chunk_used;
+    return data;
+}
+
+
+int
+main(void) {
+    printf("%9s %10s %12s %12s %12s %10s\n",
+           "entries", "dir bytes", "linear ns", "build ns", "hashed ns", "break-even");
+
+    for (size_t nentries = 8; nentries <= (1 << 18); nentries *= 2) {
+        char (*names)[32] = malloc(nentries * sizeof(*names));
+        if (!names) {
+            perror("malloc");
+            exit(1);
+        }
+        off_t length;
+        char *data = make_directory(nentries, &length, names);
+
+        // Probe live names spread over the whole directory
+        size_t probes[LOOKUPS];
+        for (int i = 0; i < LOOKUPS; i++) {
+            probes[i] = (i * 2654435761u) % nentries;
+            if (probes[i] % 10 == 9) probes[i]--;
+        }
+
+        int linear_lookups = nentries > 4096 ? LOOKUPS / 20 : LOOKUPS;
+        double start = now_ns();
+        for (int i = 0; i < linear_lookups; i++) {
+            sink += (uintptr_t)ufs_dirscan_find(data, length, names[probes[i]], strlen(names[probes[i]]));
+        }
+        double linear = (now_ns() - start) / linear_lookups;
+
+        // Build cost includes the counting pass ufs_dirhash_get does
+        int builds = nentries > 4096 ? 4 : 64;
+        struct ufs_arena arena = { 0 };
+        struct ufs_dirhash *table = NULL;
+        start = now_ns();
+        for (int i = 0; i < builds; i++) {
+            size_t live = 0;
+            const struct direct *dir;
+            for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+                dir = (const struct direct *)(data + offset);
+                if (dir->d_ino) live++;
+            }
+            table = ufs_dirhash_create(&arena, 2, live);
+            ufs_dirhash_add_run(table, data, length, NULL);
+        }
+        double build = (now_ns() - start) / builds;
+
+        start = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            const char *name = names[probes[i]];
+            sink += (uintptr_t)ufs_dirhash_find(table, name, strlen(name));
+        }
+        double hashed = (now_ns() - start) / LOOKUPS;
+
+        if (linear > hashed) {
+            printf("%9zu %10jd %12.0f %12.0f %12.0f %10.1f\n", nentries, (intmax_t)length,
+                   linear, build, hashed, build / (linear - hashed));
+        } else {
+            printf("%9zu %10jd %12.0f %12.0f %12.0f %10s\n", nentries, (intmax_t)length,
+                   linear, build, hashed, "never");
+        }
+
+        ufs_arena_free(&arena);
+        free(data);
+        free(names);
+    }
+    return 0;
+}
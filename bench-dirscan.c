@@ -0,0 +1,180 @@
+/**
+ * bench-dirscan.c
+ *
+ * Times dirscan's vector lookup against its scalar path, and its listing,
+ * over synthetic 32 KiB directory blocks. Each name profile gets its own
+ * row: the lookups probe live names and missing ones, and every probe has
+ * to come back the same from both paths.
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memcpy
+#include <time.h>
+
+#include "dirscan.h"
+
+#define BLOCK 32768
+#define BLOCKS 64                       // a 2 MiB directory
+#define PROBES 2000
+
+struct profile {
+    const char *label;
+    int min, max;                       // name lengths
+    int shared;                         // bytes of prefix every name starts with
+};
+
+static const struct profile profiles[] = {
+    { "short 1-8", 1, 8, 0 },
+    { "mixed 1-40", 1, 40, 0 },
+    { "long 16-60", 16, 60, 0 },
+    { "prefix 24", 24, 24, 16 },
+};
+
+static volatile uintptr_t sink;
+
+static double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t
+next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static char *
+make_blocks(const struct profile *profile, char (*names)[64], size_t *nnames) {
+    /**
+     * Fills BLOCKS blocks with entries, DIRBLKSIZ chunks at a time. About
+     * one entry in eight is deleted: at the start of a chunk it stays with
+     * d_ino 0, elsewhere its space goes to the entry before it, with the
+     * old bytes left in the gap the way the kernel leaves them
+     */
+    char *data = calloc(BLOCKS, BLOCK);
+    if (!data) {
+        perror("calloc");
+        exit(1);
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t count = 0;
+    for (off_t chunk = 0; chunk < (off_t)BLOCKS * BLOCK; chunk += DIRBLKSIZ) {
+        off_t used = 0;
+        struct direct *prev = NULL, *dir;
+        for (;;) {
+            int namlen = profile->min + next_random(&state) % (profile->max - profile->min + 1);
+            if (used + DIRECTSIZ(namlen) > DIRBLKSIZ) break;
+
+            char name[64];
+            for (int i = 0; i < namlen; i++) {
+                name[i] = i < profile->shared ? 'p' : 'a' + next_random(&state) % 26;
+            }
+            name[namlen] = '\0';
+
+            dir = (struct direct *)(data + chunk + used);
+            dir->d_ino = count + 3;
+            dir->d_reclen = DIRECTSIZ(namlen);
+            dir->d_type = DT_REG;
+            dir->d_namlen = namlen;
+            memcpy(dir->d_name, name, namlen + 1);
+            used += dir->d_reclen;
+
+            if (next_random(&state) % 8 == 0) {
+                if (prev) {
+                    prev->d_reclen += dir->d_reclen;
+                    continue;
+                }
+                dir->d_ino = 0;
+            } else {
+                memcpy(names[count++], name, namlen + 1);
+            }
+            prev = dir;
+        }
+        prev->d_reclen += DIRBLKSIZ - used;
+    }
+    *nnames = count;
+    return data;
+}
+
+int
+main(void) {
+    printf("%-12s %8s %14s %14s %14s %14s %12s\n", "names", "entries",
+           "scalar hit ns", "vector hit ns", "scalar miss ns", "vector miss ns", "list ns/blk");
+
+    char (*names)[64] = malloc(BLOCKS * (BLOCK / 12) * sizeof(*names));
+    if (!names) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+        size_t nnames;
+        char *data = make_blocks(&profiles[p], names, &nnames);
+
+        // Lookups search one block, as a small directory's would
+        size_t probes[PROBES];
+        const char *blocks[PROBES];
+        for (int i = 0; i < PROBES; i++) probes[i] = (i * 2654435761u) % nnames;
+        for (int i = 0; i < PROBES; i++) {
+            const char *name = names[probes[i]];
+            for (int b = 0; b < BLOCKS; b++) {
+                blocks[i] = data + (off_t)b * BLOCK;
+                if (ufs_dirscan_find_scalar(blocks[i], BLOCK, name, strlen(name))) break;
+            }
+        }
+
+        double times[4];
+        for (int miss = 0; miss < 2; miss++) {
+            for (int vector = 0; vector < 2; vector++) {
+                double start = now_ns();
+                for (int i = 0; i < PROBES; i++) {
+                    const char *name = names[probes[i]];
+                    const char *block = miss ? blocks[(i + 1) % PROBES] : blocks[i];
+                    size_t namlen = strlen(name);
+                    sink += (uintptr_t)(vector ? ufs_dirscan_find(block, BLOCK, name, namlen) :
+                                                 ufs_dirscan_find_scalar(block, BLOCK, name, namlen));
+                }
+                times[miss * 2 + vector] = (now_ns() - start) / PROBES;
+            }
+        }
+
+        // Both paths have to find the same entry, or miss together
+        for (int i = 0; i < PROBES; i++) {
+            for (int miss = 0; miss < 2; miss++) {
+                const char *name = names[probes[i]];
+                const char *block = miss ? blocks[(i + 1) % PROBES] : blocks[i];
+                if (ufs_dirscan_find(block, BLOCK, name, strlen(name)) !=
+                    ufs_dirscan_find_scalar(block, BLOCK, name, strlen(name))) {
+                    fprintf(stderr, "bench-dirscan: %s: paths disagree on %s\n", profiles[p].label, name);
+                    exit(1);
+                }
+            }
+        }
+
+        struct ufs_dirent entries[UFS_DIRSCAN_BATCH];
+        size_t listed = 0, n;
+        double start = now_ns();
+        for (int b = 0; b < BLOCKS; b++) {
+            off_t offset = 0;
+            while ((n = ufs_dirscan_list(data + (off_t)b * BLOCK, BLOCK, &offset, entries, UFS_DIRSCAN_BATCH))) {
+                for (size_t i = 0; i < n; i++) sink += entries[i].inode;
+                listed += n;
+            }
+        }
+        double list = (now_ns() - start) / BLOCKS;
+        if (listed != nnames) {
+            fprintf(stderr, "bench-dirscan: %s: listed %zu of %zu entries\n", profiles[p].label, listed, nnames);
+            exit(1);
+        }
+
+        printf("%-12s %8zu %14.0f %14.0f %14.0f %14.0f %12.0f\n", profiles[p].label, nnames,
+               times[0], times[1], times[2], times[3], list);
+        free(data);
+    }
+    free(names);
+    return 0;
+}
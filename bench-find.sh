@@ -0,0 +1,39 @@
+#!/bin/sh
+# Reports fs-find throughput (entries/sec) serially and at 1..16 threads
+# usage: ./bench-find.sh partition.img [runs]
+img=$1
+runs=${2:-3}
+if [ -z "$img" ]; then
+	echo "usage: $0 partition.img [runs]" >&2
+	exit 1
+fi
+
+entries=$(./fs-find "$img" | wc -l)
+echo "entries: $entries"
+
+best_time() {
+	# Fastest wall time over $runs runs of fs-find with the given flags
+	best=
+	i=0
+	while [ $i -lt $runs ]; do
+		t=$( { /usr/bin/time -p ./fs-find "$@" "$img" > /dev/null; } 2>&1 \
+			| awk '/^real/ { print $2 }')
+		if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+			best=$t
+		fi
+		i=$((i + 1))
+	done
+	echo "$best"
+}
+
+rate() {
+	awk "BEGIN { printf \"%.0f\", $entries / ($1 + 0.001) }"
+}
+
+printf "%-8s %10s %14s\n" threads seconds entries/sec
+t=$(best_time)
+printf "%-8s %10s %14s\n" serial "$t" "$(rate "$t")"
+for n in 1 2 4 8 16; do
+	t=$(best_time -j $n)
+	printf "%-8s %10s %14s\n" "$n" "$t" "$(rate "$t")"
+done
@@ -0,0 +1,140 @@
+/**
+ * bench-geometry.c
+ *
+ * Times inode and block address translation per lookup for a few
+ * geometries: the fs.h macro path (divisions by fs_ipg, fs_inopb and
+ * fs_fpg) against the kernel ufs_geometry_init picks. Every inode of the
+ * geometry, and every block looked up, has to land at the same offset
+ * both ways.
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memset
+#include <time.h>
+
+#include "ufsread.h"
+
+#define LOOKUPS (1 << 22)
+
+struct shape {
+    const char *label;
+    int32_t bsize, fsize;
+    int32_t fpg, ipg, iblkno;
+    uint32_t ncg;
+};
+
+static const struct shape shapes[] = {
+    { "32K/4K", 32768, 4096, 26728, 1920, 40, 64 },
+    { "64K/8K", 65536, 8192, 53456, 3840, 40, 64 },
+    { "4K/512", 4096, 512, 27224, 2176, 168, 64 },
+    { "32K/4K pow2", 32768, 4096, 32768, 4096, 40, 64 },
+    { "4K/512 odd", 4096, 512, 27224, 2170, 168, 64 },
+};
+
+static const char *kinds[] = { "shift", "reciprocal", "generic" };
+
+static volatile off_t sink;
+
+static double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+log2i(int32_t n) {
+    int shift = 0;
+    while ((1 << shift) < n) shift++;
+    return shift;
+}
+
+static off_t
+block_offset_macros(const struct fs *superblock, ufs2_daddr_t data_block) {
+    /**
+     * The block translation as it was: cg start plus offset in the cg
+     */
+    ufs2_daddr_t cg_num = dtog(superblock, data_block);
+    return lfragtosize(superblock, cgbase(superblock, cg_num)) +
+           lfragtosize(superblock, dtogd(superblock, data_block));
+}
+
+int
+main(void) {
+    printf("%-12s %-10s %10s %10s %10s %10s\n", "geometry", "kernel",
+           "inode ns", "macros ns", "block ns", "macros ns");
+
+    uint32_t *numbers = malloc(LOOKUPS * sizeof(uint32_t));
+    if (!numbers) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        const struct shape *shape = &shapes[s];
+        struct fs superblock;
+        memset(&superblock, 0, sizeof(superblock));
+        superblock.fs_bsize = shape->bsize;
+        superblock.fs_fsize = shape->fsize;
+        superblock.fs_frag = shape->bsize / shape->fsize;
+        superblock.fs_fshift = log2i(shape->fsize);
+        superblock.fs_fragshift = log2i(superblock.fs_frag);
+        superblock.fs_inopb = shape->bsize / sizeof(struct ufs2_dinode);
+        superblock.fs_fpg = shape->fpg;
+        superblock.fs_ipg = shape->ipg;
+        superblock.fs_iblkno = shape->iblkno;
+        superblock.fs_ncg = shape->ncg;
+
+        struct ufs_image image;
+        memset(&image, 0, sizeof(image));
+        image.superblock = &superblock;
+        ufs_geometry_init(&image.geometry, &superblock);
+
+        // Every inode number of the file system has to agree
+        uint32_t ninodes = shape->ipg * shape->ncg;
+        for (uint32_t ino = 0; ino < ninodes; ino++) {
+            if (ufs_inode_offset(&image, ino) != ufs_inode_offset_generic(&superblock, ino)) {
+                fprintf(stderr, "bench-geometry: %s: inode %u is misplaced\n", shape->label, ino);
+                exit(1);
+            }
+        }
+
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            numbers[i] = state % ninodes;
+        }
+
+        double times[4], start;
+        off_t sum = 0;
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; i++) sum += ufs_inode_offset(&image, numbers[i]);
+        times[0] = (now_ns() - start) / LOOKUPS;
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; i++) sum += ufs_inode_offset_generic(&superblock, numbers[i]);
+        times[1] = (now_ns() - start) / LOOKUPS;
+
+        // Block numbers anywhere in the file system
+        uint32_t nfrags = shape->fpg * shape->ncg;
+        for (size_t i = 0; i < LOOKUPS; i++) numbers[i] = (uint64_t)numbers[i] * nfrags / ninodes;
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            if (ufs_block_offset(&superblock, numbers[i]) != block_offset_macros(&superblock, numbers[i])) {
+                fprintf(stderr, "bench-geometry: %s: block %u is misplaced\n", shape->label, numbers[i]);
+                exit(1);
+            }
+        }
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; i++) sum += ufs_block_offset(&superblock, numbers[i]);
+        times[2] = (now_ns() - start) / LOOKUPS;
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; i++) sum += block_offset_macros(&superblock, numbers[i]);
+        times[3] = (now_ns() - start) / LOOKUPS;
+        sink = sum;
+
+        printf("%-12s %-10s %10.2f %10.2f %10.2f %10.2f\n", shape->label, kinds[image.geometry.kind],
+               times[0], times[1], times[2], times[3]);
+    }
+    free(numbers);
+    return 0;
+}
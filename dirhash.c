@@ -0,0 +1,286 @@
+/**
+ * dirhash.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc
+#include <string.h>   // memcmp
+
+#include "dirhash.h"
+#include "dirscan.h"
+
+#define ARENA_CHUNK (1 << 20)
+
+struct ufs_arena_chunk {
+    struct ufs_arena_chunk *next;
+    char data[];
+};
+
+static size_t count_entries(const char *data, off_t length);
+
+void *
+ufs_arena_alloc(struct ufs_arena *arena, size_t size) {
+    /**
+     * Bump allocates size bytes (8 byte aligned). Exits when out of memory
+     */
+    size = (size + 7) & ~(size_t)7;
+    if (size > arena->left) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        struct ufs_arena_chunk *chunk = malloc(sizeof(struct ufs_arena_chunk) + chunk_size);
+        if (!chunk) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next = chunk->data;
+        arena->left = chunk_size;
+    }
+
+    void *ptr = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    return ptr;
+}
+
+void
+ufs_arena_free(struct ufs_arena *arena) {
+    struct ufs_arena_chunk *chunk = arena->chunks, *next;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->next = NULL;
+    arena->left = 0;
+}
+
+void
+ufs_arena_adopt(struct ufs_arena *arena, struct ufs_arena *from) {
+    /**
+     * Moves from's chunks, and what was allocated in them, into arena.
+     * Allocation carries on in arena's current chunk; from ends up empty
+     */
+    if (!from->chunks) return;
+    if (!arena->chunks) {
+        *arena = *from;
+    } else {
+        struct ufs_arena_chunk *last = from->chunks;
+        while (last->next) last = last->next;
+        last->next = arena->chunks->next;
+        arena->chunks->next = from->chunks;
+    }
+    from->chunks = NULL;
+    from->next = NULL;
+    from->left = 0;
+}
+
+uint32_t
+ufs_dirhash_name(const char *name, size_t namlen) {
+    /**
+     * 32-bit FNV-1a of a directory entry name
+     */
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < namlen; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+struct ufs_dirhash *
+ufs_dirhash_create(struct ufs_arena *arena, ino_t dir_inode, size_t nentries) {
+    /**
+     * Allocates an empty table sized for nentries (kept at most half full)
+     */
+    struct ufs_dirhash *table = ufs_arena_alloc(arena, sizeof(struct ufs_dirhash));
+    table->dir_inode = dir_inode;
+    table->nentries = 0;
+    table->nslots = 16;
+    while (table->nslots < nentries * 2) table->nslots *= 2;
+
+    table->slots = ufs_arena_alloc(arena, table->nslots * sizeof(struct ufs_dirhash_slot));
+    memset(table->slots, 0, table->nslots * sizeof(struct ufs_dirhash_slot));
+    return table;
+}
+
+void
+ufs_dirhash_add_run(
+    struct ufs_dirhash *table,
+    const char *data,
+    off_t length,
+    struct ufs_arena *names
+) {
+    /**
+     * Adds the live entries of a contiguous run of directory blocks. Names
+     * are copied into names, or point into data when it stays put (NULL)
+     */
+    struct ufs_dirent entries[UFS_DIRSCAN_BATCH], *entry;
+    uint32_t mask = table->nslots - 1, i, hash;
+    off_t offset = 0;
+    size_t count;
+    while ((count = ufs_dirscan_list(data, length, &offset, entries, UFS_DIRSCAN_BATCH))) {
+        for (entry = entries; entry < entries + count; entry++) {
+            hash = ufs_dirhash_name(entry->name, entry->namlen);
+            for (i = hash & mask; table->slots[i].name; i = (i + 1) & mask);
+
+            if (names) {
+                char *copy = ufs_arena_alloc(names, entry->namlen);
+                memcpy(copy, entry->name, entry->namlen);
+                table->slots[i].name = copy;
+            } else {
+                table->slots[i].name = entry->name;
+            }
+            table->slots[i].hash = hash;
+            table->slots[i].inode = entry->inode;
+            table->slots[i].namlen = entry->namlen;
+            table->slots[i].type = entry->type;
+            table->nentries++;
+        }
+    }
+}
+
+const struct ufs_dirhash_slot *
+ufs_dirhash_find(const struct ufs_dirhash *table, const char *name, size_t namlen) {
+    /**
+     * Returns the entry called name, or NULL
+     */
+    uint32_t hash = ufs_dirhash_name(name, namlen);
+    uint32_t mask = table->nslots - 1;
+    const struct ufs_dirhash_slot *slot;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &table->slots[i];
+        if (!slot->name) return NULL;
+        if (slot->hash == hash && slot->namlen == namlen && !memcmp(slot->name, name, namlen)) {
+            return slot;
+        }
+    }
+}
+
+void
+ufs_dirhash_init(struct ufs_dirhash_cache *cache, off_t minsize) {
+    memset(cache, 0, sizeof(*cache));
+    cache->minsize = minsize;
+}
+
+struct ufs_dirhash *
+ufs_dirhash_get(
+    struct ufs_dirhash_cache *cache,
+    const struct ufs_image *image,
+    ino_t dir_inode
+) {
+    /**
+     * Returns the table for a directory, building it on first use. NULL
+     * means the directory is below minsize and should be scanned instead
+     */
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, dir_inode, &buf);
+    struct ufs_dirhash *table = NULL;
+    if ((off_t)inode->di_size >= cache->minsize && !(table = ufs_dirhash_lookup(cache, dir_inode))) {
+        table = ufs_dirhash_build(&cache->arena, image, dir_inode, inode);
+        ufs_dirhash_insert(cache, table, NULL);
+    }
+    ufs_put(image, buf);
+    return table;
+}
+
+struct ufs_dirhash *
+ufs_dirhash_lookup(const struct ufs_dirhash_cache *cache, ino_t dir_inode) {
+    /**
+     * The table already built for a directory, or NULL
+     */
+    if (!cache->cap) return NULL;
+    size_t mask = cache->cap - 1;
+    for (size_t i = dir_inode & mask; cache->tables[i]; i = (i + 1) & mask) {
+        if (cache->tables[i]->dir_inode == dir_inode) return cache->tables[i];
+    }
+    return NULL;
+}
+
+struct ufs_dirhash *
+ufs_dirhash_build(
+    struct ufs_arena *arena,
+    const struct ufs_image *image,
+    ino_t dir_inode,
+    const struct ufs2_dinode *inode
+) {
+    /**
+     * Builds a directory's table in arena, whatever its size
+     */
+    // Count, then fill: one extra pass beats guessing the size from di_size
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    size_t nentries = 0;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        nentries += count_entries(data, length);
+    }
+    ufs_dir_end(&iter);
+
+    // Blocks that went through the cache will not stay, their names are copied
+    struct ufs_dirhash *table = ufs_dirhash_create(arena, dir_inode, nentries);
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        ufs_dirhash_add_run(table, data, length, image->base ? NULL : arena);
+    }
+    ufs_dir_end(&iter);
+    return table;
+}
+
+void
+ufs_dirhash_insert(
+    struct ufs_dirhash_cache *cache,
+    struct ufs_dirhash *table,
+    struct ufs_arena *arena
+) {
+    /**
+     * Remembers a table that is not in the cache yet. One built in an
+     * arena other than the cache's passes it over (NULL: the cache's own)
+     */
+    if (arena) ufs_arena_adopt(&cache->arena, arena);
+
+    // Grow the directory map when it is half full
+    size_t i, mask;
+    if ((cache->ntables + 1) * 2 > cache->cap) {
+        size_t new_cap = cache->cap ? cache->cap * 2 : 64;
+        struct ufs_dirhash **tables = calloc(new_cap, sizeof(struct ufs_dirhash *));
+        if (!tables) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t n = 0; n < cache->cap; n++) {
+            if (!cache->tables[n]) continue;
+            for (i = cache->tables[n]->dir_inode & (new_cap - 1); tables[i]; i = (i + 1) & (new_cap - 1));
+            tables[i] = cache->tables[n];
+        }
+        free(cache->tables);
+        cache->tables = tables;
+        cache->cap = new_cap;
+    }
+    mask = cache->cap - 1;
+    for (i = table->dir_inode & mask; cache->tables[i]; i = (i + 1) & mask);
+    cache->tables[i] = table;
+    cache->ntables++;
+}
+
+void
+ufs_dirhash_free(struct ufs_dirhash_cache *cache) {
+    ufs_arena_free(&cache->arena);
+    free(cache->tables);
+    cache->tables = NULL;
+    cache->ntables = cache->cap = 0;
+}
+
+static size_t
+count_entries(const char *data, off_t length) {
+    const struct direct *dir;
+    size_t count = 0;
+    for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+        dir = (const struct direct *)(data + offset);
+        if (!dir->d_reclen) break;
+        if (dir->d_ino) count++;
+    }
+    return count;
+}
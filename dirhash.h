@@ -0,0 +1,93 @@
+/**
+ * dirhash.h
+ *
+ * In-memory name -> inode hash tables for large directories, in the spirit
+ * of FreeBSD's ufs_dirhash. A table is built the first time a directory of
+ * at least minsize bytes is searched and kept for the rest of the run, so
+ * later lookups in that directory are O(1). Tables and their slots live in
+ * an arena; names point straight into the mapped image, or are copied into
+ * the arena when the image is read through the cache. ufs_dirhash_get
+ * does it all in one call; threads sharing a cache look tables up and
+ * insert them under their own lock, and build them outside it into an
+ * arena of their own that the cache then takes over.
+ */
+#ifndef DIRHASH_H
+#define DIRHASH_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "ufsread.h"
+
+// Directories smaller than this are scanned linearly (see bench-dirhash)
+#define UFS_DIRHASH_MINSIZE 2560
+
+struct ufs_arena {
+    struct ufs_arena_chunk *chunks;
+    char *next;
+    size_t left;
+};
+
+struct ufs_dirhash_slot {
+    const char *name;           // d_name in the image or a copy, NULL if empty
+    uint32_t hash;
+    uint32_t inode;
+    uint8_t namlen;
+    uint8_t type;
+};
+
+struct ufs_dirhash {
+    ino_t dir_inode;
+    uint32_t nslots;            // power of two
+    uint32_t nentries;
+    struct ufs_dirhash_slot *slots;
+};
+
+struct ufs_dirhash_cache {
+    struct ufs_arena arena;
+    off_t minsize;
+
+    // Directory inode -> its table, open addressing
+    struct ufs_dirhash **tables;
+    size_t ntables, cap;
+};
+
+void *ufs_arena_alloc(struct ufs_arena *arena, size_t size);
+void ufs_arena_free(struct ufs_arena *arena);
+void ufs_arena_adopt(struct ufs_arena *arena, struct ufs_arena *from);
+
+uint32_t ufs_dirhash_name(const char *name, size_t namlen);
+struct ufs_dirhash *ufs_dirhash_create(struct ufs_arena *arena, ino_t dir_inode, size_t nentries);
+void ufs_dirhash_add_run(
+    struct ufs_dirhash *table,
+    const char *data,
+    off_t length,
+    struct ufs_arena *names
+);
+const struct ufs_dirhash_slot *ufs_dirhash_find(
+    const struct ufs_dirhash *table,
+    const char *name,
+    size_t namlen
+);
+
+void ufs_dirhash_init(struct ufs_dirhash_cache *cache, off_t minsize);
+struct ufs_dirhash *ufs_dirhash_get(
+    struct ufs_dirhash_cache *cache,
+    const struct ufs_image *image,
+    ino_t dir_inode
+);
+struct ufs_dirhash *ufs_dirhash_lookup(const struct ufs_dirhash_cache *cache, ino_t dir_inode);
+struct ufs_dirhash *ufs_dirhash_build(
+    struct ufs_arena *arena,
+    const struct ufs_image *image,
+    ino_t dir_inode,
+    const struct ufs2_dinode *inode
+);
+void ufs_dirhash_insert(
+    struct ufs_dirhash_cache *cache,
+    struct ufs_dirhash *table,
+    struct ufs_arena *arena
+);
+void ufs_dirhash_free(struct ufs_dirhash_cache *cache);
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * dirscan.c
+ */
+#include <string.h>   // memcmp
+#include <stddef.h>   // offsetof
+
+#include "dirscan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WINDOW 32
+typedef __m256i window_t;
+#define LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define EQUAL(a, b) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((a), (b))))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define WINDOW 16
+typedef __m128i window_t;
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define EQUAL(a, b) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8((a), (b))))
+#endif
+
+// The window starts at d_namlen, so the name follows it
+#define NAMLEN_OFFSET offsetof(struct direct, d_namlen)
+
+const struct direct *
+ufs_dirscan_find(
+    const char *data,
+    off_t length,
+    const char *name,
+    size_t namlen
+) {
+    /**
+     * Searches a contiguous run of directory blocks for name (namlen
+     * bytes). Returns its live entry, or NULL. The window settles names of
+     * up to WINDOW - 1 bytes; a longer one has to match its last WINDOW
+     * bytes as well, and only one past 2 * WINDOW - 1 needs a memcmp
+     */
+#ifdef WINDOW
+    if (namlen > UFS_MAXNAMLEN) return NULL;
+
+    // d_namlen and the first WINDOW - 1 bytes of the name; the rest is masked off
+    unsigned char bytes[WINDOW];
+    size_t covered = namlen < WINDOW - 1 ? namlen + 1 : WINDOW;
+    uint32_t mask = covered == 32 ? 0xffffffff : ((uint32_t)1 << covered) - 1;
+    memset(bytes, 0, sizeof(bytes));
+    bytes[0] = namlen;
+    memcpy(bytes + 1, name, covered - 1);
+    window_t pattern = LOAD(bytes);
+
+    // Longer names also get their last WINDOW bytes compared in one go
+    window_t tail;
+    if (namlen >= WINDOW) tail = LOAD(name + namlen - WINDOW);
+
+    // Records starting after last would load past the run
+    off_t last = length - (off_t)(NAMLEN_OFFSET + WINDOW);
+    const struct direct *dir;
+    off_t offset;
+    for (offset = 0; offset <= last; offset += dir->d_reclen) {
+        dir = (const struct direct *)(data + offset);
+        if (!dir->d_reclen) return NULL; // corrupt block, don't spin
+        if ((EQUAL(LOAD(data + offset + NAMLEN_OFFSET), pattern) & mask) != mask) continue;
+        if (!dir->d_ino) continue;
+        if (namlen >= WINDOW) {
+            if (EQUAL(LOAD(dir->d_name + namlen - WINDOW), tail) != (uint32_t)((1ULL << WINDOW) - 1)) continue;
+            if (namlen > 2 * WINDOW - 1 &&
+                memcmp(dir->d_name + WINDOW - 1, name + WINDOW - 1, namlen - (2 * WINDOW - 1))) continue;
+        }
+        return dir;
+    }
+    return ufs_dirscan_find_scalar(data + offset, length - offset, name, namlen);
+#else
+    return ufs_dirscan_find_scalar(data, length, name, namlen);
+#endif
+}
+
+const struct direct *
+ufs_dirscan_find_scalar(
+    const char *data,
+    off_t length,
+    const char *name,
+    size_t namlen
+) {
+    /**
+     * ufs_dirscan_find a record at a time: the length byte, then memcmp
+     */
+    const struct direct *dir;
+    for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+        dir = (const struct direct *)(data + offset);
+        if (!dir->d_reclen) break; // corrupt block, don't spin
+
+        if (dir->d_ino && dir->d_namlen == namlen && !memcmp(name, dir->d_name, namlen)) {
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+size_t
+ufs_dirscan_list(
+    const char *data,
+    off_t length,
+    off_t *offset,
+    struct ufs_dirent *entries,
+    size_t max
+) {
+    /**
+     * Fills entries with up to max live entries of a run, starting at
+     * *offset and moving it past them. Returns how many; 0 once the run
+     * is done
+     */
+    const struct direct *dir;
+    size_t count = 0;
+    off_t at = *offset;
+    while (count < max && at < length) {
+        dir = (const struct direct *)(data + at);
+        if (!dir->d_reclen) { // corrupt block, don't spin
+            at = length;
+            break;
+        }
+        at += dir->d_reclen;
+        if (!dir->d_ino) continue;
+
+        entries[count].name = dir->d_name;
+        entries[count].inode = dir->d_ino;
+        entries[count].type = dir->d_type;
+        entries[count].namlen = dir->d_namlen;
+        count++;
+    }
+    *offset = at;
+    return count;
+}
@@ -0,0 +1,51 @@
+/**
+ * dirscan.h
+ *
+ * Directory block scanning without a compare per entry. A lookup builds
+ * a window of the wanted d_namlen followed by the first bytes of the name
+ * and checks it against each record's with one vector compare (SSE2: 16
+ * bytes, AVX2 when built for it: 32). Names that fit the window are
+ * settled by that compare alone; longer ones only get a memcmp of the
+ * rest once it passes. Records near the end of a run, and builds without
+ * SSE2, take the scalar path, which finds the same entries.
+ * Listing pulls a run's live entries out as (inode, type, name, namlen)
+ * tuples, a batch at a time.
+ */
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "ufsread.h"
+
+#define UFS_DIRSCAN_BATCH 64            // entries per listing call, for callers' arrays
+
+struct ufs_dirent {
+    const char *name;           // d_name in the run, not NUL terminated
+    uint32_t inode;
+    uint8_t type;
+    uint8_t namlen;
+};
+
+const struct direct *ufs_dirscan_find(
+    const char *data,
+    off_t length,
+    const char *name,
+    size_t namlen
+);
+const struct direct *ufs_dirscan_find_scalar(
+    const char *data,
+    off_t length,
+    const char *name,
+    size_t namlen
+);
+size_t ufs_dirscan_list(
+    const char *data,
+    off_t length,
+    off_t *offset,
+    struct ufs_dirent *entries,
+    size_t max
+);
+
+#endif
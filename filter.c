@@ -0,0 +1,394 @@
+/**
+ * filter.c
+ */
+#define _GNU_SOURCE   // memmem on glibc
+#include <stdio.h>
+#include <stdlib.h>   // malloc
+#include <string.h>   // memcmp, memmem
+#include <fnmatch.h>
+
+#include "filter.h"
+
+static struct ufs_pred *add_pred(struct ufs_filter *filter, enum ufs_pred_kind kind, int negate);
+static int parse_number(const char *arg, struct ufs_pred *pred, int suffixes);
+static int parse_types(const char *arg, uint32_t *types);
+static int entry_pred(
+    const struct ufs_pred *pred,
+    const struct direct *dir,
+    const char *path,
+    size_t path_len
+);
+static int inode_pred(const struct ufs_pred *pred, const struct ufs2_dinode *inode, time_t now);
+static int compare(int64_t value, const struct ufs_pred *pred);
+
+int
+ufs_filter_parse(
+    struct ufs_filter *filter,
+    int argc,
+    char **argv,
+    char *error,
+    size_t error_size
+) {
+    /**
+     * Parses predicates ("-name x", "! -type d", ...), all of which have to
+     * hold. Returns -1 with a message in error on a bad one
+     */
+    memset(filter, 0, sizeof(*filter));
+    filter->maxdepth = -1;
+    filter->now = time(NULL);
+
+    int negate = 0;
+    for (int i = 0; i < argc; i++) {
+        char *name = argv[i];
+        if (!strcmp(name, "!") || !strcmp(name, "-not")) {
+            negate = !negate;
+            continue;
+        }
+        if (i + 1 == argc) {
+            snprintf(error, error_size, "%s: missing argument", name);
+            return -1;
+        }
+        char *arg = argv[++i];
+
+        struct ufs_pred *pred;
+        if (!strcmp(name, "-name") || !strcmp(name, "-path")) {
+            pred = add_pred(filter, name[1] == 'n' ? UFS_PRED_NAME : UFS_PRED_PATH, negate);
+            ufs_glob_compile(&pred->glob, arg);
+        } else if (!strcmp(name, "-regex")) {
+            // Like find, the expression has to match the whole path
+            size_t len = strlen(arg) + 5;
+            char *anchored = malloc(len);
+            if (!anchored) {
+                perror("malloc");
+                exit(1);
+            }
+            snprintf(anchored, len, "^(%s)$", arg);
+            pred = add_pred(filter, UFS_PRED_REGEX, negate);
+            int res = regcomp(&pred->regex, anchored, REG_EXTENDED | REG_NOSUB);
+            free(anchored);
+            if (res) {
+                filter->npreds--; // nothing for ufs_filter_free to regfree
+                snprintf(error, error_size, "-regex: bad expression %s", arg);
+                return -1;
+            }
+        } else if (!strcmp(name, "-type")) {
+            pred = add_pred(filter, UFS_PRED_TYPE, negate);
+            if (parse_types(arg, &pred->types) == -1) {
+                snprintf(error, error_size, "-type: bad type %s", arg);
+                return -1;
+            }
+        } else if (!strcmp(name, "-size")) {
+            pred = add_pred(filter, UFS_PRED_SIZE, negate);
+            if (parse_number(arg, pred, 1) == -1) {
+                snprintf(error, error_size, "-size: bad size %s", arg);
+                return -1;
+            }
+        } else if (!strcmp(name, "-mtime") || !strcmp(name, "-mmin")) {
+            pred = add_pred(filter, UFS_PRED_MTIME, negate);
+            pred->unit = name[2] == 't' ? 86400 : 60;
+            if (parse_number(arg, pred, 0) == -1) {
+                snprintf(error, error_size, "%s: bad age %s", name, arg);
+                return -1;
+            }
+        } else if (!strcmp(name, "-uid") || !strcmp(name, "-gid")) {
+            pred = add_pred(filter, name[1] == 'u' ? UFS_PRED_UID : UFS_PRED_GID, negate);
+            if (parse_number(arg, pred, 0) == -1) {
+                snprintf(error, error_size, "%s: bad id %s", name, arg);
+                return -1;
+            }
+        } else if (!negate && !strcmp(name, "-prune")) {
+            filter->prunes = realloc(filter->prunes, (filter->nprunes + 1) * sizeof(struct ufs_glob));
+            if (!filter->prunes) {
+                perror("realloc");
+                exit(1);
+            }
+            ufs_glob_compile(&filter->prunes[filter->nprunes++], arg);
+        } else if (!negate && (!strcmp(name, "-maxdepth") || !strcmp(name, "-mindepth"))) {
+            char *end;
+            long depth = strtol(arg, &end, 10);
+            if (*end || end == arg || depth < 0) {
+                snprintf(error, error_size, "%s: bad depth %s", name, arg);
+                return -1;
+            }
+            if (name[2] == 'a') {
+                filter->maxdepth = depth;
+            } else {
+                filter->mindepth = depth;
+            }
+        } else {
+            snprintf(error, error_size, "%s%s: unknown predicate", negate ? "! " : "", name);
+            return -1;
+        }
+        negate = 0;
+    }
+    if (negate) {
+        snprintf(error, error_size, "!: missing predicate");
+        return -1;
+    }
+
+    // Entry predicates go first so the inode is only read when it has to be
+    struct ufs_pred swap;
+    for (int i = 0; i < filter->npreds; i++) {
+        if (filter->preds[i].kind >= UFS_PRED_SIZE) continue;
+        swap = filter->preds[i];
+        memmove(&filter->preds[filter->nentry_preds + 1], &filter->preds[filter->nentry_preds],
+                (i - filter->nentry_preds) * sizeof(struct ufs_pred));
+        filter->preds[filter->nentry_preds++] = swap;
+    }
+    return 0;
+}
+
+void
+ufs_filter_free(struct ufs_filter *filter) {
+    /**
+     * Frees what ufs_filter_parse allocated, for callers that parse more
+     * than once
+     */
+    for (int i = 0; i < filter->npreds; i++) {
+        if (filter->preds[i].kind == UFS_PRED_REGEX) regfree(&filter->preds[i].regex);
+    }
+    free(filter->preds);
+    free(filter->prunes);
+    filter->preds = NULL;
+    filter->prunes = NULL;
+    filter->npreds = filter->nentry_preds = filter->nprunes = 0;
+}
+
+int
+ufs_filter_active(const struct ufs_filter *filter) {
+    return filter->npreds || filter->nprunes || filter->mindepth || filter->maxdepth >= 0;
+}
+
+int
+ufs_filter_pruned(const struct ufs_filter *filter, const char *path, size_t path_len) {
+    /**
+     * Whether path matches a -prune pattern: then it is neither printed
+     * nor, for a directory, read
+     */
+    for (int i = 0; i < filter->nprunes; i++) {
+        if (ufs_glob_match(&filter->prunes[i], path, path_len)) return 1;
+    }
+    return 0;
+}
+
+int
+ufs_filter_descend(const struct ufs_filter *filter, int depth) {
+    /**
+     * Whether the entries of a directory at depth (1 for the root's
+     * children) are wanted at all
+     */
+    return filter->maxdepth < 0 || depth < filter->maxdepth;
+}
+
+int
+ufs_filter_match(
+    const struct ufs_filter *filter,
+    const struct ufs_image *image,
+    const struct direct *dir,
+    const char *path,
+    size_t path_len,
+    int depth
+) {
+    /**
+     * Whether an entry is to be printed
+     */
+    if (depth < filter->mindepth) return 0;
+
+    int i;
+    for (i = 0; i < filter->nentry_preds; i++) {
+        if (entry_pred(&filter->preds[i], dir, path, path_len) == filter->preds[i].negate) return 0;
+    }
+    if (i == filter->npreds) return 1;
+
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, dir->d_ino, &buf);
+    for (; i < filter->npreds; i++) {
+        if (inode_pred(&filter->preds[i], inode, filter->now) == filter->preds[i].negate) break;
+    }
+    ufs_put(image, buf);
+    return i == filter->npreds;
+}
+
+int
+ufs_filter_match_inode(const struct ufs_filter *filter, const struct ufs2_dinode *inode) {
+    /**
+     * The part of ufs_filter_match that can be answered from the inode
+     * alone (type from di_mode, size, times, owner), for scans that meet
+     * inodes before their names
+     */
+    const struct ufs_pred *pred;
+    for (int i = 0; i < filter->npreds; i++) {
+        pred = &filter->preds[i];
+        if (pred->kind == UFS_PRED_TYPE) {
+            // The IFMT bits of di_mode are the DT_ value shifted up by 12
+            int type = (inode->di_mode & IFMT) >> 12;
+            if (((pred->types >> type) & 1) == pred->negate) return 0;
+        } else if (pred->kind >= UFS_PRED_SIZE) {
+            if (inode_pred(pred, inode, filter->now) == pred->negate) return 0;
+        }
+    }
+    return 1;
+}
+
+void
+ufs_glob_compile(struct ufs_glob *glob, const char *pattern) {
+    /**
+     * Picks the cheapest matcher for pattern. Only '*' is understood
+     * here; '?', '[' and '\\' leave it to fnmatch
+     */
+    size_t len = strlen(pattern);
+    glob->pattern = pattern;
+    glob->kind = UFS_GLOB_FNMATCH;
+    if (strpbrk(pattern, "?[\\")) return;
+
+    size_t start = 0, end = len;
+    while (start < len && pattern[start] == '*') start++;
+    if (start == len) {
+        glob->kind = len ? UFS_GLOB_ANY : UFS_GLOB_EXACT;
+        glob->literal = pattern;
+        glob->len = 0;
+        return;
+    }
+    while (pattern[end - 1] == '*') end--;
+    if (memchr(pattern + start, '*', end - start)) return;
+
+    glob->literal = pattern + start;
+    glob->len = end - start;
+    if (!start && end == len) {
+        glob->kind = UFS_GLOB_EXACT;
+    } else if (!start) {
+        glob->kind = UFS_GLOB_PREFIX;
+    } else if (end == len) {
+        glob->kind = UFS_GLOB_SUFFIX;
+    } else {
+        glob->kind = UFS_GLOB_CONTAINS;
+    }
+}
+
+int
+ufs_glob_match(const struct ufs_glob *glob, const char *string, size_t len) {
+    /**
+     * Matches string (NUL terminated, len bytes) against a compiled glob
+     */
+    switch (glob->kind) {
+    case UFS_GLOB_ANY:
+        return 1;
+    case UFS_GLOB_EXACT:
+        return len == glob->len && !memcmp(string, glob->literal, len);
+    case UFS_GLOB_PREFIX:
+        return len >= glob->len && !memcmp(string, glob->literal, glob->len);
+    case UFS_GLOB_SUFFIX:
+        return len >= glob->len && !memcmp(string + len - glob->len, glob->literal, glob->len);
+    case UFS_GLOB_CONTAINS:
+        return memmem(string, len, glob->literal, glob->len) != NULL;
+    default:
+        return !fnmatch(glob->pattern, string, 0);
+    }
+}
+
+static struct ufs_pred *
+add_pred(struct ufs_filter *filter, enum ufs_pred_kind kind, int negate) {
+    filter->preds = realloc(filter->preds, (filter->npreds + 1) * sizeof(struct ufs_pred));
+    if (!filter->preds) {
+        perror("realloc");
+        exit(1);
+    }
+    struct ufs_pred *pred = &filter->preds[filter->npreds++];
+    memset(pred, 0, sizeof(*pred));
+    pred->kind = kind;
+    pred->negate = negate;
+    return pred;
+}
+
+static int
+parse_number(const char *arg, struct ufs_pred *pred, int suffixes) {
+    /**
+     * Parses [+|-]N, N optionally followed by c, k, M or G when suffixes
+     * is set. +N means more than N, -N less than N
+     */
+    pred->cmp = 0;
+    if (*arg == '+') pred->cmp = 1;
+    if (*arg == '-') pred->cmp = -1;
+    if (pred->cmp) arg++;
+
+    char *end;
+    if (*arg < '0' || *arg > '9') return -1;
+    pred->value = strtoll(arg, &end, 10);
+    if (suffixes) {
+        switch (*end) {
+        case 'G': case 'g': pred->value <<= 10; /* FALLTHROUGH */
+        case 'M': case 'm': pred->value <<= 10; /* FALLTHROUGH */
+        case 'k': case 'K': pred->value <<= 10; /* FALLTHROUGH */
+        case 'c': end++; break;
+        }
+    }
+    return *end ? -1 : 0;
+}
+
+static int
+parse_types(const char *arg, uint32_t *types) {
+    /**
+     * Parses find's type letters, several separated by commas
+     */
+    *types = 0;
+    for (; *arg; arg++) {
+        switch (*arg) {
+        case 'f': *types |= 1u << DT_REG; break;
+        case 'd': *types |= 1u << DT_DIR; break;
+        case 'l': *types |= 1u << DT_LNK; break;
+        case 'c': *types |= 1u << DT_CHR; break;
+        case 'b': *types |= 1u << DT_BLK; break;
+        case 'p': *types |= 1u << DT_FIFO; break;
+        case 's': *types |= 1u << DT_SOCK; break;
+        case 'w': *types |= 1u << DT_WHT; break;
+        default: return -1;
+        }
+        if (arg[1] == ',') arg++;
+    }
+    return *types ? 0 : -1;
+}
+
+static int
+entry_pred(
+    const struct ufs_pred *pred,
+    const struct direct *dir,
+    const char *path,
+    size_t path_len
+) {
+    switch (pred->kind) {
+    case UFS_PRED_NAME:
+        return ufs_glob_match(&pred->glob, dir->d_name, dir->d_namlen);
+    case UFS_PRED_PATH:
+        return ufs_glob_match(&pred->glob, path, path_len);
+    case UFS_PRED_REGEX:
+        return !regexec(&pred->regex, path, 0, NULL, 0);
+    case UFS_PRED_TYPE:
+        return dir->d_type < 32 && ((pred->types >> dir->d_type) & 1);
+    default:
+        return 0;
+    }
+}
+
+static int
+inode_pred(const struct ufs_pred *pred, const struct ufs2_dinode *inode, time_t now) {
+    switch (pred->kind) {
+    case UFS_PRED_SIZE:
+        return compare(inode->di_size, pred);
+    case UFS_PRED_MTIME:
+        // Whole units of age, fractions dropped, as find does
+        return compare((now - inode->di_mtime) / pred->unit, pred);
+    case UFS_PRED_UID:
+        return compare(inode->di_uid, pred);
+    case UFS_PRED_GID:
+        return compare(inode->di_gid, pred);
+    default:
+        return 0;
+    }
+}
+
+static int
+compare(int64_t value, const struct ufs_pred *pred) {
+    if (pred->cmp > 0) return value > pred->value;
+    if (pred->cmp < 0) return value < pred->value;
+    return value == pred->value;
+}
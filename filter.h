@@ -0,0 +1,91 @@
+/**
+ * filter.h
+ *
+ * find(1)-style predicates evaluated during a walk. Predicates that only
+ * need the directory entry (name, path, type) are checked first, so the
+ * inode is read only for entries that got past them. Globs are compiled
+ * into exact/prefix/suffix/substring matches (memcmp/memmem) where they
+ * can be, anything fancier goes to fnmatch(3).
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <regex.h>
+#include <time.h>
+
+#include "ufsread.h"
+
+enum ufs_glob_kind {
+    UFS_GLOB_ANY,               // *
+    UFS_GLOB_EXACT,             // literal
+    UFS_GLOB_PREFIX,            // literal*
+    UFS_GLOB_SUFFIX,            // *literal
+    UFS_GLOB_CONTAINS,          // *literal*
+    UFS_GLOB_FNMATCH,           // anything else
+};
+
+struct ufs_glob {
+    enum ufs_glob_kind kind;
+    const char *pattern;        // for fnmatch
+    const char *literal;        // points into pattern
+    size_t len;
+};
+
+enum ufs_pred_kind {
+    UFS_PRED_NAME,              // glob on d_name
+    UFS_PRED_PATH,              // glob on the path from the root
+    UFS_PRED_REGEX,             // extended regex on the whole path
+    UFS_PRED_TYPE,
+    UFS_PRED_SIZE,              // needs the inode from here on
+    UFS_PRED_MTIME,
+    UFS_PRED_UID,
+    UFS_PRED_GID,
+};
+
+struct ufs_pred {
+    enum ufs_pred_kind kind;
+    int negate;
+    struct ufs_glob glob;
+    regex_t regex;
+    uint32_t types;             // bit (1 << d_type) per accepted type
+    int cmp;                    // -1 less than, 0 equal, 1 more than
+    int64_t value;
+    int64_t unit;               // seconds per unit for mtime
+};
+
+struct ufs_filter {
+    struct ufs_pred *preds;     // entry predicates first
+    int npreds, nentry_preds;
+    struct ufs_glob *prunes;
+    int nprunes;
+    int mindepth, maxdepth;     // maxdepth -1: unlimited
+    time_t now;
+};
+
+int ufs_filter_parse(
+    struct ufs_filter *filter,
+    int argc,
+    char **argv,
+    char *error,
+    size_t error_size
+);
+void ufs_filter_free(struct ufs_filter *filter);
+int ufs_filter_active(const struct ufs_filter *filter);
+int ufs_filter_pruned(const struct ufs_filter *filter, const char *path, size_t path_len);
+int ufs_filter_descend(const struct ufs_filter *filter, int depth);
+int ufs_filter_match_inode(const struct ufs_filter *filter, const struct ufs2_dinode *inode);
+int ufs_filter_match(
+    const struct ufs_filter *filter,
+    const struct ufs_image *image,
+    const struct direct *dir,
+    const char *path,
+    size_t path_len,
+    int depth
+);
+
+void ufs_glob_compile(struct ufs_glob *glob, const char *pattern);
+int ufs_glob_match(const struct ufs_glob *glob, const char *string, size_t len);
+
+#endif
@@ -2,447 +2,1021 @@
  * fs-cat.c
  */
 #include <stdio.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/uio.h>  // write
-#include <stdlib.h>   // malloc
-#include <sys/stat.h> // stat
-#include <string.h>   // strcmp
 #include <stdlib.h>   // exit
-
-#include </usr/src/sys/ufs/ffs/fs.h>
-#include </usr/src/sys/ufs/ufs/dinode.h>
-#include </usr/src/sys/ufs/ufs/dir.h>
-
-#define SINGLE 1
-#define DOUBLE 2
-
-
-void *get_inode_address(struct fs *superblock, void *partition_start, ino_t inode_num);
-void *get_data_address(struct fs *superblock, void *partition_start, int data_block);
-int check_direct_cat(struct direct *dir, char *path, int file);
-int search_directory(
-    struct fs *superblock,
-    void *partition_start,
-    ino_t inode_num,
-    char *path,
-    int num_spaces
+#include <string.h>   // strcmp
+#include <unistd.h>   // STDOUT_FILENO
+#include <getopt.h>   // getopt_long
+#include <limits.h>   // PATH_MAX
+#include <stdint.h>   // uintptr_t
+#include <errno.h>
+
+#include "ufsread.h"
+#include "ufsout.h"
+#include "ufsindex.h"
+#include "dirhash.h"
+#include "dirscan.h"
+#include "ufsstats.h"
+#include "ufshash.h"
+#include "ufstar.h"
+#include "pool.h"
+
+#define USAGE "usage: fs-cat [-j threads] [-H dirhash-minsize] [-x index] [-B backend] [--stats[=mincore]]\n" \
+              "              [--hash | --offset bytes [--length bytes] | --tail bytes] partition.img path\n" \
+              "       fs-cat [-j threads] [-H dirhash-minsize] [-x index] [-B backend] [--stats[=mincore]]\n" \
+              "              [--hash] -b list partition.img\n" \
+              "       fs-cat --dupes [-j threads] [-B backend] [--stats[=mincore]] partition.img\n" \
+              "       fs-cat --tar [-H dirhash-minsize] [-x index] [-B backend] [--stats[=mincore]]\n" \
+              "              partition.img path\n"
+
+// Long options have no short letter
+#define OPT_STATS 256
+#define OPT_HASH 257
+#define OPT_DUPES 258
+#define OPT_TAR 259
+#define OPT_OFFSET 260
+#define OPT_LENGTH 261
+#define OPT_TAIL 262
+
+static const struct option long_options[] = {
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { "hash", no_argument, NULL, OPT_HASH },
+    { "dupes", no_argument, NULL, OPT_DUPES },
+    { "tar", no_argument, NULL, OPT_TAR },
+    { "offset", required_argument, NULL, OPT_OFFSET },
+    { "length", required_argument, NULL, OPT_LENGTH },
+    { "tail", required_argument, NULL, OPT_TAIL },
+    { NULL, 0, NULL, 0 },
+};
+
+// Bytes of a file per parallel copy task; files under two of them stay serial
+#define COPY_CHUNK ((off_t)64 << 20)
+
+// One path component of the batch; children share the parent's lookup
+struct trie_node {
+    char *name;
+    size_t namlen;
+    struct trie_node *parent;
+    struct trie_node *children;     // first child
+    struct trie_node *next;         // next sibling
+    ino_t inode_num;                // 0 until resolved
+    int type;
+    int wanted;                     // on the way to a path still unresolved
+};
+
+// Requested paths in input order, and the trie they were split into
+struct batch {
+    struct ufs_arena arena;
+    struct trie_node root;
+
+    char **paths;
+    struct trie_node **nodes;
+    size_t npaths, cap;
+
+    // (parent, name) -> child, open addressing
+    struct trie_node **slots;
+    size_t nnodes, nslots;
+};
+
+// One piece of a file being copied in parallel (-j)
+struct copy_task {
+    struct ufs_image *image;
+    struct ufs2_dinode *inode;
+    off_t start, end;           // logical range of the file
+    off_t base;                 // output offset that byte 0 of the file maps to
+    int error;                  // errno of a failed write, or 0
+};
+
+/*
+ * Duplicate search (--dupes): every non-empty regular file in the image,
+ * grouped by size. Within a size, files with the same block pointers
+ * (hard links, or one file reached twice) are equal without looking, so
+ * only one of them is hashed; a size where all of them share their
+ * blocks is not hashed at all.
+ */
+struct dupe {
+    char *path;
+    ino_t inode_num;
+    off_t size;
+    uint64_t blocks_key;        // XXH64 of di_db and di_ib
+    uint64_t hash;              // of the contents, for the first of a run
+    struct dupe *same;          // earlier file with the same blocks, or NULL
+    size_t order;               // in the walk
+};
+
+struct dupes {
+    struct ufs_arena arena;     // paths
+    struct dupe *files;
+    size_t nfiles, cap;
+};
+
+// Standard out, written without going through stdio
+static struct ufs_out out;
+
+// Workers for -j, NULL when copying serially
+static struct pool *copy_pool;
+
+// Hash tables of the large directories searched so far
+static struct ufs_dirhash_cache dirhash;
+
+// --hash: print the XXH64 of each file instead of its contents
+static int hash_mode;
+
+// --tar: the path found is archived, subtree and all
+static int tar_mode;
+
+// --offset/--length/--tail: only part of the file is written (-1: unset)
+static off_t range_offset = -1, range_length = -1, range_tail = -1;
+
+// Image the --dupes hashing tasks read
+static struct ufs_image *dupes_image;
+
+int open_index(
+    struct ufs_image *image,
+    char *partition_name,
+    char *index_path,
+    struct ufs_index *index
 );
-int search_directory_blk(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num, 
-    char *path,
-    int blk_size,
-    int num_spaces
+int search_directory(struct ufs_image *image, ino_t inode_num, char *path, const char *shown);
+int lookup_entry(
+    struct ufs_image *image,
+    ino_t dir_inode,
+    const char *name,
+    size_t namlen,
+    ino_t *inode_num,
+    int *type
 );
-void print_file(struct fs *superblock, void *partition_start, ino_t inode_num);
-void print_data_block(struct fs *superblock, void *partition_start, int db_num, int size);
-int search_indirect_blocks(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
+void read_batch(struct batch *batch, FILE *list);
+struct trie_node *trie_child(struct batch *batch, struct trie_node *parent, char *name, size_t namlen);
+void resolve_children(struct ufs_image *image, struct trie_node *node);
+int print_batch(struct ufs_image *image, struct batch *batch, struct ufs_index *index);
+int parse_bytes(const char *arg, off_t *value);
+void print_file(struct ufs_image *image, ino_t inode_num);
+void file_range(struct ufs2_dinode *inode, off_t *start, off_t *end);
+void print_file_parallel(struct ufs_image *image, struct ufs2_dinode *inode, off_t start, off_t end);
+void copy_range(void *arg);
+void print_extent(struct ufs_image *image, struct ufs_extent *extent);
+void print_found(struct ufs_image *image, ino_t inode_num, const char *name);
+void print_hash(struct ufs_image *image, ino_t inode_num, const char *name);
+void find_dupes(struct ufs_image *image, int num_threads);
+void collect_files(
+    struct ufs_image *image,
+    struct dupes *dupes,
+    ino_t inode_num,
     char *path,
-    int bytes_left,
-    int indirection_type,
-    int file
-);
-
-void print_indirect_block(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int size,
-    int indirection_type
+    size_t path_len
 );
+int compare_dupes(const void *a, const void *b);
+int compare_hashes(const void *a, const void *b);
+int same_blocks(struct ufs_image *image, ino_t a, ino_t b);
+void hash_dupe(void *arg);
 
 
 int
 main (int argc, char *argv[]) {
-    // Retrieve input path
-    if (argc != 3) {
-        perror("argc != 3");
+    char *index_path = NULL;
+    char *list_path = NULL;
+    off_t dirhash_minsize = UFS_DIRHASH_MINSIZE;
+    enum ufs_backend backend = UFS_BACKEND_MMAP;
+    int opt;
+    int num_threads = 0;
+    int dupes = 0;
+    while ((opt = getopt_long(argc, argv, "b:B:H:j:x:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "mincore")) {
+                fprintf(stderr, "fs-cat: --stats only takes =mincore\n");
+                exit(1);
+            }
+            ufs_stats_enable(optarg != NULL);
+            break;
+        case OPT_HASH:
+            hash_mode = 1;
+            break;
+        case OPT_DUPES:
+            dupes = 1;
+            break;
+        case OPT_TAR:
+            tar_mode = 1;
+            break;
+        case OPT_OFFSET:
+        case OPT_LENGTH:
+        case OPT_TAIL:
+            if (parse_bytes(optarg, opt == OPT_OFFSET ? &range_offset :
+                                    opt == OPT_LENGTH ? &range_length : &range_tail) == -1) {
+                fprintf(stderr, "fs-cat: --%s takes a byte count, with k, M or G for KiB, MiB, GiB\n",
+                        opt == OPT_OFFSET ? "offset" : opt == OPT_LENGTH ? "length" : "tail");
+                exit(1);
+            }
+            break;
+        case 'b':
+            list_path = optarg;
+            break;
+        case 'B':
+            if (ufs_backend_parse(optarg, &backend) == -1) {
+                fprintf(stderr, "fs-cat: -B takes mmap, pread or aio\n");
+                exit(1);
+            }
+            break;
+        case 'H':
+            if (parse_bytes(optarg, &dirhash_minsize) == -1) {
+                fprintf(stderr, "fs-cat: -H takes a byte count, with k, M or G for KiB, MiB, GiB\n");
+                exit(1);
+            }
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "fs-cat: -j needs a positive thread count\n");
+                exit(1);
+            }
+            break;
+        case 'x':
+            index_path = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    // Retrieve input path, unless the paths come from a list
+    int ranged = range_offset >= 0 || range_length >= 0 || range_tail >= 0;
+    if (argc != (list_path || dupes ? 1 : 2) || (dupes && list_path) ||
+        (tar_mode && (list_path || dupes || hash_mode)) ||
+        (ranged && (list_path || dupes || hash_mode || tar_mode)) ||
+        (range_tail >= 0 && (range_offset >= 0 || range_length >= 0))) {
+        fprintf(stderr, USAGE);
         exit(1);
     }
-    char *partition_name = argv[1];
-    char *path = argv[2];
+    char *partition_name = argv[0];
 
-    // Open and mmap file of partition_start dump into memory
-    int fd = open(partition_name, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
+    // Open the partition dump (mapped, unless -B says otherwise)
+    struct ufs_image image;
+    ufs_stats_phase("open");
+    if (ufs_open(&image, partition_name, backend) == -1) {
+        perror(partition_name);
         exit(1);
     }
+    ufs_stats_opened(&image);
+
+    ufs_out_init(&out, STDOUT_FILENO);
+    if (dupes) {
+        find_dupes(&image, num_threads);
+        ufs_stats_phase("flush");
+        if (ufs_out_flush(&out) == -1) {
+            perror("write");
+            exit(1);
+        }
+        ufs_stats_report(stderr, &image);
+        return 0;
+    }
+    ufs_dirhash_init(&dirhash, dirhash_minsize);
+
+    // Only regular files can be written out of order; pipes stay serial
+    if (num_threads > 1 && out.sparse) {
+        copy_pool = pool_create(num_threads);
+        if (!copy_pool) {
+            perror("pool_create");
+            exit(1);
+        }
+    }
+    struct ufs_index index;
+    int have_index = open_index(&image, partition_name, index_path, &index);
+
+    int found;
+    if (list_path) {
+        // Read the whole list first so shared prefixes resolve once
+        FILE *list = strcmp(list_path, "-") ? fopen(list_path, "r") : stdin;
+        if (!list) {
+            perror(list_path);
+            exit(1);
+        }
+        struct batch batch;
+        memset(&batch, 0, sizeof(batch));
+        read_batch(&batch, list);
+        if (list != stdin) fclose(list);
 
-    // Get size of partition.img
-    struct stat file_info;
-    if (fstat(fd, &file_info) == -1) {
-        perror("fstat");
-        exit(1);
+        found = print_batch(&image, &batch, have_index ? &index : NULL);
+    } else {
+        // One probe in the path index if there is one, else walk from the root
+        char path[PATH_MAX];
+        ino_t inode_num;
+        int type;
+        char name[PATH_MAX];
+        snprintf(path, sizeof(path), "%s", argv[1]);
+        ufs_normalize_path(path);
+
+        // The archive names its entries the way fs-find prints them
+        snprintf(name, sizeof(name), "%s", *path ? path : ".");
+        const char *shown = tar_mode ? name : argv[1];
+        ufs_stats_phase("lookup");
+        if (have_index && ufs_index_lookup(&index, path, &inode_num, &type) &&
+            (type == DT_REG || tar_mode)) {
+            ufs_stats_phase("copy");
+            print_found(&image, inode_num, shown);
+            found = 1;
+        } else {
+            found = search_directory(&image, UFS_ROOTINO, path, shown);
+        }
+        if (!found) fprintf(stderr, "fs-cat: %s: no such file\n", argv[1]);
     }
-    size_t file_size = file_info.st_size;
 
-    void *partition_start = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0); 
-    if (partition_start == MAP_FAILED) {
-        perror("mmap");
+    ufs_stats_phase("flush");
+    if (ufs_out_flush(&out) == -1) {
+        perror("write");
         exit(1);
     }
-
-    // Finding the superblock and then search for path
-    struct fs *superblock = (void *)((char*)partition_start + SBLOCK_UFS2);
-    search_directory(superblock, partition_start, UFS_ROOTINO, path, 0);
+    if (copy_pool) pool_destroy(copy_pool);
+    ufs_stats_report(stderr, &image);
+    return found ? 0 : 1;
 }
 
 int
-search_directory(
-    struct fs *superblock,
-    void *partition_start,
-    ino_t inode_num,
-    char *path,
-    int file
+open_index(
+    struct ufs_image *image,
+    char *partition_name,
+    char *index_path,
+    struct ufs_index *index
 ) {
     /**
-     * Prints out full directory
+     * Maps the index fs-index wrote (index_path, or <image>.idx when it
+     * exists). Returns 0 when there is no usable index
      */
-    // Getting inode struct
-    struct ufs2_dinode *inode = get_inode_address(superblock, partition_start, inode_num);
-
-    // Getting number of direct blocks
-    int num_db = UFS_NDADDR;
-
-    // Remaining bytes of file after full blocks
-    int bytes_left = inode->di_size % superblock->fs_bsize;
-    int num_blocks = (inode->di_size / superblock->fs_bsize) + 1;
-
-    // Iterate thru direct blocks, printing this contents
-    int db_num, blk_size;
-    for (int i = 0; i < num_db; i++) {
-        db_num = inode->di_db[i];
-        if (!db_num) break;
-
-        // Setting size of block of direct we are searching
-        blk_size = i + 1 < num_blocks ? superblock->fs_bsize : bytes_left; 
-
-        if (search_directory_blk(superblock, partition_start, db_num, path, blk_size, 0))
-            return 1;
-    }
-
-    // Handling indirect blocks
-    int bytes_left_after_dbs = inode->di_size - (12 * superblock->fs_bsize);
-    if (!bytes_left_after_dbs) return 0;
-
-    if (!inode->di_ib[0]) return 0;
-    search_indirect_blocks(
-        superblock,
-        partition_start,
-        inode->di_ib[0],
-        path,
-        bytes_left_after_dbs,
-        SINGLE,
-        file
-    );
-
-    int bytes_left_after_single = bytes_left_after_dbs - (1024 * superblock->fs_bsize);
-
-    if (!inode->di_ib[1]) return 0;
-    search_indirect_blocks(
-        superblock,
-        partition_start,
-        inode->di_ib[1],
-        path,
-        bytes_left_after_single,
-        DOUBLE,
-        file
-    );
+    char default_path[PATH_MAX];
+    int explicit = index_path != NULL;
+    if (!explicit) {
+        snprintf(default_path, sizeof(default_path), "%s.idx", partition_name);
+        index_path = default_path;
+    }
 
-    return 0;
+    // A stale or broken index is ignored, we just walk instead
+    if (ufs_index_open(index, index_path, image) == -1) {
+        if (errno == ESTALE) {
+            fprintf(stderr, "fs-cat: %s: image changed since indexing, not using index\n", index_path);
+        } else if (explicit || errno != ENOENT) {
+            fprintf(stderr, "fs-cat: %s: %s, not using index\n", index_path, strerror(errno));
+        }
+        return 0;
+    }
+    return 1;
 }
 
 int
-search_directory_blk(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    char *path,
-    int blk_size,
-    int file
+search_directory(struct ufs_image *image, ino_t inode_num, char *path, const char *shown) {
+    /**
+     * Follows path one component at a time from directory inode_num and
+     * prints the file at the end (as shown, with --hash and --tar). The
+     * empty path is the root. Returns 0 when it is not there
+     */
+    ino_t next;
+    int type = DT_DIR;
+    char *name, *rest = *path ? path : NULL;
+    while ((name = strsep(&rest, "/")) != NULL) {
+        // Every component before the last has to be a directory
+        if (type != DT_DIR) return 0;
+        if (!lookup_entry(image, inode_num, name, strlen(name), &next, &type)) return 0;
+        inode_num = next;
+    }
+
+    if (type != DT_REG && !tar_mode) return 0;
+    ufs_stats_phase("copy");
+    print_found(image, inode_num, shown);
+    return 1;
+}
+
+int
+lookup_entry(
+    struct ufs_image *image,
+    ino_t dir_inode,
+    const char *name,
+    size_t namlen,
+    ino_t *inode_num,
+    int *type
 ) {
     /**
-     * Searches directory block for matching path
+     * Finds name (NUL terminated, namlen bytes) in a directory. Returns 1
+     * and fills in inode_num/type when it is there
      */
-    // Get substring we are looking at
-    char *last_char;
-    if ((last_char = strchr(path, '/')) != NULL) {
-        *last_char = '\0';
-        last_char++;
-        file = 0;
-    } else {
-        file = 1;
-    }
-
-    // Getting data
-    struct direct *dir = get_data_address(superblock, partition_start, db_num);
-
-    // Iterate thru directs, printing them
-    int res, file_found, bytes_left = blk_size;
-    while (bytes_left > 0) {
-        res = check_direct_cat(dir, path, file);
-
-        if (res == 1) { // Path matches and directory
-            file_found = search_directory(
-                            superblock,
-                            partition_start,
-                            dir->d_ino,
-                            last_char,
-                            0
-                        );
-            if (file_found) return 1;
+    // Large directories get a hash table, built once and reused
+    struct ufs_dirhash *table = ufs_dirhash_get(&dirhash, image, dir_inode);
+    if (table) {
+        const struct ufs_dirhash_slot *slot = ufs_dirhash_find(table, name, namlen);
+        if (!slot) return 0;
+        *inode_num = slot->inode;
+        *type = slot->type;
+        return 1;
+    }
+
+    // Iterate thru the directory's blocks, searching each run
+    struct ufs_buf *buf;
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir = NULL;
+    ufs_dir_begin(&iter, image, ufs_inode(image, dir_inode, &buf));
+    while (!dir && (data = ufs_dir_next(&iter, &physical, &length))) {
+        dir = ufs_dirscan_find(data, length, name, namlen);
+        if (dir) {
+            *inode_num = dir->d_ino;
+            *type = dir->d_type;
         }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    return dir != NULL;
+}
 
-        if (res == 2) { // File matches >>> print contents
-            print_file(superblock, partition_start, dir->d_ino);
-            return 1;
+void
+read_batch(struct batch *batch, FILE *list) {
+    /**
+     * Reads one path per line and threads each through the trie. The
+     * original spelling is kept for the frame header
+     */
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, list)) != -1) {
+        if (len && line[len - 1] == '\n') line[--len] = '\0';
+        if (!len) continue;
+
+        if (batch->npaths == batch->cap) {
+            batch->cap = batch->cap ? batch->cap * 2 : 1024;
+            batch->paths = realloc(batch->paths, batch->cap * sizeof(char *));
+            batch->nodes = realloc(batch->nodes, batch->cap * sizeof(struct trie_node *));
+            if (!batch->paths || !batch->nodes) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        char *path = ufs_arena_alloc(&batch->arena, len + 1);
+        memcpy(path, line, len + 1);
+
+        // The components live in a second copy, split at the slashes
+        char *components = ufs_arena_alloc(&batch->arena, len + 1);
+        memcpy(components, line, len + 1);
+        ufs_normalize_path(components);
+
+        struct trie_node *node = &batch->root;
+        char *name, *rest = components;
+        while ((name = strsep(&rest, "/")) != NULL) {
+            node = trie_child(batch, node, name, strlen(name));
         }
 
-        // Move to next direct struct and update bytes elft
-        bytes_left -= dir->d_reclen;
-        dir = (struct direct*)((char*)dir + DIRECTSIZ(dir->d_namlen));
+        batch->paths[batch->npaths] = path;
+        batch->nodes[batch->npaths] = node;
+        batch->npaths++;
     }
-    return 0;
+    free(line);
 }
 
-int
-search_indirect_blocks(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    char *path,
-    int bytes_left,
-    int indirection_type,
-    int file
-) {
+struct trie_node *
+trie_child(struct batch *batch, struct trie_node *parent, char *name, size_t namlen) {
     /**
-     * Searches indirect blocks
+     * Returns parent's child called name, adding it the first time
      */
-    // Get indirect datablock
-    ufs2_daddr_t *data = get_data_address(superblock, partition_start, db_num);
-
-    int num_db_nums = superblock->fs_bsize / 8;
-    int in_db_num, bytes_in_block, res;
-
-    for (int i = 0; i < num_db_nums; i++) {
-        if (bytes_left <= 0) return 0;
-        // Get data block number
-        in_db_num = data[i];
-
-        if (indirection_type == SINGLE) {
-            // Getting bytes in block
-            bytes_in_block = bytes_left >= superblock->fs_bsize
-                            ? superblock->fs_bsize
-                            : bytes_left;
-
-            res = search_directory_blk(
-                superblock,
-                partition_start,
-                in_db_num,
-                path,
-                bytes_left,
-                file
-            );
-
-            if (res) return 1;
-
-            bytes_left -= bytes_in_block;
+    uint32_t hash = ufs_dirhash_name(name, namlen) ^ (uint32_t)((uintptr_t)parent >> 3) * 0x9e3779b1u;
+    size_t mask = batch->nslots - 1, i;
+    if (batch->nslots) {
+        for (i = hash & mask; batch->slots[i]; i = (i + 1) & mask) {
+            struct trie_node *node = batch->slots[i];
+            if (node->parent == parent && node->namlen == namlen && !memcmp(node->name, name, namlen)) {
+                return node;
+            }
         }
+    }
 
-        if (indirection_type == DOUBLE) {
-            // Getting bytes in block
-            bytes_in_block = bytes_left >= (superblock->fs_bsize * 4096)
-                            ? superblock->fs_bsize * 4096
-                            : bytes_left;
-
-            res = search_indirect_blocks(
-                superblock,
-                partition_start,
-                in_db_num,
-                path,
-                bytes_left,
-                SINGLE,
-                file
-            );
-
-            if (res) return 1;
-
-            bytes_left -= bytes_in_block;
+    // Grow the map when it is half full, rehashing what is there
+    if ((batch->nnodes + 1) * 2 > batch->nslots) {
+        size_t new_nslots = batch->nslots ? batch->nslots * 2 : 1024;
+        struct trie_node **slots = calloc(new_nslots, sizeof(struct trie_node *));
+        if (!slots) {
+            perror("calloc");
+            exit(1);
         }
+        for (size_t n = 0; n < batch->nslots; n++) {
+            struct trie_node *node = batch->slots[n];
+            if (!node) continue;
+            uint32_t h = ufs_dirhash_name(node->name, node->namlen) ^
+                         (uint32_t)((uintptr_t)node->parent >> 3) * 0x9e3779b1u;
+            for (i = h & (new_nslots - 1); slots[i]; i = (i + 1) & (new_nslots - 1));
+            slots[i] = node;
+        }
+        free(batch->slots);
+        batch->slots = slots;
+        batch->nslots = new_nslots;
     }
 
-    return 0;
+    struct trie_node *node = ufs_arena_alloc(&batch->arena, sizeof(struct trie_node));
+    memset(node, 0, sizeof(*node));
+    node->name = name;
+    node->namlen = namlen;
+    node->parent = parent;
+    node->next = parent->children;
+    parent->children = node;
+
+    mask = batch->nslots - 1;
+    for (i = hash & mask; batch->slots[i]; i = (i + 1) & mask);
+    batch->slots[i] = node;
+    batch->nnodes++;
+    return node;
 }
 
 void
-print_file(struct fs *superblock, void *partition_start, ino_t inode_num) {
+resolve_children(struct ufs_image *image, struct trie_node *node) {
     /**
-     * Prints contents of file
+     * Looks up every child of a resolved directory node, then descends.
+     * Each directory on the requested paths is searched once per distinct
+     * name below it, never once per path
      */
-    // Get inode data
-    struct ufs2_dinode *inode = get_inode_address(superblock, partition_start, inode_num);
-
-    // Getting number of direct and indirect blocks
-    int total_num_blocks = inode->di_blocks;
-    int num_direct_blocks = total_num_blocks > 12 ? 12 : total_num_blocks;
-    int num_indirect_blocks = total_num_blocks > 12 ? total_num_blocks - 12 : 0;
-
-    // Getting data size
-    int file_size = inode->di_size;
-
-    // Handling direct blocks
-    int db_num;
-    for (int i = 0; i < num_direct_blocks; i++) {
-        db_num = inode->di_db[i];
-        if (!db_num) return;
-
-        // If we are printing remainder of file, return
-        if (file_size < superblock->fs_bsize) {
-            print_data_block(superblock, partition_start, db_num, file_size); 
-            return;
+    for (struct trie_node *child = node->children; child; child = child->next) {
+        if (!child->wanted) continue; // already answered by the index
+        if (!child->inode_num &&
+            !lookup_entry(image, node->inode_num, child->name, child->namlen,
+                          &child->inode_num, &child->type)) {
+            continue;
         }
-        print_data_block(superblock, partition_start, db_num, superblock->fs_bsize);
-        file_size -= superblock->fs_bsize;
-    }
-
-    // Handling indirect block
-    int file_size_after_dbs = file_size - (superblock->fs_bsize * 12);
-
-    if (!inode->di_ib[0]) return;
-    print_indirect_block(
-        superblock,
-        partition_start,
-        db_num,
-        file_size_after_dbs,
-        SINGLE
-    );
-
-    int file_size_after_single = file_size_after_dbs - (superblock->fs_bsize * 4096);
-
-    if (!inode->di_ib[1]) return;
-    print_indirect_block(
-        superblock,
-        partition_start,
-        db_num,
-        file_size_after_single,
-        DOUBLE
-    );
+        if (child->children && child->type == DT_DIR) resolve_children(image, child);
+    }
 }
 
-void
-print_indirect_block(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int size,
-    int indirection_type
-) {
+int
+print_batch(struct ufs_image *image, struct batch *batch, struct ufs_index *index) {
     /**
-     * Write file block data to standard out. Only size size is written
+     * Resolves the whole trie, then writes one frame per requested path in
+     * input order: a "<size> <path>\n" header followed by exactly size
+     * bytes, or "- <path>\n" when it is not a regular file in the image.
+     * With --hash a found file is just its hash line. Returns 1 when every
+     * path was found
      */
-    // Get indirect datablock
-    ufs2_daddr_t *data = get_data_address(superblock, partition_start, db_num);
+    batch->root.inode_num = UFS_ROOTINO;
+    batch->root.type = DT_DIR;
+    ufs_stats_phase("resolve");
+
+    // The index answers whole paths; the trie walk fills in what it missed
+    if (index) {
+        char path[PATH_MAX];
+        for (size_t n = 0; n < batch->npaths; n++) {
+            struct trie_node *node = batch->nodes[n];
+            if (node->inode_num) continue;
+            snprintf(path, sizeof(path), "%s", batch->paths[n]);
+            ufs_normalize_path(path);
+            ufs_index_lookup(index, path, &node->inode_num, &node->type);
+        }
+    }
+    for (size_t n = 0; n < batch->npaths; n++) {
+        if (batch->nodes[n]->inode_num) continue;
+        for (struct trie_node *node = batch->nodes[n]; node && !node->wanted; node = node->parent) {
+            node->wanted = 1;
+        }
+    }
+    resolve_children(image, &batch->root);
+
+    char header[PATH_MAX + 32];
+    int all_found = 1, len;
+    ufs_stats_phase("copy");
+    for (size_t n = 0; n < batch->npaths; n++) {
+        struct trie_node *node = batch->nodes[n];
+        if (hash_mode && node->inode_num && node->type == DT_REG) {
+            print_hash(image, node->inode_num, batch->paths[n]);
+            continue;
+        }
+        if (node->inode_num && node->type == DT_REG) {
+            struct ufs_buf *buf;
+            struct ufs2_dinode *inode = ufs_inode(image, node->inode_num, &buf);
+            len = snprintf(header, sizeof(header), "%jd %s\n", (intmax_t)inode->di_size, batch->paths[n]);
+            ufs_put(image, buf);
+        } else {
+            fprintf(stderr, "fs-cat: %s: no such file\n", batch->paths[n]);
+            len = snprintf(header, sizeof(header), "- %s\n", batch->paths[n]);
+            all_found = 0;
+        }
+        if (len >= (int)sizeof(header)) len = sizeof(header) - 1;
 
-    int num_db_nums = superblock->fs_bsize / 8;
-    int in_db_num, bytes_in_block;
-    for (int i = 0; i < num_db_nums; i++) {
-        if (size <= 0) return;
-        // Get data block number
-        in_db_num = data[i];
+        if (ufs_out_bytes(&out, header, len) == -1) {
+            perror("write");
+            exit(1);
+        }
+        if (node->inode_num && node->type == DT_REG) print_file(image, node->inode_num);
+    }
+    return all_found;
+}
 
-        if (indirection_type == SINGLE) {
-            // Getting bytes in block
-            bytes_in_block = size >= superblock->fs_bsize
-                            ? superblock->fs_bsize
-                            : size;
+int
+parse_bytes(const char *arg, off_t *value) {
+    /**
+     * Reads a byte count, in KiB, MiB or GiB with a k, M or G after it.
+     * Returns -1 when it is not one, or does not fit in an off_t
+     */
+    char *end;
+    int shift = 0;
+    if (*arg < '0' || *arg > '9') return -1;
+    errno = 0;
+    *value = strtoll(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': shift += 10; /* FALLTHROUGH */
+    case 'M': case 'm': shift += 10; /* FALLTHROUGH */
+    case 'k': case 'K': shift += 10; end++; break;
+    }
+    if (*end || errno || *value > (INT64_MAX >> shift)) return -1;
+    *value <<= shift;
+    return 0;
+}
+
+void
+print_file(struct ufs_image *image, ino_t inode_num) {
+    /**
+     * Prints contents of file (or the range asked for), one contiguous
+     * extent at a time. Holes between extents read back as zeros
+     */
+    // Get inode data, pinned until the copy is done
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+    off_t start, end;
+    file_range(inode, &start, &end);
+    if (copy_pool && end - start >= 2 * COPY_CHUNK) {
+        print_file_parallel(image, inode, start, end);
+        ufs_put(image, buf);
+        return;
+    }
 
-            print_data_block(superblock, partition_start, in_db_num, bytes_in_block);
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    off_t written = start;
+    ufs_extent_begin(&iter, image, inode);
+    ufs_extent_range(&iter, start, end);
+    while (ufs_extent_next(&iter, &extent)) {
+        if (ufs_out_zeros(&out, extent.logical - written) == -1) break;
+        print_extent(image, &extent);
+        written = extent.logical + extent.length;
+    }
+    ufs_extent_end(&iter);
+    if (ufs_out_zeros(&out, end - written) == -1) {
+        perror("write");
+        exit(1);
+    }
+    ufs_put(image, buf);
+}
 
-            size -= bytes_in_block;
-        }
+void
+file_range(struct ufs2_dinode *inode, off_t *start, off_t *end) {
+    /**
+     * The bytes of a file to write: all of them, or what --offset/--length
+     * or --tail pick, clipped to the file
+     */
+    off_t size = inode->di_size;
+    *start = 0;
+    *end = size;
+    if (range_tail >= 0) {
+        if (range_tail < size) *start = size - range_tail;
+        return;
+    }
+    if (range_offset > 0) *start = range_offset < size ? range_offset : size;
+    if (range_length >= 0 && range_length < *end - *start) *end = *start + range_length;
+}
 
-        if (indirection_type == DOUBLE) {
-            // Getting bytes in block
-            bytes_in_block = size >= (superblock->fs_bsize * 4096)
-                            ? superblock->fs_bsize * 4096
-                            : size;
+void
+print_file_parallel(struct ufs_image *image, struct ufs2_dinode *inode, off_t start, off_t end) {
+    /**
+     * Copies bytes [start, end) of a large file into the (regular) output
+     * file with COPY_CHUNK pieces spread over the pool. Each piece finds
+     * its own way down the indirect blocks and pwrites at its own offset;
+     * holes are only written where the output file had old contents. The
+     * file offset ends up after the range, as if written serially
+     */
+    if (ufs_out_flush(&out) == -1) {
+        perror("write");
+        exit(1);
+    }
+    off_t base = lseek(out.fd, 0, SEEK_CUR);
+    if (base == -1) {
+        perror("lseek");
+        exit(1);
+    }
 
-            print_indirect_block(
-                superblock, partition_start, in_db_num, bytes_in_block, SINGLE
-            );
+    size_t count = (end - start + COPY_CHUNK - 1) / COPY_CHUNK;
+    struct copy_task *tasks = calloc(count, sizeof(struct copy_task));
+    if (!tasks) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t n = 0; n < count; n++) {
+        tasks[n].image = image;
+        tasks[n].inode = inode;
+        tasks[n].start = start + n * COPY_CHUNK;
+        tasks[n].end = tasks[n].start + COPY_CHUNK < end ? tasks[n].start + COPY_CHUNK : end;
+        tasks[n].base = base - start;
+        pool_submit(copy_pool, copy_range, &tasks[n]);
+    }
+    pool_wait(copy_pool);
 
-            size -= bytes_in_block;
+    for (size_t n = 0; n < count; n++) {
+        if (tasks[n].error) {
+            errno = tasks[n].error;
+            perror("write");
+            exit(1);
         }
     }
+    free(tasks);
+
+    // A trailing hole still has to count: the final flush extends the file
+    if (lseek(out.fd, base + end - start, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(1);
+    }
+    out.extend = 1;
 }
 
 void
-print_data_block(struct fs *superblock, void *partition_start, int db_num, int size) {
+copy_range(void *arg) {
     /**
-     * Prints the data block specified by the block number
+     * Pool entry point: copies the extents of one piece of a file, and
+     * the holes between them
      */
-    // Get data block address
-    void *data = get_data_address(superblock, partition_start, db_num);
+    struct copy_task *task = arg;
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    off_t written = task->start;
+    ufs_extent_begin(&iter, task->image, task->inode);
+    ufs_extent_range(&iter, task->start, task->end);
+    while (ufs_extent_next(&iter, &extent)) {
+        if (ufs_out_pzeros(&out, extent.logical - written, task->base + written) == -1 ||
+            ufs_out_pextent(&out, task->image, extent.physical, extent.length,
+                            task->base + extent.logical) == -1) {
+            task->error = errno;
+            break;
+        }
+        written = extent.logical + extent.length;
+    }
+    if (!task->error && ufs_out_pzeros(&out, task->end - written, task->base + written) == -1) {
+        task->error = errno;
+    }
+    ufs_extent_end(&iter);
+}
 
-    // Write data
-    if (!fwrite(data, size, 1, stdout)) {
-        perror("fwrite");
+void
+print_extent(struct ufs_image *image, struct ufs_extent *extent) {
+    /**
+     * Writes one extent of file data to standard out, zero copy when the
+     * kernel can do it
+     */
+    if (ufs_out_extent(&out, image, extent->physical, extent->length) == -1) {
+        perror("write");
+        exit(1);
     }
 }
 
+void
+print_found(struct ufs_image *image, ino_t inode_num, const char *name) {
+    /**
+     * Writes out a file that was asked for: its contents, with --hash its
+     * hash line, with --tar an archive of it
+     */
+    if (tar_mode) {
+        if (ufs_tar_write(&out, image, inode_num, name) == -1) {
+            perror("write");
+            exit(1);
+        }
+    } else if (hash_mode) {
+        print_hash(image, inode_num, name);
+    } else {
+        print_file(image, inode_num);
+    }
+}
 
-int
-check_direct_cat(struct direct *dir, char *path, int file) {
-    /*
-     * Determines whether this directory describes:
-     * 0. directory and path do not match
-     * 1. directories match
-     * 2. file found
+void
+print_hash(struct ufs_image *image, ino_t inode_num, const char *name) {
+    /**
+     * Writes "<xxh64>  <name>\n", the way sha256sum and friends print
      */
-    if (!dir->d_ino || strcmp(path, dir->d_name)!= 0) return 0;
-    if (dir->d_type == DT_REG && file) return 2;
-    if (dir->d_type == DT_DIR && !file) return 1;
-    return 1;
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+    uint64_t hash = ufs_hash_file(image, inode);
+    ufs_put(image, buf);
+
+    char line[PATH_MAX + 32];
+    int len = snprintf(line, sizeof(line), "%016jx  %s\n", (uintmax_t)hash, name);
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    if (ufs_out_bytes(&out, line, len) == -1) {
+        perror("write");
+        exit(1);
+    }
 }
 
-void *
-get_inode_address(struct fs *superblock, void *partition_start, ino_t inode_num) {
+void
+find_dupes(struct ufs_image *image, int num_threads) {
     /**
-     * Takes in inode number and returns its location on partition_start
+     * Prints every set of files with the same contents as their paths, one
+     * per line, with a blank line after each set; biggest files first
      */
-    // Finding the address of inode section start in correct cylinder group
-    int cg_inode_start_frag = ino_to_fsba(superblock, inode_num);
-    int cg_inode_start_offset = lfragtosize(superblock, cg_inode_start_frag);
+    struct dupes dupes;
+    memset(&dupes, 0, sizeof(dupes));
+    char path[PATH_MAX];
+    path[0] = '\0';
+    ufs_stats_phase("walk");
+    collect_files(image, &dupes, UFS_ROOTINO, path, 0);
+    qsort(dupes.files, dupes.nfiles, sizeof(struct dupe), compare_dupes);
+
+    struct pool *pool = NULL;
+    if (num_threads > 1) {
+        pool = pool_create(num_threads);
+        if (!pool) {
+            perror("pool_create");
+            exit(1);
+        }
+    }
+    dupes_image = image;
+
+    // Runs of equal block pointers share their first file's hash
+    ufs_stats_phase("hash");
+    struct dupe *files = dupes.files, *first;
+    size_t start, end, n, distinct;
+    for (start = 0; start < dupes.nfiles; start = end) {
+        for (end = start + 1; end < dupes.nfiles && files[end].size == files[start].size; end++);
+        if (end - start < 2) continue;
+
+        distinct = 1;
+        first = &files[start];
+        for (n = start + 1; n < end; n++) {
+            if (files[n].blocks_key == first->blocks_key &&
+                same_blocks(image, files[n].inode_num, first->inode_num)) {
+                files[n].same = first;
+                continue;
+            }
+            first = &files[n];
+            distinct++;
+        }
+        if (distinct == 1) continue;
+
+        for (n = start; n < end; n++) {
+            if (files[n].same) continue;
+            if (pool) {
+                pool_submit(pool, hash_dupe, &files[n]);
+            } else {
+                hash_dupe(&files[n]);
+            }
+        }
+    }
+    if (pool) {
+        pool_wait(pool);
+        pool_destroy(pool);
+    }
 
-    // Finding the address in inode section of inode we want
-    int num_inode_in_cg = ino_to_fsbo(superblock, inode_num);
-    int inode_offset = num_inode_in_cg * sizeof(struct ufs2_dinode);
+    size_t len;
+    for (start = 0; start < dupes.nfiles; start = end) {
+        for (end = start + 1; end < dupes.nfiles && files[end].size == files[start].size; end++);
+        if (end - start < 2) continue;
 
-    int offset = cg_inode_start_offset + inode_offset;
+        for (n = start; n < end; n++) {
+            if (files[n].same) files[n].hash = files[n].same->hash;
+        }
+        qsort(files + start, end - start, sizeof(struct dupe), compare_hashes);
+
+        size_t from, to;
+        for (from = start; from < end; from = to) {
+            for (to = from + 1; to < end && files[to].hash == files[from].hash; to++);
+            if (to - from < 2) continue;
+            for (n = from; n < to; n++) {
+                len = strlen(files[n].path);
+                files[n].path[len] = '\n';
+                if (ufs_out_bytes(&out, files[n].path, len + 1) == -1 ||
+                    (n == to - 1 && ufs_out_bytes(&out, "\n", 1) == -1)) {
+                    perror("write");
+                    exit(1);
+                }
+                files[n].path[len] = '\0';
+            }
+        }
+    }
+    free(dupes.files);
+    ufs_arena_free(&dupes.arena);
+}
 
-    return (void*)((char*)partition_start + offset);
+void
+collect_files(
+    struct ufs_image *image,
+    struct dupes *dupes,
+    ino_t inode_num,
+    char *path,
+    size_t path_len
+) {
+    /**
+     * Adds every non-empty regular file below a directory, hidden ones
+     * too. path (path_len bytes, PATH_MAX long) holds its path
+     */
+    struct ufs_buf *buf, *file_buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf), *file;
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir;
+    struct dupe *dupe;
+    struct ufs_xxh64 key;
+    size_t len;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (const struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || (dir->d_type != DT_REG && dir->d_type != DT_DIR)) continue;
+            if (dir->d_name[0] == '.' && (dir->d_namlen == 1 ||
+                (dir->d_namlen == 2 && dir->d_name[1] == '.'))) continue;
+
+            len = path_len;
+            if (len + dir->d_namlen + 2 > PATH_MAX) {
+                fprintf(stderr, "fs-cat: path too long, skipping %s\n", dir->d_name);
+                continue;
+            }
+            if (len) path[len++] = '/';
+            memcpy(path + len, dir->d_name, dir->d_namlen);
+            len += dir->d_namlen;
+            path[len] = '\0';
+
+            if (dir->d_type == DT_DIR) {
+                collect_files(image, dupes, dir->d_ino, path, len);
+                continue;
+            }
+
+            file = ufs_inode(image, dir->d_ino, &file_buf);
+            if (!file->di_size) {
+                ufs_put(image, file_buf);
+                continue;
+            }
+            if (dupes->nfiles == dupes->cap) {
+                dupes->cap = dupes->cap ? dupes->cap * 2 : 1024;
+                dupes->files = realloc(dupes->files, dupes->cap * sizeof(struct dupe));
+                if (!dupes->files) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            dupe = &dupes->files[dupes->nfiles];
+            memset(dupe, 0, sizeof(*dupe));
+            dupe->path = ufs_arena_alloc(&dupes->arena, len + 1);
+            memcpy(dupe->path, path, len + 1);
+            dupe->inode_num = dir->d_ino;
+            dupe->size = file->di_size;
+            dupe->order = dupes->nfiles++;
+
+            ufs_xxh64_init(&key, 0);
+            ufs_xxh64_update(&key, file->di_db, sizeof(file->di_db));
+            ufs_xxh64_update(&key, file->di_ib, sizeof(file->di_ib));
+            dupe->blocks_key = ufs_xxh64_digest(&key);
+            ufs_put(image, file_buf);
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    path[path_len] = '\0';
 }
 
-void *
-get_data_address(struct fs *superblock, void *partition_start, int data_block) {
+int
+compare_dupes(const void *a, const void *b) {
     /**
-     * Takes in data block and returns its address in the system (relative to the buffer)
+     * Biggest first, then runs of the same blocks, then walk order
      */
-     // Finding the start of the cylinder group desired
-    int cg_num = dtog(superblock, data_block);
-    int cg_start_addr = lfragtosize(superblock, (cgbase(superblock, cg_num)));
+    const struct dupe *x = a, *y = b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    if (x->blocks_key != y->blocks_key) return x->blocks_key < y->blocks_key ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
 
-    // Finding the offset of the block number relative to the cylinder group start
-    int blknum_in_cg = dtogd(superblock, data_block);
-    int offset_of_blknum_in_cg = lfragtosize(superblock, blknum_in_cg);  
+int
+compare_hashes(const void *a, const void *b) {
+    /**
+     * Same contents together, each set in walk order
+     */
+    const struct dupe *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
 
-    int offset = offset_of_blknum_in_cg + cg_start_addr;
+int
+same_blocks(struct ufs_image *image, ino_t a, ino_t b) {
+    /**
+     * Whether two files point at the same blocks, and so hold the same
+     * bytes (they have the same size already)
+     */
+    if (a == b) return 1;
+    struct ufs_buf *a_buf, *b_buf;
+    struct ufs2_dinode *x = ufs_inode(image, a, &a_buf), *y = ufs_inode(image, b, &b_buf);
+    int same = !memcmp(x->di_db, y->di_db, sizeof(x->di_db)) &&
+               !memcmp(x->di_ib, y->di_ib, sizeof(x->di_ib));
+    ufs_put(image, b_buf);
+    ufs_put(image, a_buf);
+    return same;
+}
 
-    return (void*)((char*)partition_start + offset);
+void
+hash_dupe(void *arg) {
+    /**
+     * Pool entry point: hashes one candidate's contents
+     */
+    struct dupe *dupe = arg;
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(dupes_image, dupe->inode_num, &buf);
+    dupe->hash = ufs_hash_file(dupes_image, inode);
+    ufs_put(dupes_image, buf);
 }
@@ -0,0 +1,358 @@
+/**
+ * fs-diff.c
+ *
+ * Lists the paths that differ between two images of the same file system
+ * (say two daily snapshots) by walking both trees together. A directory
+ * whose inode is unchanged (same block pointers, size, times and modrev)
+ * has the same entries on both sides, so its blocks are read once and no
+ * names are matched; only a changed directory gets its old entries hashed
+ * by name and looked up from the new side. The subtree below it still has
+ * to be looked at: writing to a file changes the file's inode and nothing
+ * above it, so an unchanged directory says nothing about its children.
+ */
+#include <stdio.h>
+#include <stdlib.h>   // exit
+#include <string.h>   // memcmp
+#include <unistd.h>   // STDOUT_FILENO
+#include <getopt.h>   // getopt_long
+#include <limits.h>   // PATH_MAX
+
+#include "ufsread.h"
+#include "textout.h"
+#include "dirhash.h"
+#include "ufsstats.h"
+
+#define USAGE "usage: fs-diff [-0] [-B mmap|pread|aio] [--stats[=mincore]]\n" \
+              "               old.img new.img\n"
+
+// Long options have no short letter
+#define OPT_STATS 256
+
+static const struct option long_options[] = {
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { NULL, 0, NULL, 0 },
+};
+
+static struct ufs_image old_image, new_image;
+static struct ufs_text out;
+static char terminator = '\n';
+
+int inode_changed(const struct ufs2_dinode *old, const struct ufs2_dinode *new);
+int skip_direct(const char *name, size_t namlen);
+ssize_t child_path(char *path, size_t path_len, const char *name, size_t namlen);
+void emit(char change, const char *path, size_t path_len);
+void emit_tree(struct ufs_image *image, ino_t inode_num, char change, char *path, size_t path_len);
+void diff_directory(ino_t old_num, ino_t new_num, char *path, size_t path_len);
+void diff_same_entries(struct ufs2_dinode *new_dir, char *path, size_t path_len);
+void diff_entries(
+    ino_t old_num,
+    struct ufs2_dinode *old_dir,
+    struct ufs2_dinode *new_dir,
+    char *path,
+    size_t path_len
+);
+void diff_entry(
+    ino_t old_num,
+    int old_type,
+    ino_t new_num,
+    int new_type,
+    char *path,
+    size_t path_len
+);
+
+int
+main(int argc, char *argv[]) {
+    enum ufs_backend backend = UFS_BACKEND_MMAP;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "0B:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "mincore")) {
+                fprintf(stderr, "fs-diff: --stats only takes =mincore\n");
+                exit(1);
+            }
+            ufs_stats_enable(optarg != NULL);
+            break;
+        case '0':
+            terminator = '\0';
+            break;
+        case 'B':
+            if (ufs_backend_parse(optarg, &backend) == -1) {
+                fprintf(stderr, "fs-diff: -B takes mmap, pread or aio\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    ufs_stats_phase("open");
+    if (ufs_open(&old_image, argv[0], backend) == -1) {
+        perror(argv[0]);
+        exit(1);
+    }
+    if (ufs_open(&new_image, argv[1], backend) == -1) {
+        perror(argv[1]);
+        exit(1);
+    }
+    ufs_stats_opened(&new_image);
+
+    ufs_text_init(&out, STDOUT_FILENO);
+    char path[PATH_MAX];
+    path[0] = '\0';
+    ufs_stats_phase("diff");
+    diff_directory(UFS_ROOTINO, UFS_ROOTINO, path, 0);
+
+    ufs_stats_phase("flush");
+    if (ufs_text_flush(&out) == -1) {
+        perror("write");
+        exit(1);
+    }
+    ufs_stats_report(stderr, &new_image);
+    return 0;
+}
+
+int
+inode_changed(const struct ufs2_dinode *old, const struct ufs2_dinode *new) {
+    /**
+     * Whether anything but the access time differs. The block pointers
+     * double as the target of a short symlink
+     */
+    return old->di_mode != new->di_mode ||
+           old->di_uid != new->di_uid ||
+           old->di_gid != new->di_gid ||
+           old->di_flags != new->di_flags ||
+           old->di_size != new->di_size ||
+           old->di_mtime != new->di_mtime ||
+           old->di_mtimensec != new->di_mtimensec ||
+           old->di_ctime != new->di_ctime ||
+           old->di_ctimensec != new->di_ctimensec ||
+           old->di_modrev != new->di_modrev ||
+           memcmp(old->di_db, new->di_db, sizeof(old->di_db)) ||
+           memcmp(old->di_ib, new->di_ib, sizeof(old->di_ib));
+}
+
+int
+skip_direct(const char *name, size_t namlen) {
+    /**
+     * "." and "..", which are on both sides and never differ
+     */
+    return name[0] == '.' && (namlen == 1 || (namlen == 2 && name[1] == '.'));
+}
+
+ssize_t
+child_path(char *path, size_t path_len, const char *name, size_t namlen) {
+    /**
+     * Appends "/<name>" (just the name at the root) to path. Returns the
+     * new length, or -1 when it would not fit in PATH_MAX
+     */
+    size_t len = path_len;
+    if (len + namlen + 2 > PATH_MAX) {
+        fprintf(stderr, "fs-diff: path too long, skipping %.*s\n", (int)namlen, name);
+        return -1;
+    }
+    if (len) path[len++] = '/';
+    memcpy(path + len, name, namlen);
+    len += namlen;
+    path[len] = '\0';
+    return len;
+}
+
+void
+emit(char change, const char *path, size_t path_len) {
+    /**
+     * Writes one "<change> <path>" record: + added, - removed, M modified
+     */
+    ufs_text_char(&out, change);
+    ufs_text_char(&out, ' ');
+    ufs_text_bytes(&out, path, path_len);
+    ufs_text_char(&out, terminator);
+}
+
+void
+emit_tree(struct ufs_image *image, ino_t inode_num, char change, char *path, size_t path_len) {
+    /**
+     * Emits everything below a directory that is only on one side
+     */
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir;
+    ssize_t len;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (const struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || skip_direct(dir->d_name, dir->d_namlen)) continue;
+
+            len = child_path(path, path_len, dir->d_name, dir->d_namlen);
+            if (len == -1) continue;
+            emit(change, path, len);
+            if (dir->d_type == DT_DIR) emit_tree(image, dir->d_ino, change, path, len);
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    path[path_len] = '\0';
+}
+
+void
+diff_directory(ino_t old_num, ino_t new_num, char *path, size_t path_len) {
+    /**
+     * Compares the entries of a directory that is on both sides. path
+     * (path_len bytes, PATH_MAX long) holds its path, empty for the root
+     */
+    struct ufs_buf *old_buf, *new_buf;
+    struct ufs2_dinode *old_dir = ufs_inode(&old_image, old_num, &old_buf);
+    struct ufs2_dinode *new_dir = ufs_inode(&new_image, new_num, &new_buf);
+
+    if (inode_changed(old_dir, new_dir)) {
+        diff_entries(old_num, old_dir, new_dir, path, path_len);
+    } else {
+        // Same entries, but the files (and directories) they name may not be
+        diff_same_entries(new_dir, path, path_len);
+    }
+
+    ufs_put(&new_image, new_buf);
+    ufs_put(&old_image, old_buf);
+    path[path_len] = '\0';
+}
+
+void
+diff_same_entries(struct ufs2_dinode *new_dir, char *path, size_t path_len) {
+    /**
+     * Compares each entry's inodes for a directory whose blocks did not
+     * change, reading them from the new image only
+     */
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir;
+    ssize_t len;
+    ufs_dir_begin(&iter, &new_image, new_dir);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (const struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || skip_direct(dir->d_name, dir->d_namlen)) continue;
+
+            len = child_path(path, path_len, dir->d_name, dir->d_namlen);
+            if (len == -1) continue;
+            diff_entry(dir->d_ino, dir->d_type, dir->d_ino, dir->d_type, path, len);
+        }
+    }
+    ufs_dir_end(&iter);
+}
+
+void
+diff_entries(
+    ino_t old_num,
+    struct ufs2_dinode *old_dir,
+    struct ufs2_dinode *new_dir,
+    char *path,
+    size_t path_len
+) {
+    /**
+     * Matches a changed directory's entries by name: the old ones go into
+     * a dirhash table, the new ones are looked up in it as they are read
+     * and whatever is left unmatched was removed
+     */
+    struct ufs_arena arena;
+    memset(&arena, 0, sizeof(arena));
+
+    // Every entry takes at least DIRECTSIZ(1) bytes, so that many fit
+    struct ufs_dirhash *table = ufs_dirhash_create(&arena, old_num, old_dir->di_size / DIRECTSIZ(1) + 1);
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    ufs_dir_begin(&iter, &old_image, old_dir);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        ufs_dirhash_add_run(table, data, length, old_image.base ? NULL : &arena);
+    }
+    ufs_dir_end(&iter);
+
+    char *matched = ufs_arena_alloc(&arena, table->nslots);
+    memset(matched, 0, table->nslots);
+
+    const struct direct *dir;
+    const struct ufs_dirhash_slot *slot;
+    ssize_t len;
+    ufs_dir_begin(&iter, &new_image, new_dir);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (const struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || skip_direct(dir->d_name, dir->d_namlen)) continue;
+
+            len = child_path(path, path_len, dir->d_name, dir->d_namlen);
+            if (len == -1) continue;
+            slot = ufs_dirhash_find(table, dir->d_name, dir->d_namlen);
+            if (!slot) {
+                emit('+', path, len);
+                if (dir->d_type == DT_DIR) emit_tree(&new_image, dir->d_ino, '+', path, len);
+                continue;
+            }
+            matched[slot - table->slots] = 1;
+            diff_entry(slot->inode, slot->type, dir->d_ino, dir->d_type, path, len);
+        }
+    }
+    ufs_dir_end(&iter);
+
+    for (uint32_t i = 0; i < table->nslots; i++) {
+        slot = &table->slots[i];
+        if (!slot->name || matched[i] || skip_direct(slot->name, slot->namlen)) continue;
+
+        len = child_path(path, path_len, slot->name, slot->namlen);
+        if (len == -1) continue;
+        emit('-', path, len);
+        if (slot->type == DT_DIR) emit_tree(&old_image, slot->inode, '-', path, len);
+    }
+    path[path_len] = '\0';
+    ufs_arena_free(&arena);
+}
+
+void
+diff_entry(
+    ino_t old_num,
+    int old_type,
+    ino_t new_num,
+    int new_type,
+    char *path,
+    size_t path_len
+) {
+    /**
+     * Compares a name that is on both sides. A change of type is a removal
+     * and an addition; otherwise the inodes decide, and directories are
+     * compared in turn
+     */
+    if (old_type != new_type) {
+        emit('-', path, path_len);
+        if (old_type == DT_DIR) emit_tree(&old_image, old_num, '-', path, path_len);
+        emit('+', path, path_len);
+        if (new_type == DT_DIR) emit_tree(&new_image, new_num, '+', path, path_len);
+        return;
+    }
+
+    struct ufs_buf *old_buf, *new_buf;
+    struct ufs2_dinode *old_inode = ufs_inode(&old_image, old_num, &old_buf);
+    struct ufs2_dinode *new_inode = ufs_inode(&new_image, new_num, &new_buf);
+    int changed = inode_changed(old_inode, new_inode);
+    ufs_put(&new_image, new_buf);
+    ufs_put(&old_image, old_buf);
+
+    if (changed) emit('M', path, path_len);
+    if (new_type == DT_DIR) diff_directory(old_num, new_num, path, path_len);
+}
@@ -2,238 +2,706 @@
  * fs-find.c
  */
 #include <stdio.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/uio.h>  // write
-#include <stdlib.h>   // malloc
-#include <sys/stat.h> // stat
-#include <stdlib.h>   // exit
-
-#include </usr/src/sys/ufs/ffs/fs.h>
-#include </usr/src/sys/ufs/ufs/dinode.h>
-#include </usr/src/sys/ufs/ufs/dir.h>
-
-// For indirection
-#define SINGLE 1
-#define DOUBLE 2
-
-void *get_inode_address(struct fs *superblock, void *partition_start, ino_t inode_num);
-void *get_data_address(struct fs *superblock, void *partition_start, int data_block);
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memcpy
+#include <unistd.h>   // STDOUT_FILENO
+#include <getopt.h>   // getopt_long
+#include <limits.h>   // PATH_MAX
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ufsread.h"
+#include "textout.h"
+#include "filter.h"
+#include "ufsscan.h"
+#include "ufsstats.h"
+#include "pool.h"
+
+// Predicates follow the image, glibc's getopt would pull them forward
+#ifdef __GLIBC__
+#define OPTIONS "+0B:d:Jj:pSt:u"
+#else
+#define OPTIONS "0B:d:Jj:pSt:u"
+#endif
+#define USAGE "usage: fs-find [-0 | -J] [-p | -S] [-j threads] [-B mmap|pread|aio] [--stats[=mincore]]\n" \
+              "               partition.img [predicates]\n" \
+              "       fs-find -u [-d depth] [-t count] [-p] [-j threads] [-B mmap|pread|aio]\n" \
+              "               [--stats[=mincore]] partition.img\n"
+
+// Long options have no short letter
+#define OPT_STATS 256
+
+static const struct option long_options[] = {
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { NULL, 0, NULL, 0 },
+};
+
+enum format {
+    FORMAT_TREE,                // indented names, directories end in ':'
+    FORMAT_PATH,                // full paths, one per line
+    FORMAT_NUL,                 // full paths, each followed by '\0'
+    FORMAT_JSON,                // one JSON object per line
+};
+
+/*
+ * Parallel mode (-j N): every directory becomes a dir_task run on the pool.
+ * A task's output is a list of pieces, each one a chunk of text followed by
+ * the subdirectory printed right after it. The main thread walks that tree
+ * in order, so the listing is byte for byte the one the serial walk prints.
+ */
+struct piece {
+    char *text;
+    size_t len;
+    struct dir_task *child;     // subtree printed after text, or NULL
+    struct piece *next;
+};
+
+struct dir_task {
+    ino_t inode_num;
+    int num_spaces;
+    char *path;                 // the directory's own path, NULL for trees
+    size_t path_len;
+
+    // Text not yet closed off into a piece
+    struct ufs_text text;
+
+    struct piece *pieces;
+    struct piece **last_piece;
+    int done;
+};
+
+/*
+ * Scan mode (-S): each cylinder group's inode table is read in order and
+ * the inodes that pass the inode predicates are kept; directories go into
+ * the parent map on the way. Once every group is done the matches get
+ * their paths, and the rest of the predicates, one group per task again.
+ */
+struct scan_cg {
+    int cg;
+    ino_t *matches;
+    size_t nmatches, cap;
+    struct ufs_text text;
+    int done;
+};
+
+/*
+ * Du mode (-u): a directory's usage is its own plus its entries' plus its
+ * subdirectories'. Every directory is a du_task (a pool task with -j):
+ * it counts its files, starts its subdirectories and then drops its own
+ * hold on pending. A subdirectory adds its sum into the directory when it
+ * finishes, and whoever brings pending to zero, the directory or its last
+ * subdirectory, passes the directory's sum up the same way, so the
+ * reduction runs post-order without a thread ever waiting on another. Serially a task is reported and freed as soon as it is folded
+ * into its parent, so only directories still being summed have one.
+ *
+ * With -j the main thread reports the tasks in serial order, like the
+ * parallel listing, and frees each one once its line is out. Files with
+ * several links are left to it too, each task just noting them between
+ * its subdirectories, so a linked file is counted under the same name the
+ * serial walk counts it under: the first one in walk order. A slow early
+ * subtree holds up the report of everything after it, so once
+ * DU_ACTIVE_MAX tasks are started and not yet reported, workers stop
+ * submitting subdirectories and only list them; the main thread submits
+ * those when the report gets near them.
+ */
+#define DU_ACTIVE_MAX 65536
+
+struct du_link {
+    ino_t inode_num;
+    size_t before;              // subdirectories of the task ahead of it
+    uint64_t blocks, size;
+};
+
+struct du_task {
+    ino_t inode_num;
+    int depth;                  // the root's is 0
+    char *path;
+    size_t path_len;
+    struct du_task *parent;
+    struct du_task *children;   // -j: subdirectories in entry order
+    struct du_task **last_child;
+    struct du_task *next;
+    size_t nchildren;
+    atomic_int pending;         // unfinished children, plus one while read
+    int deferred;               // -j: listed but left for du_emit to submit
+
+    uint64_t blocks;            // di_blocks (512 byte units) of the subtree
+    uint64_t files;             // everything but directories
+    uint64_t largest;           // biggest di_size among those
+
+    // -j: linked files in entry order, and what the subtree got of them
+    struct du_link *links;
+    size_t nlinks, links_cap;
+    uint64_t linked_blocks, linked_files, linked_largest;
+    int listed, done;
+};
+
+// One of the -t biggest subtrees, kept in a min-heap on blocks
+struct du_top {
+    uint64_t blocks, files, largest;
+    char *path;
+};
+
+static enum format walk_format = FORMAT_TREE;
+static int walk_prefetch;
+static struct ufs_filter walk_filter;
+static struct ufs_parents walk_parents;
+static struct ufs_text out;
+static struct pool *walk_pool;
+static struct ufs_image *walk_image;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+
+static int du_depth = -1;       // report subtrees down to this depth, -1: all
+static int du_top_count;
+static struct du_top *du_top;
+static int du_top_len;
+static uint8_t *du_linked;      // hard linked files already counted
+static atomic_int du_active;    // -j: tasks submitted and not yet reported
+
 int check_direct(struct direct *dir);
+ssize_t child_path(char *path, size_t path_len, struct direct *dir);
+void prefetch_children(
+    struct ufs_image *image,
+    struct ufs2_dinode *inode,
+    char *path,
+    size_t path_len,
+    int depth
+);
 void print_directory(
-    struct fs *superblock,
-    void *partition_start,
+    struct ufs_image *image,
     ino_t inode_num,
-    int num_spaces
+    int num_spaces,
+    char *path,
+    size_t path_len,
+    struct dir_task *task
 );
-void print_directory_blk(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int blk_size,
-    int num_spaces
+void print_directory_extent(
+    struct ufs_image *image,
+    const char *data,
+    off_t length,
+    int num_spaces,
+    char *path,
+    size_t path_len,
+    struct dir_task *task
 );
-void print_indirect_block(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int bytes_left,
-    int indirection_type,
-    int num_spaces
+void print_entry(
+    struct ufs_image *image,
+    struct ufs_text *text,
+    struct direct *dir,
+    int num_spaces,
+    char *path,
+    size_t path_len
 );
+char type_letter(int type);
+struct dir_task *spawn_directory(ino_t inode_num, int num_spaces, char *path, size_t path_len);
+void run_directory(void *arg);
+void emit_directory(struct dir_task *task);
+void task_close_piece(struct dir_task *task, struct dir_task *child);
+void scan_image(struct ufs_image *image, int num_threads);
+void scan_inodes(void *arg);
+void scan_inode(void *arg, ino_t inode_num, struct ufs2_dinode *inode);
+void scan_paths(void *arg);
+int scan_visible(char *path, size_t path_len);
+void finish(struct ufs_image *image);
+void du_image(struct ufs_image *image, int num_threads);
+struct du_task *du_spawn(struct du_task *parent, ino_t inode_num, char *path, size_t path_len);
+void du_run(void *arg);
+void du_release(struct du_task *task);
+void du_finish(struct du_task *task);
+void du_add(struct du_task *task, uint64_t blocks, uint64_t files, uint64_t largest);
+void du_emit(struct du_task *task);
+struct du_task *du_resume(struct du_task *ahead, struct du_task *child);
+void du_submit(struct du_task *task);
+void du_wait(struct du_task *task, int *flag);
+void du_claim(struct du_task *task, const struct du_link *link);
+void du_report(struct du_task *task, uint64_t blocks, uint64_t files, uint64_t largest);
+void du_line(struct ufs_text *text, uint64_t blocks, uint64_t files, uint64_t largest,
+             const char *path, size_t path_len);
+void du_top_add(uint64_t blocks, uint64_t files, uint64_t largest, const char *path);
 
 int
 main (int argc, char *argv[]) {
-    if (argc != 2) {
-        perror("argc != 2");
+    enum ufs_backend backend = UFS_BACKEND_MMAP;
+    int num_threads = 0;
+    int scan = 0;
+    int du = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "mincore")) {
+                fprintf(stderr, "fs-find: --stats only takes =mincore\n");
+                exit(1);
+            }
+            ufs_stats_enable(optarg != NULL);
+            break;
+        case '0':
+            walk_format = FORMAT_NUL;
+            break;
+        case 'B':
+            if (ufs_backend_parse(optarg, &backend) == -1) {
+                fprintf(stderr, "fs-find: -B takes mmap, pread or aio\n");
+                exit(1);
+            }
+            break;
+        case 'd':
+            du_depth = atoi(optarg);
+            if (du_depth < 0) {
+                fprintf(stderr, "fs-find: -d needs a depth of 0 or more\n");
+                exit(1);
+            }
+            break;
+        case 'J':
+            walk_format = FORMAT_JSON;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "fs-find: -j needs a positive thread count\n");
+                exit(1);
+            }
+            break;
+        case 'p':
+            walk_prefetch = 1;
+            break;
+        case 'S':
+            scan = 1;
+            break;
+        case 't':
+            du_top_count = atoi(optarg);
+            if (du_top_count < 1) {
+                fprintf(stderr, "fs-find: -t needs a positive count\n");
+                exit(1);
+            }
+            break;
+        case 'u':
+            du = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    char *partition_path = argv[0];
+    if (du && (scan || argc > 1)) {
+        fprintf(stderr, "fs-find: -u takes neither -S nor predicates\n");
         exit(1);
     }
-    char *partition_path = argv[1];
 
-    // Open and mmap file of partition_start dump into memory
-    int fd = open(partition_path, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
+    // Anything after the image is a predicate; matches print as full paths
+    char error[256];
+    if (ufs_filter_parse(&walk_filter, argc - 1, argv + 1, error, sizeof(error)) == -1) {
+        fprintf(stderr, "fs-find: %s\n", error);
         exit(1);
     }
+    if ((scan || ufs_filter_active(&walk_filter)) && walk_format == FORMAT_TREE) {
+        walk_format = FORMAT_PATH;
+    }
+
+    // aio only pays off with something to batch: the -p prefetches
+    if (backend == UFS_BACKEND_AIO) walk_prefetch = 1;
 
-    // Get size of partition.img
-    struct stat file_info;
-    if (fstat(fd, &file_info) == -1) {
-        perror("fstat");
+    // Open the partition dump (mapped, unless -B says otherwise)
+    struct ufs_image image;
+    ufs_stats_phase("open");
+    if (ufs_open(&image, partition_path, backend) == -1) {
+        perror(partition_path);
         exit(1);
     }
-    size_t file_size = file_info.st_size;
+    ufs_stats_opened(&image);
 
-    // mmaping entire partition dump
-    void *partition_start = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0); 
-    if (partition_start == MAP_FAILED) {
-        perror("mmap");
+    // Printing contents of root inode
+    ufs_text_init(&out, STDOUT_FILENO);
+    if (du) {
+        du_image(&image, num_threads);
+        finish(&image);
+        return 0;
+    }
+    if (scan) {
+        scan_image(&image, num_threads);
+        finish(&image);
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    path[0] = '\0';
+    if (!ufs_filter_descend(&walk_filter, 0)) {
+        finish(&image);
+        return 0;
+    }
+    ufs_stats_phase("walk");
+    if (!num_threads) {
+        print_directory(&image, UFS_ROOTINO, 0, path, 0, NULL);
+        finish(&image);
+        return 0;
+    }
+
+    // Parallel walk: workers fill per-subtree buffers, we stitch them in order
+    walk_image = &image;
+    walk_pool = pool_create(num_threads);
+    if (!walk_pool) {
+        perror("pool_create");
         exit(1);
     }
 
-    // Finding the superblock and then printing contents of root inode
-    struct fs *superblock = (void *)((char*)partition_start + SBLOCK_UFS2);
-    print_directory(superblock, partition_start, UFS_ROOTINO, 0);
+    struct dir_task *root = spawn_directory(UFS_ROOTINO, 0, path, 0);
+    emit_directory(root);
+
+    pool_destroy(walk_pool);
+    finish(&image);
+    return 0;
+}
+
+void
+finish(struct ufs_image *image) {
+    /**
+     * Writes out what is still buffered, then the --stats report
+     */
+    ufs_stats_phase("flush");
+    if (ufs_text_flush(&out) == -1) {
+        perror("write");
+        exit(1);
+    }
+    ufs_stats_report(stderr, image);
 }
 
 void
 print_directory(
-    struct fs *superblock,
-    void *partition_start,
+    struct ufs_image *image,
     ino_t inode_num,
-    int num_spaces
+    int num_spaces,
+    char *path,
+    size_t path_len,
+    struct dir_task *task
 ) {
     /**
-     * Prints out full directory
+     * Prints out full directory. path (path_len bytes, PATH_MAX long)
+     * holds the directory's own path; the entries' paths are built on it
      */
     // Getting inode struct
-    struct ufs2_dinode *inode = get_inode_address(
-                                    superblock,
-                                    partition_start,
-                                    inode_num
-                                );
-
-    // Getting number of direct blocks
-    int num_db = UFS_NDADDR;
-
-    // remaining bytes of directory after full blocks
-    int bytes_left = inode->di_size % superblock->fs_bsize;
-    int num_blocks =  (inode->di_size / superblock->fs_bsize) + 1;
-
-    // Iterate thru direct blocks, printing this contents
-    int db_num, blk_size;
-    for (int i = 0; i < num_db; i++) {
-        db_num = inode->di_db[i];
-        if (!db_num) return;
-
-        // Setting size of block of direct we are printing
-        blk_size = i + 1 < num_blocks  ? superblock->fs_bsize : bytes_left;
-
-        print_directory_blk(superblock, partition_start, db_num, blk_size, num_spaces);
-    }
-    printf("after direct blocksi\n");
-    int bytes_left_after_dbs = inode->di_size - (12 * superblock->fs_bsize);
-    if (!bytes_left_after_dbs) return;
-
-    printf("Indirect blocks\n");
-    return;
-
-    // Handling indirect blocks
-    if (!inode->di_ib[0]) return;
-    print_indirect_block(
-        superblock,
-        partition_start,
-        inode->di_ib[0],
-        bytes_left_after_dbs,
-        SINGLE,
-        num_spaces
-    );
-
-    int bytes_left_after_single = bytes_left_after_dbs - (1024 * superblock->fs_bsize);
-
-    if (!inode->di_ib[1]) return;
-    print_indirect_block(
-        superblock,
-        partition_start,
-        inode->di_ib[1],
-        bytes_left_after_single,
-        DOUBLE,
-        num_spaces
-    );
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+    if (walk_prefetch) prefetch_children(image, inode, path, path_len, num_spaces / 4 + 1);
+
+    // Iterate thru the directory's blocks, printing their contents
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        print_directory_extent(image, data, length, num_spaces, path, path_len, task);
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
 }
 
 void
-print_directory_blk(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int blk_size,
-    int num_spaces
+print_directory_extent(
+    struct ufs_image *image,
+    const char *data,
+    off_t length,
+    int num_spaces,
+    char *path,
+    size_t path_len,
+    struct dir_task *task
 ) {
     /**
-     * Prints directories in specified block
+     * Prints directories in a contiguous run of directory blocks
      */
-    // Getting data (directories)
-    struct direct *dir = get_data_address(superblock, partition_start, db_num);
+    struct ufs_text *text = task ? &task->text : &out;
+    int depth = num_spaces / 4 + 1; // of the entries, the root's are at 1
+    int filtering = ufs_filter_active(&walk_filter);
 
     // Iterate thru directs, printing them
-    int res, bytes_left = blk_size;
-    while (bytes_left > 0) {
+    struct direct *dir;
+    ssize_t len = path_len;
+    int res;
+    for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+        dir = (struct direct*)(data + offset);
+        if (!dir->d_reclen) break; // corrupt block, don't spin
+
         res = check_direct(dir);
+        if (!res) continue;
 
-        if (res == 1) { // Prints file name
-            printf("%*s%s\n", num_spaces, "", dir->d_name);
+        // Only the path formats need "<path>/<name>"
+        if (walk_format != FORMAT_TREE) {
+            len = child_path(path, path_len, dir);
+            if (len < 0) {
+                fprintf(stderr, "fs-find: path too long, skipping %s\n", dir->d_name);
+                continue;
+            }
         }
 
-        if (res == 2) { // Prints directory name and then its contents
-            printf("%*s%s:\n", num_spaces, "", dir->d_name);
-            print_directory(superblock, partition_start, dir->d_ino, num_spaces+4);
+        // Name and type are checked here, the inode only if those pass
+        if (filtering) {
+            if (ufs_filter_pruned(&walk_filter, path, len)) continue;
+            if (ufs_filter_match(&walk_filter, image, dir, path, len, depth)) {
+                print_entry(image, text, dir, num_spaces, path, len);
+            }
+            if (!ufs_filter_descend(&walk_filter, depth)) res = 1;
+        } else {
+            print_entry(image, text, dir, num_spaces, path, len);
         }
 
-        // Update bytes_left and move to next direct struct
-        bytes_left -= dir->d_reclen;
-        dir = (struct direct*)((char*)dir + DIRECTSIZ(dir->d_namlen));
+        if (res == 2) { // Prints directory contents after its name
+            if (task) {
+                // Subtree goes to the pool, its output lands after this line
+                task_close_piece(task, spawn_directory(dir->d_ino, num_spaces+4, path, len));
+            } else {
+                print_directory(image, dir->d_ino, num_spaces+4, path, len, NULL);
+            }
+        }
     }
+    path[path_len] = '\0';
 }
 
 void
-print_indirect_block(
-    struct fs *superblock,
-    void *partition_start,
-    int db_num,
-    int bytes_left,
-    int indirection_type,
-    int num_spaces
+print_entry(
+    struct ufs_image *image,
+    struct ufs_text *text,
+    struct direct *dir,
+    int num_spaces,
+    char *path,
+    size_t path_len
 ) {
     /**
-     * Prints indirect blocks
+     * Appends one entry in the chosen format. Only JSON reads the inode
      */
-    // Get indirect datablock
-    ufs2_daddr_t *data = get_data_address(superblock, partition_start, db_num);
-
-    int num_db_nums = superblock->fs_bsize / 8;
-    int in_db_num, bytes_in_block;
-    for (int i = 0; i < num_db_nums; i++) {
-        if (bytes_left <= 0) return;
-        // Get data block number
-        in_db_num = data[i];
-
-        if (indirection_type == SINGLE) {
-            // Getting bytes in block
-            bytes_in_block = bytes_left >= superblock->fs_bsize 
-                            ? superblock->fs_bsize 
-                            : bytes_left;
-
-            print_directory_blk(
-                superblock,
-                partition_start,
-                in_db_num,
-                bytes_in_block,
-                num_spaces
-            );
-
-            bytes_left -= bytes_in_block;
+    if (walk_format == FORMAT_TREE) {
+        ufs_text_spaces(text, num_spaces);
+        ufs_text_bytes(text, dir->d_name, dir->d_namlen);
+        if (dir->d_type == DT_DIR) ufs_text_char(text, ':');
+        ufs_text_char(text, '\n');
+        return;
+    }
+    if (walk_format == FORMAT_PATH) {
+        ufs_text_bytes(text, path, path_len);
+        ufs_text_char(text, '\n');
+        return;
+    }
+    if (walk_format == FORMAT_NUL) {
+        ufs_text_bytes(text, path, path_len + 1);
+        return;
+    }
+
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, dir->d_ino, &buf);
+    char type[] = { '"', type_letter(dir->d_type), '"' };
+    ufs_text_bytes(text, "{\"path\":", 8);
+    ufs_text_json(text, path, path_len);
+    ufs_text_bytes(text, ",\"ino\":", 7);
+    ufs_text_uint(text, dir->d_ino);
+    ufs_text_bytes(text, ",\"type\":", 8);
+    ufs_text_bytes(text, type, sizeof(type));
+    ufs_text_bytes(text, ",\"size\":", 8);
+    ufs_text_uint(text, inode->di_size);
+    ufs_text_bytes(text, ",\"mtime\":", 9);
+    ufs_text_int(text, inode->di_mtime);
+    ufs_text_bytes(text, "}\n", 2);
+    ufs_put(image, buf);
+}
+
+char
+type_letter(int type) {
+    /**
+     * find(1)'s -type letter for a d_type
+     */
+    switch (type) {
+    case DT_REG: return 'f';
+    case DT_DIR: return 'd';
+    case DT_LNK: return 'l';
+    case DT_CHR: return 'c';
+    case DT_BLK: return 'b';
+    case DT_FIFO: return 'p';
+    case DT_SOCK: return 's';
+    case DT_WHT: return 'w';
+    default: return '?';
+    }
+}
+
+ssize_t
+child_path(char *path, size_t path_len, struct direct *dir) {
+    /**
+     * Appends "/<name>" (just the name at the root) to path. Returns the
+     * new length, or -1 when it would not fit in PATH_MAX
+     */
+    size_t len = path_len;
+    if (len + dir->d_namlen + 2 > PATH_MAX) return -1;
+    if (len) path[len++] = '/';
+    memcpy(path + len, dir->d_name, dir->d_namlen);
+    len += dir->d_namlen;
+    path[len] = '\0';
+    return len;
+}
+
+void
+prefetch_children(
+    struct ufs_image *image,
+    struct ufs2_dinode *inode,
+    char *path,
+    size_t path_len,
+    int depth
+) {
+    /**
+     * Gets the subdirectories of a directory read ahead of the walk. Their
+     * inodes are sorted into cylinder group order and their inode blocks
+     * prefetched, then the inodes are read in that order (near sequential
+     * instead of one random fault each) and their direct blocks prefetched.
+     * Children at depth that the walk will not enter are left alone
+     */
+    if (!ufs_filter_descend(&walk_filter, depth)) return;
+
+    ino_t *children = NULL;
+    size_t count = 0, cap = 0;
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    struct direct *dir;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (struct direct*)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (check_direct(dir) != 2) continue;
+            if (walk_filter.nprunes) {
+                ssize_t len = child_path(path, path_len, dir);
+                if (len < 0 || ufs_filter_pruned(&walk_filter, path, len)) continue;
+            }
+
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                children = realloc(children, cap * sizeof(ino_t));
+                if (!children) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            children[count++] = dir->d_ino;
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_prefetch_inodes(image, children, count);
+
+    // Directory blocks are prefetched a whole run of them at a time
+    struct fs *superblock = image->superblock;
+    struct ufs_buf *buf;
+    for (size_t n = 0; n < count; n++) {
+        struct ufs2_dinode *child = ufs_inode(image, children[n], &buf);
+        ufs_lbn_t blocks = lblkno(superblock, (off_t)child->di_size + superblock->fs_bsize - 1);
+        off_t start = -1, end = -1, block;
+        for (ufs_lbn_t lbn = 0; lbn < blocks && lbn < UFS_NDADDR; lbn++) {
+            if (!child->di_db[lbn]) continue;
+            block = ufs_block_offset(superblock, child->di_db[lbn]);
+            if (block == end) {
+                end += superblock->fs_bsize;
+                continue;
+            }
+            if (start >= 0) ufs_prefetch(image, start, end - start);
+            start = block;
+            end = block + superblock->fs_bsize;
         }
+        if (start >= 0) ufs_prefetch(image, start, end - start);
+        ufs_put(image, buf);
+    }
+    path[path_len] = '\0';
+    free(children);
+}
 
-        if (indirection_type == DOUBLE) {
-            // Getting bytes in block
-            bytes_in_block = bytes_left >= (superblock->fs_bsize * 4096)
-                            ? superblock->fs_bsize * 4096
-                            : bytes_left;
-
-            print_indirect_block(
-                superblock,
-                partition_start,
-                db_num,
-                bytes_left,
-                SINGLE,
-                num_spaces
-            );
-
-            bytes_left -= bytes_in_block;
+struct dir_task *
+spawn_directory(ino_t inode_num, int num_spaces, char *path, size_t path_len) {
+    /**
+     * Creates the task for a subdirectory and hands it to the pool
+     */
+    struct dir_task *task = calloc(1, sizeof(struct dir_task));
+    if (!task) {
+        perror("calloc");
+        exit(1);
+    }
+    task->inode_num = inode_num;
+    task->num_spaces = num_spaces;
+    task->last_piece = &task->pieces;
+    ufs_text_init(&task->text, -1);
+    if (walk_format != FORMAT_TREE) {
+        task->path = malloc(path_len + 1);
+        if (!task->path) {
+            perror("malloc");
+            exit(1);
         }
+        memcpy(task->path, path, path_len + 1);
+        task->path_len = path_len;
+    }
+
+    pool_submit(walk_pool, run_directory, task);
+    return task;
+}
+
+void
+run_directory(void *arg) {
+    /**
+     * Pool entry point: lists one directory into its own buffers
+     */
+    struct dir_task *task = arg;
+    char path[PATH_MAX];
+    if (task->path) memcpy(path, task->path, task->path_len + 1);
+    print_directory(walk_image, task->inode_num, task->num_spaces, path, task->path_len, task);
+    task_close_piece(task, NULL);
+
+    pthread_mutex_lock(&done_lock);
+    task->done = 1;
+    pthread_cond_broadcast(&done_cv);
+    pthread_mutex_unlock(&done_lock);
+}
+
+void
+emit_directory(struct dir_task *task) {
+    /**
+     * Writes a finished subtree to stdout in serial order, freeing as it goes
+     */
+    pthread_mutex_lock(&done_lock);
+    while (!task->done) {
+        pthread_cond_wait(&done_cv, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+
+    struct piece *piece = task->pieces, *next;
+    while (piece) {
+        ufs_text_bytes(&out, piece->text, piece->len);
+        if (piece->child) emit_directory(piece->child);
+
+        next = piece->next;
+        free(piece->text);
+        free(piece);
+        piece = next;
+    }
+    free(task->path);
+    free(task);
+}
+
+void
+task_close_piece(struct dir_task *task, struct dir_task *child) {
+    /**
+     * Moves the pending text into a piece followed by child's subtree
+     */
+    struct piece *piece = malloc(sizeof(struct piece));
+    if (!piece) {
+        perror("malloc");
+        exit(1);
     }
+    piece->text = ufs_text_take(&task->text, &piece->len);
+    piece->child = child;
+    piece->next = NULL;
+
+    *task->last_piece = piece;
+    task->last_piece = &piece->next;
 }
 
 int
@@ -249,38 +717,531 @@ check_direct(struct direct *dir) {
     return 1;
 }
 
-void *
-get_inode_address(struct fs *superblock, void *partition_start, ino_t inode_num) {
+void
+scan_image(struct ufs_image *image, int num_threads) {
+    /**
+     * Lists what the predicates select by scanning the inode tables,
+     * num_threads cylinder groups at a time (or serially for 0). Output
+     * is in inode number order
+     */
+    struct fs *superblock = image->superblock;
+    struct scan_cg *scans = calloc(superblock->fs_ncg, sizeof(struct scan_cg));
+    if (!scans || ufs_parents_init(&walk_parents, image) == -1) {
+        perror("calloc");
+        exit(1);
+    }
+    walk_image = image;
+    if (num_threads) {
+        walk_pool = pool_create(num_threads);
+        if (!walk_pool) {
+            perror("pool_create");
+            exit(1);
+        }
+    }
+
+    // The parent map has to be complete before any path is put together
+    ufs_stats_phase("scan inodes");
+    for (int c = 0; c < superblock->fs_ncg; c++) {
+        scans[c].cg = c;
+        ufs_text_init(&scans[c].text, -1);
+        if (num_threads) {
+            pool_submit(walk_pool, scan_inodes, &scans[c]);
+        } else {
+            scan_inodes(&scans[c]);
+        }
+    }
+    if (num_threads) pool_wait(walk_pool);
+
+    ufs_stats_phase("scan paths");
+    for (int c = 0; c < superblock->fs_ncg; c++) {
+        if (num_threads) {
+            pool_submit(walk_pool, scan_paths, &scans[c]);
+        } else {
+            scan_paths(&scans[c]);
+        }
+    }
+
+    // Write each group out as soon as it and those before it are done
+    char *text;
+    size_t len;
+    for (int c = 0; c < superblock->fs_ncg; c++) {
+        pthread_mutex_lock(&done_lock);
+        while (!scans[c].done) {
+            pthread_cond_wait(&done_cv, &done_lock);
+        }
+        pthread_mutex_unlock(&done_lock);
+
+        text = ufs_text_take(&scans[c].text, &len);
+        ufs_text_bytes(&out, text, len);
+        free(text);
+        free(scans[c].matches);
+    }
+
+    if (num_threads) pool_destroy(walk_pool);
+    ufs_parents_free(&walk_parents);
+    free(scans);
+}
+
+void
+scan_inodes(void *arg) {
+    /**
+     * First pass over one cylinder group
+     */
+    struct scan_cg *scan = arg;
+    if (ufs_scan_cg(walk_image, scan->cg, scan_inode, scan) == -1) {
+        fprintf(stderr, "fs-find: cylinder group %d: bad header, skipped\n", scan->cg);
+    }
+}
+
+void
+scan_inode(void *arg, ino_t inode_num, struct ufs2_dinode *inode) {
+    /**
+     * Keeps an inode if its own fields match, and maps a directory's
+     * entries back to it
+     */
+    struct scan_cg *scan = arg;
+    if (inode_num < UFS_ROOTINO || !inode->di_mode) return;
+    if ((inode->di_mode & IFMT) == IFDIR) {
+        ufs_parents_add_dir(&walk_parents, walk_image, inode_num, inode);
+    }
+    if (inode_num == UFS_ROOTINO || !ufs_filter_match_inode(&walk_filter, inode)) return;
+
+    if (scan->nmatches == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 256;
+        scan->matches = realloc(scan->matches, scan->cap * sizeof(ino_t));
+        if (!scan->matches) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    scan->matches[scan->nmatches++] = inode_num;
+}
+
+void
+scan_paths(void *arg) {
+    /**
+     * Second pass over one cylinder group: names the matches and checks
+     * what needs a name
+     */
+    struct scan_cg *scan = arg;
+    char path[PATH_MAX];
+    const struct direct *dir;
+    struct ufs_buf *buf;
+    ssize_t len;
+    int depth;
+    for (size_t n = 0; n < scan->nmatches; n++) {
+        len = ufs_parents_path(&walk_parents, walk_image, scan->matches[n], path, sizeof(path), &depth);
+        if (len < 0) continue; // not linked from the root
+        if (!scan_visible(path, len) || !ufs_filter_descend(&walk_filter, depth - 1)) continue;
+
+        dir = ufs_parents_entry(&walk_parents, walk_image, scan->matches[n], &buf);
+        if (ufs_filter_match(&walk_filter, walk_image, dir, path, len, depth)) {
+            print_entry(walk_image, &scan->text, (struct direct *)dir, 0, path, len);
+        }
+        ufs_put(walk_image, buf);
+    }
+
+    pthread_mutex_lock(&done_lock);
+    scan->done = 1;
+    pthread_cond_broadcast(&done_cv);
+    pthread_mutex_unlock(&done_lock);
+}
+
+int
+scan_visible(char *path, size_t path_len) {
+    /**
+     * Whether the walk would get to path: no component is hidden and
+     * neither it nor a directory above it is pruned
+     */
+    for (size_t i = 0; i <= path_len; i++) {
+        if ((i == 0 || path[i - 1] == '/') && path[i] == '.') return 0;
+        if (i < path_len && path[i] != '/') continue;
+        if (!walk_filter.nprunes) continue;
+
+        char c = path[i];
+        path[i] = '\0';
+        int pruned = ufs_filter_pruned(&walk_filter, path, i);
+        path[i] = c;
+        if (pruned) return 0;
+    }
+    return 1;
+}
+
+void
+du_image(struct ufs_image *image, int num_threads) {
     /**
-     * Takes in inode number and returns its location on partition_start
+     * Prints the usage of every directory down to du_depth, children before
+     * their parent like du(1), or with -t the biggest of them, biggest first
      */
-    // Finding the address of inode section start in correct cylinder group
-    int cg_inode_start_frag = ino_to_fsba(superblock, inode_num);
-    int cg_inode_start_offset = lfragtosize(superblock, cg_inode_start_frag);
+    struct fs *superblock = image->superblock;
+    size_t ninodes = (size_t)superblock->fs_ncg * superblock->fs_ipg;
+    du_linked = calloc(ninodes / 8 + 1, 1);
+    if (du_top_count) du_top = calloc(du_top_count, sizeof(struct du_top));
+    if (!du_linked || (du_top_count && !du_top)) {
+        perror("calloc");
+        exit(1);
+    }
+    walk_image = image;
+    if (num_threads) {
+        walk_pool = pool_create(num_threads);
+        if (!walk_pool) {
+            perror("pool_create");
+            exit(1);
+        }
+    }
 
-    // Finding the address in inode section of inode we want
-    int num_inode_in_cg = ino_to_fsbo(superblock, inode_num);
-    int inode_offset = num_inode_in_cg * sizeof(struct ufs2_dinode);
+    ufs_stats_phase("du");
+    char path[PATH_MAX];
+    path[0] = '\0';
+    struct du_task *root = du_spawn(NULL, UFS_ROOTINO, path, 0);
 
-    int offset = cg_inode_start_offset + inode_offset;
+    // Serially the lines went straight out; in parallel they go out here
+    if (walk_pool) {
+        du_emit(root);
+        pool_destroy(walk_pool);
+    }
 
-    return (void*)((char*)partition_start + offset);
+    // Heap order to biggest first
+    struct du_top entry;
+    for (int n = du_top_len - 1; n > 0; n--) {
+        entry = du_top[0];
+        du_top[0] = du_top[n];
+        du_top[n] = entry;
+        for (int i = 0, child; (child = 2 * i + 1) < n; i = child) {
+            if (child + 1 < n && du_top[child + 1].blocks < du_top[child].blocks) child++;
+            if (du_top[i].blocks <= du_top[child].blocks) break;
+            entry = du_top[i];
+            du_top[i] = du_top[child];
+            du_top[child] = entry;
+        }
+    }
+    for (int n = 0; n < du_top_len; n++) {
+        du_line(&out, du_top[n].blocks, du_top[n].files, du_top[n].largest,
+                du_top[n].path, strlen(du_top[n].path));
+        free(du_top[n].path);
+    }
+    free(du_top);
+    free((void *)du_linked);
 }
 
-void *
-get_data_address(struct fs *superblock, void *partition_start, int data_block) {
+struct du_task *
+du_spawn(struct du_task *parent, ino_t inode_num, char *path, size_t path_len) {
     /**
-     * Takes in data block and returns its address in the system (relative to the buffer)
+     * Creates the task for a directory and runs it, on the pool if there
+     * is one and it is not full. The parent's pending count must already
+     * include it. Serially the task is gone by the time this returns
      */
-    // Finding the start of the cylinder group desired
-    int cg_num = dtog(superblock, data_block);
-    int cg_start_addr = lfragtosize(superblock, (cgbase(superblock, cg_num)));
+    struct du_task *task = calloc(1, sizeof(struct du_task));
+    if (!task || !(task->path = malloc(path_len + 1))) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(task->path, path, path_len + 1);
+    task->path_len = path_len;
+    task->inode_num = inode_num;
+    task->depth = parent ? parent->depth + 1 : 0;
+    task->parent = parent;
+    task->last_child = &task->children;
+    atomic_init(&task->pending, 1);
 
-    // Finding the offset of the block number relative to the cylinder group start
-    int blknum_in_cg = dtogd(superblock, data_block);
-    int offset_of_blknum_in_cg = lfragtosize(superblock, blknum_in_cg);  
+    if (!walk_pool) {
+        du_run(task);
+        return NULL;
+    }
+    if (parent && atomic_load(&du_active) >= DU_ACTIVE_MAX) {
+        task->deferred = 1;
+    } else {
+        du_submit(task);
+    }
+    return task;
+}
 
-    int offset = offset_of_blknum_in_cg + cg_start_addr;
+void
+du_submit(struct du_task *task) {
+    /**
+     * Hands a task to the pool, counting it until du_emit frees it
+     */
+    atomic_fetch_add(&du_active, 1);
+    pool_submit(walk_pool, du_run, task);
+}
 
-    return (void*)((char*)partition_start + offset);
+void
+du_run(void *arg) {
+    /**
+     * Adds up one directory's own blocks and its files, and starts its
+     * subdirectories. Hard linked files count once, under the name the
+     * walk gets to first; with -j du_emit decides that
+     */
+    struct du_task *task = arg;
+    struct ufs_image *image = walk_image;
+    char path[PATH_MAX];
+    memcpy(path, task->path, task->path_len + 1);
+
+    // Subdirectories fold into task as they finish, so these add up apart
+    struct ufs_buf *buf, *child_buf;
+    struct ufs2_dinode *inode = ufs_inode(image, task->inode_num, &buf), *child;
+    uint64_t blocks = inode->di_blocks, files = 0, largest = 0;
+    if (walk_prefetch) prefetch_children(image, inode, path, task->path_len, task->depth + 1);
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    struct direct *dir;
+    struct du_task *sub;
+    ssize_t len;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (struct direct*)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino) continue;
+            if (dir->d_name[0] == '.' && (dir->d_namlen == 1 ||
+                (dir->d_namlen == 2 && dir->d_name[1] == '.'))) continue;
+
+            if (dir->d_type == DT_DIR) {
+                len = child_path(path, task->path_len, dir);
+                if (len < 0) {
+                    fprintf(stderr, "fs-find: path too long, skipping %s\n", dir->d_name);
+                    continue;
+                }
+                atomic_fetch_add(&task->pending, 1);
+                sub = du_spawn(task, dir->d_ino, path, len);
+                if (sub) {
+                    *task->last_child = sub;
+                    task->last_child = &sub->next;
+                }
+                task->nchildren++;
+                continue;
+            }
+
+            child = ufs_inode(image, dir->d_ino, &child_buf);
+            if (child->di_nlink >= 2 && walk_pool) {
+                if (task->nlinks == task->links_cap) {
+                    task->links_cap = task->links_cap ? task->links_cap * 2 : 16;
+                    task->links = realloc(task->links, task->links_cap * sizeof(struct du_link));
+                    if (!task->links) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                task->links[task->nlinks++] = (struct du_link){
+                    dir->d_ino, task->nchildren, child->di_blocks, child->di_size
+                };
+            } else if (child->di_nlink < 2 || !isset(du_linked, dir->d_ino)) {
+                if (child->di_nlink >= 2) setbit(du_linked, dir->d_ino);
+                blocks += child->di_blocks;
+                files++;
+                if (child->di_size > largest) largest = child->di_size;
+            }
+            ufs_put(image, child_buf);
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+
+    if (walk_pool) {
+        pthread_mutex_lock(&done_lock);
+        du_add(task, blocks, files, largest);
+        task->listed = 1;
+        pthread_cond_broadcast(&done_cv);
+        pthread_mutex_unlock(&done_lock);
+    } else {
+        du_add(task, blocks, files, largest);
+    }
+    du_release(task);
+}
+
+void
+du_release(struct du_task *task) {
+    /**
+     * Drops one hold on a directory; the last one finishes it
+     */
+    if (atomic_fetch_sub(&task->pending, 1) == 1) du_finish(task);
+}
+
+void
+du_finish(struct du_task *task) {
+    /**
+     * Passes a directory whose subdirectories have all folded in on to its
+     * parent. Serially it is reported and freed right away
+     */
+    struct du_task *parent = task->parent;
+
+    // du_emit still has to go through the links and report the task
+    if (walk_pool) {
+        pthread_mutex_lock(&done_lock);
+        if (parent) du_add(parent, task->blocks, task->files, task->largest);
+        task->done = 1;
+        pthread_cond_broadcast(&done_cv);
+        pthread_mutex_unlock(&done_lock);
+        if (parent) du_release(parent);
+        return;
+    }
+
+    du_report(task, task->blocks, task->files, task->largest);
+    if (parent) du_add(parent, task->blocks, task->files, task->largest);
+    free(task->path);
+    free(task);
+    if (parent) du_release(parent);
+}
+
+void
+du_add(struct du_task *task, uint64_t blocks, uint64_t files, uint64_t largest) {
+    /**
+     * Adds usage to a task's totals. With -j under done_lock, as the
+     * task's subdirectories and its own worker add to it at once
+     */
+    task->blocks += blocks;
+    task->files += files;
+    if (largest > task->largest) task->largest = largest;
+}
+
+void
+du_emit(struct du_task *task) {
+    /**
+     * Main thread with -j: reports a subtree in serial order as its parts
+     * finish, deciding where linked files count on the way, and frees its
+     * tasks, each once its line is out
+     */
+    du_wait(task, &task->listed);
+
+    // The links ahead of each subdirectory, then the subdirectory
+    struct du_task *child = task->children, *ahead = child, *next;
+    size_t l = 0, n = 0;
+    for (;;) {
+        while (l < task->nlinks && task->links[l].before <= n) du_claim(task, &task->links[l++]);
+        if (!child) break;
+        ahead = du_resume(ahead, child);
+        next = child->next;
+        du_emit(child);
+        child = next;
+        n++;
+    }
+    free(task->links);
+
+    // Once done no worker touches the task
+    du_wait(task, &task->done);
+    du_report(task, task->blocks + task->linked_blocks, task->files + task->linked_files,
+              task->largest > task->linked_largest ? task->largest : task->linked_largest);
+    if (task->parent) {
+        struct du_task *parent = task->parent;
+        parent->linked_blocks += task->linked_blocks;
+        parent->linked_files += task->linked_files;
+        if (task->linked_largest > parent->linked_largest) parent->linked_largest = task->linked_largest;
+    }
+    free(task->path);
+    free(task);
+    atomic_fetch_sub(&du_active, 1);
+}
+
+struct du_task *
+du_resume(struct du_task *ahead, struct du_task *child) {
+    /**
+     * Main thread with -j: submits subdirectories a full pool deferred,
+     * starting at ahead. child, the next one to report, goes whatever the
+     * count, the ones after it while there is room. Returns where to carry
+     * on for the next child
+     */
+    if (ahead == child) {
+        if (child->deferred) du_submit(child);
+        ahead = child->next;
+    }
+    while (ahead && atomic_load(&du_active) < DU_ACTIVE_MAX) {
+        if (ahead->deferred) du_submit(ahead);
+        ahead = ahead->next;
+    }
+    return ahead;
+}
+
+void
+du_wait(struct du_task *task, int *flag) {
+    /**
+     * Waits for a worker to set one of task's flags
+     */
+    pthread_mutex_lock(&done_lock);
+    while (!*flag) {
+        pthread_cond_wait(&done_cv, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+}
+
+void
+du_claim(struct du_task *task, const struct du_link *link) {
+    /**
+     * Counts a linked file in task unless an earlier name already has it
+     */
+    if (isset(du_linked, link->inode_num)) return;
+    setbit(du_linked, link->inode_num);
+    task->linked_blocks += link->blocks;
+    task->linked_files++;
+    if (link->size > task->linked_largest) task->linked_largest = link->size;
+}
+
+void
+du_report(struct du_task *task, uint64_t blocks, uint64_t files, uint64_t largest) {
+    /**
+     * Prints a finished directory's line, or offers it to -t
+     */
+    if (du_depth >= 0 && task->depth > du_depth) return;
+    const char *path = task->path_len ? task->path : ".";
+    size_t path_len = task->path_len ? task->path_len : 1;
+    if (du_top_count) {
+        du_top_add(blocks, files, largest, path);
+    } else {
+        du_line(&out, blocks, files, largest, path, path_len);
+    }
+}
+
+void
+du_line(struct ufs_text *text, uint64_t blocks, uint64_t files, uint64_t largest,
+        const char *path, size_t path_len) {
+    /**
+     * Appends "<KiB>\t<files>\t<largest>\t<path>", du(1)'s two columns
+     * with the file count and biggest file size in between
+     */
+    ufs_text_uint(text, (blocks + 1) / 2);
+    ufs_text_char(text, '\t');
+    ufs_text_uint(text, files);
+    ufs_text_char(text, '\t');
+    ufs_text_uint(text, largest);
+    ufs_text_char(text, '\t');
+    ufs_text_bytes(text, path, path_len);
+    ufs_text_char(text, '\n');
+}
+
+void
+du_top_add(uint64_t blocks, uint64_t files, uint64_t largest, const char *path) {
+    /**
+     * Offers a finished subtree to the -t heap, which keeps the biggest.
+     * Only ever called from one thread, in post-order
+     */
+    int i;
+    if (du_top_len < du_top_count) {
+        i = du_top_len++;
+        // Sift up from the new leaf
+        while (i > 0 && du_top[(i - 1) / 2].blocks > blocks) {
+            du_top[i] = du_top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (blocks > du_top[0].blocks) {
+        // Replace the smallest and sift down
+        free(du_top[0].path);
+        int child;
+        for (i = 0; (child = 2 * i + 1) < du_top_len; i = child) {
+            if (child + 1 < du_top_len && du_top[child + 1].blocks < du_top[child].blocks) child++;
+            if (blocks <= du_top[child].blocks) break;
+            du_top[i] = du_top[child];
+        }
+    } else {
+        return;
+    }
+
+    du_top[i].blocks = blocks;
+    du_top[i].files = files;
+    du_top[i].largest = largest;
+    du_top[i].path = strdup(path);
+    if (!du_top[i].path) {
+        perror("strdup");
+        exit(1);
+    }
 }
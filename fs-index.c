@@ -0,0 +1,106 @@
+/**
+ * fs-index.c
+ *
+ * Walks an image once and writes the path index fs-cat uses to skip the
+ * directory walk (see ufsindex.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>   // exit
+#include <string.h>   // memcpy
+#include <limits.h>   // PATH_MAX
+
+#include "ufsread.h"
+#include "ufsindex.h"
+
+void index_directory(
+    struct ufs_image *image,
+    struct ufs_index_builder *builder,
+    ino_t inode_num,
+    char *path,
+    size_t path_len
+);
+
+int
+main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: fs-index partition.img [index]\n");
+        exit(1);
+    }
+    char *partition_path = argv[1];
+
+    // Index defaults to living next to the image
+    char index_path[PATH_MAX];
+    if (argc == 3) {
+        snprintf(index_path, sizeof(index_path), "%s", argv[2]);
+    } else {
+        snprintf(index_path, sizeof(index_path), "%s.idx", partition_path);
+    }
+
+    struct ufs_image image;
+    if (ufs_open(&image, partition_path, UFS_BACKEND_MMAP) == -1) {
+        perror(partition_path);
+        exit(1);
+    }
+
+    struct ufs_index_builder builder;
+    memset(&builder, 0, sizeof(builder));
+
+    char path[PATH_MAX];
+    index_directory(&image, &builder, UFS_ROOTINO, path, 0);
+
+    if (ufs_index_write(&builder, &image, index_path) == -1) {
+        perror(index_path);
+        exit(1);
+    }
+    return 0;
+}
+
+void
+index_directory(
+    struct ufs_image *image,
+    struct ufs_index_builder *builder,
+    ino_t inode_num,
+    char *path,
+    size_t path_len
+) {
+    /**
+     * Adds every entry below a directory; path holds the directory's own
+     * path (path_len bytes, empty for the root)
+     */
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    struct direct *dir;
+    size_t len;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (struct direct*)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino) continue;
+            if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, "..")) continue;
+
+            // Child path is "<path>/<name>", or just the name at the root
+            len = path_len;
+            if (len + dir->d_namlen + 2 > PATH_MAX) {
+                fprintf(stderr, "fs-index: path too long, skipping %s\n", dir->d_name);
+                continue;
+            }
+            if (len) path[len++] = '/';
+            memcpy(path + len, dir->d_name, dir->d_namlen);
+            len += dir->d_namlen;
+            path[len] = '\0';
+
+            ufs_index_add(builder, path, len, dir->d_ino, dir->d_type);
+            if (dir->d_type == DT_DIR) {
+                index_directory(image, builder, dir->d_ino, path, len);
+            }
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    path[path_len] = '\0';
+}
@@ -0,0 +1,876 @@
+/**
+ * fs-mkimage.c
+ *
+ * Builds a synthetic UFS2 image directly in a file: no newfs, no mount, no
+ * root. The tree shape is given on the command line, so directories large
+ * enough for single/double/triple indirect blocks, sparse files and
+ * multi-million inode images can be produced in seconds.
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdlib.h>   // malloc
+#include <sys/stat.h> // stat
+#include <string.h>   // memcpy
+#include <unistd.h>   // getopt, ftruncate
+#include <stdint.h>
+#include <limits.h>   // PATH_MAX
+#include <time.h>
+#include <errno.h>
+
+#include </usr/src/sys/ufs/ffs/fs.h>
+#include </usr/src/sys/ufs/ufs/dinode.h>
+#include </usr/src/sys/ufs/ufs/dir.h>
+
+struct params {
+    int bsize, fsize;
+    int depth, fanout, files;
+    long big_entries;           // files in /big, 0 for none
+    uint64_t min_file, max_file;
+    int sparse_pct;             // % of files that get holes
+    uint64_t huge_size;         // size of /sparse, 0 for none
+    uint64_t seed;
+    uint64_t min_image;
+    time_t now;
+    const char *mirror;         // host directory to mirror the tree into
+};
+
+struct entry {
+    char *name;
+    ino_t ino;
+    u_int8_t type;
+};
+
+struct entries {
+    struct entry *v;
+    size_t n, cap;
+};
+
+struct builder {
+    struct params *p;
+    int dry_run;
+    uint64_t rng;
+
+    // Totals collected by the dry run
+    int64_t frags;
+    int64_t inodes;
+
+    // Image being written (second pass)
+    char *base;
+    size_t size;
+    struct fs *sb;
+    int64_t *cg_next_frag;      // next free frag, relative to cgbase
+    ino_t *cg_next_ino;         // next free inode, relative to the cg
+    int32_t *cg_ndir;
+    u_int32_t dir_rotor;
+    ufs2_daddr_t tail_blk;      // block fragment tails are carved from
+    int tail_used;
+};
+
+static void usage(void);
+static uint64_t parse_size(const char *arg);
+static uint64_t rng_next(struct builder *b);
+static void build_tree(struct builder *b);
+static ino_t make_dir(struct builder *b, ino_t parent, int cg, int depth, char *path, size_t path_len);
+static ino_t make_file(
+    struct builder *b,
+    int cg,
+    uint64_t size,
+    int sparse,
+    char *path
+);
+static void layout(struct builder *b);
+static void finish(struct builder *b);
+
+int
+main(int argc, char *argv[]) {
+    struct params p = {
+        .bsize = 32768, .fsize = 4096,
+        .depth = 3, .fanout = 4, .files = 8,
+        .min_file = 0, .max_file = 65536,
+        .seed = 1,
+    };
+    p.now = time(NULL);
+
+    int opt;
+    char *colon;
+    while ((opt = getopt(argc, argv, "b:f:d:n:e:L:S:H:T:r:s:t:x:")) != -1) {
+        switch (opt) {
+        case 'b': p.bsize = parse_size(optarg); break;
+        case 'f': p.fsize = parse_size(optarg); break;
+        case 'd': p.depth = atoi(optarg); break;
+        case 'n': p.fanout = atoi(optarg); break;
+        case 'e': p.files = atoi(optarg); break;
+        case 'L': p.big_entries = atol(optarg); break;
+        case 'S':
+            if (!(colon = strchr(optarg, ':'))) usage();
+            *colon = '\0';
+            p.min_file = parse_size(optarg);
+            p.max_file = parse_size(colon + 1);
+            break;
+        case 'H': p.sparse_pct = atoi(optarg); break;
+        case 'T': p.huge_size = parse_size(optarg); break;
+        case 'r': p.seed = strtoull(optarg, NULL, 0); break;
+        case 's': p.min_image = parse_size(optarg); break;
+        case 't': p.now = strtoll(optarg, NULL, 0); break;
+        case 'x': p.mirror = optarg; break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1) usage();
+
+    if (p.bsize < MINBSIZE || p.bsize > 65536 || (p.bsize & (p.bsize - 1)) ||
+        p.fsize < 512 || (p.fsize & (p.fsize - 1)) ||
+        p.bsize / p.fsize > MAXFRAG || p.fsize > p.bsize) {
+        fprintf(stderr, "fs-mkimage: bad block/fragment size %d/%d\n", p.bsize, p.fsize);
+        exit(1);
+    }
+    if (p.min_file > p.max_file) usage();
+
+    // First pass only counts inodes and fragments so the image can be sized
+    struct builder b = { .p = &p, .dry_run = 1 };
+    build_tree(&b);
+
+    // Second pass replays the same random choices into the real image
+    int fd = open(argv[0], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    layout(&b);
+    if (ftruncate(fd, b.size) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    b.base = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (b.base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    b.dry_run = 0;
+    finish(&b);
+
+    if (munmap(b.base, b.size) == -1 || close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return 0;
+}
+
+static void
+usage(void) {
+    fprintf(stderr,
+        "usage: fs-mkimage [-b bsize] [-f fsize] [-d depth] [-n fanout] [-e files]\n"
+        "                  [-L big-dir-entries] [-S min:max] [-H sparse%%]\n"
+        "                  [-T huge-sparse-size] [-r seed] [-s min-image-size]\n"
+        "                  [-t time] [-x mirror-dir] image\n");
+    exit(1);
+}
+
+static uint64_t
+parse_size(const char *arg) {
+    /**
+     * Parses a byte count with an optional k/m/g/t suffix
+     */
+    char *end;
+    uint64_t value = strtoull(arg, &end, 0);
+    switch (*end) {
+    case 't': case 'T': value <<= 10; /* FALLTHROUGH */
+    case 'g': case 'G': value <<= 10; /* FALLTHROUGH */
+    case 'm': case 'M': value <<= 10; /* FALLTHROUGH */
+    case 'k': case 'K': value <<= 10; break;
+    case '\0': break;
+    default:
+        fprintf(stderr, "fs-mkimage: bad size %s\n", arg);
+        exit(1);
+    }
+    return value;
+}
+
+static uint64_t
+rng_next(struct builder *b) {
+    /**
+     * splitmix64, so both passes see the same sequence for the same seed
+     */
+    uint64_t z = (b->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void
+layout(struct builder *b) {
+    /**
+     * Picks cylinder group geometry that fits the dry run's totals
+     */
+    struct params *p = b->p;
+    int frag = p->bsize / p->fsize;
+    int inopb = p->bsize / sizeof(struct ufs2_dinode);
+    int inopf = inopb / frag;
+
+    int sblkno = roundup(howmany(SBLOCK_UFS2 + SBLOCKSIZE, p->fsize), frag);
+    int cblkno = sblkno + roundup(howmany(SBLOCKSIZE, p->fsize), frag);
+    int iblkno = cblkno + frag;
+
+    // Headroom for fragment tails and cgs filling unevenly
+    int64_t want_frags = b->frags + b->frags / 16 + 64 * frag;
+    int64_t want_inodes = b->inodes + b->inodes / 16 + UFS_ROOTINO + 1;
+    if ((int64_t)(p->min_image / p->fsize) > want_frags) {
+        want_frags = p->min_image / p->fsize;
+    }
+
+    int64_t ncg, ipg, fpg;
+    for (ncg = 1; ; ncg++) {
+        ipg = roundup(howmany(want_inodes, ncg), inopb);
+        int64_t dblkno = iblkno + ipg / inopf;
+        int64_t csum_frags = roundup(howmany(ncg * sizeof(struct csum), p->fsize), frag);
+        fpg = roundup(howmany(want_frags + csum_frags, ncg) + dblkno + 2 * frag, frag);
+
+        size_t cgsize = offsetof(struct cg, cg_space) + howmany(ipg, NBBY) + howmany(fpg, NBBY);
+        if (cgsize <= (size_t)p->bsize && fpg < INT32_MAX) break;
+    }
+
+    b->size = (size_t)ncg * fpg * p->fsize;
+
+    // Scratch superblock until the image is mapped
+    b->sb = calloc(1, SBLOCKSIZE);
+    if (!b->sb) {
+        perror("calloc");
+        exit(1);
+    }
+    struct fs *fs = b->sb;
+    fs->fs_magic = FS_UFS2_MAGIC;
+    fs->fs_bsize = p->bsize;
+    fs->fs_fsize = p->fsize;
+    fs->fs_frag = frag;
+    fs->fs_bmask = ~(p->bsize - 1);
+    fs->fs_fmask = ~(p->fsize - 1);
+    fs->fs_qbmask = p->bsize - 1;
+    fs->fs_qfmask = p->fsize - 1;
+    for (fs->fs_bshift = 0; (1 << fs->fs_bshift) < p->bsize; fs->fs_bshift++);
+    for (fs->fs_fshift = 0; (1 << fs->fs_fshift) < p->fsize; fs->fs_fshift++);
+    for (fs->fs_fragshift = 0; (1 << fs->fs_fragshift) < frag; fs->fs_fragshift++);
+    for (fs->fs_fsbtodb = 0; (512 << fs->fs_fsbtodb) < p->fsize; fs->fs_fsbtodb++);
+    fs->fs_sblkno = sblkno;
+    fs->fs_cblkno = cblkno;
+    fs->fs_iblkno = iblkno;
+    fs->fs_dblkno = iblkno + ipg / inopf;
+    fs->fs_ncg = ncg;
+    fs->fs_ipg = ipg;
+    fs->fs_fpg = fpg;
+    fs->fs_nindir = p->bsize / sizeof(ufs2_daddr_t);
+    fs->fs_inopb = inopb;
+    fs->fs_sbsize = SBLOCKSIZE;
+    fs->fs_cgsize = fragroundup(fs, (int64_t)(offsetof(struct cg, cg_space) +
+                        howmany(ipg, NBBY) + howmany(fpg, NBBY)));
+    fs->fs_cssize = fragroundup(fs, (int64_t)(ncg * sizeof(struct csum)));
+    fs->fs_csaddr = cgdmin(fs, 0);
+    fs->fs_size = ncg * fpg;
+    fs->fs_dsize = fs->fs_size - fs->fs_sblkno -
+                   ncg * (fs->fs_dblkno - fs->fs_sblkno) -
+                   howmany(fs->fs_cssize, fs->fs_fsize);
+    fs->fs_minfree = 8;
+    fs->fs_optim = FS_OPTTIME;
+    fs->fs_maxcontig = MAX(1, 131072 / p->bsize);
+    fs->fs_maxbpg = NINDIR(fs);
+    fs->fs_maxbsize = p->bsize;
+    fs->fs_maxsymlinklen = (UFS_NDADDR + UFS_NIADDR) * sizeof(ufs2_daddr_t);
+    fs->fs_avgfilesize = 16384;
+    fs->fs_avgfpdir = 64;
+    fs->fs_sblockloc = SBLOCK_UFS2;
+    fs->fs_sblockactualloc = SBLOCK_UFS2;
+    fs->fs_clean = 1;
+    fs->fs_time = p->now;
+    fs->fs_mtime = p->now;
+    fs->fs_old_time = p->now;
+
+    uint64_t nindir = NINDIR(fs);
+    uint64_t max_blocks = UFS_NDADDR + nindir + nindir * nindir + nindir * nindir * nindir;
+    fs->fs_maxfilesize = max_blocks > (INT64_MAX >> fs->fs_bshift)
+                        ? INT64_MAX
+                        : (max_blocks << fs->fs_bshift) - 1;
+
+    b->cg_next_frag = calloc(ncg, sizeof(int64_t));
+    b->cg_next_ino = calloc(ncg, sizeof(ino_t));
+    b->cg_ndir = calloc(ncg, sizeof(int32_t));
+    if (!b->cg_next_frag || !b->cg_next_ino || !b->cg_ndir) {
+        perror("calloc");
+        exit(1);
+    }
+}
+
+static struct cg *
+cg_header(struct builder *b, int cg) {
+    return (struct cg *)(b->base + lfragtosize(b->sb, cgtod(b->sb, cg)));
+}
+
+static void
+finish(struct builder *b) {
+    /**
+     * Writes cg headers, replays the tree and fills in the summaries
+     */
+    struct fs *fs = b->sb;
+
+    for (u_int32_t c = 0; c < fs->fs_ncg; c++) {
+        struct cg *cgp = cg_header(b, c);
+        cgp->cg_magic = CG_MAGIC;
+        cgp->cg_cgx = c;
+        cgp->cg_time = b->p->now;
+        cgp->cg_old_time = b->p->now;
+        cgp->cg_niblk = fs->fs_ipg;
+        cgp->cg_initediblk = fs->fs_ipg;
+        cgp->cg_ndblk = fs->fs_fpg;
+        cgp->cg_iusedoff = offsetof(struct cg, cg_space);
+        cgp->cg_freeoff = cgp->cg_iusedoff + howmany(fs->fs_ipg, NBBY);
+        cgp->cg_nextfreeoff = cgp->cg_freeoff + howmany(fs->fs_fpg, NBBY);
+        cgp->cg_clustersumoff = cgp->cg_nextfreeoff;
+        cgp->cg_clusteroff = cgp->cg_nextfreeoff;
+
+        // Metadata (and cg 0's boot area) is in use, the rest starts free
+        u_int8_t *blksfree = cg_blksfree(cgp);
+        for (int64_t f = 0; c && f < fs->fs_sblkno; f++) setbit(blksfree, f);
+        for (int64_t f = fs->fs_dblkno; f < fs->fs_fpg; f++) setbit(blksfree, f);
+
+        b->cg_next_frag[c] = fs->fs_dblkno;
+    }
+
+    // Cylinder summary array sits at the start of cg 0's data area
+    int64_t csum_frags = roundup(howmany(fs->fs_cssize, fs->fs_fsize), fs->fs_frag);
+    for (int64_t f = 0; f < csum_frags; f++) {
+        clrbit(cg_blksfree(cg_header(b, 0)), fs->fs_dblkno + f);
+    }
+    b->cg_next_frag[0] += csum_frags;
+
+    // Inodes 0 and 1 are reserved
+    setbit(cg_inosused(cg_header(b, 0)), 0);
+    setbit(cg_inosused(cg_header(b, 0)), 1);
+    b->cg_next_ino[0] = UFS_ROOTINO;
+
+    struct fs *scratch = fs;
+    b->sb = fs = (struct fs *)(b->base + SBLOCK_UFS2);
+    memcpy(fs, scratch, sizeof(struct fs));
+    free(scratch);
+    fs->fs_id[0] = (int32_t)b->p->now;
+    fs->fs_id[1] = (int32_t)(b->p->seed ^ (b->p->seed >> 32));
+
+    build_tree(b);
+
+    // Summaries: recount everything from the bitmaps
+    struct csum *csums = (struct csum *)(b->base + lfragtosize(fs, fs->fs_csaddr));
+    memset(&fs->fs_cstotal, 0, sizeof(fs->fs_cstotal));
+    for (u_int32_t c = 0; c < fs->fs_ncg; c++) {
+        struct cg *cgp = cg_header(b, c);
+        u_int8_t *blksfree = cg_blksfree(cgp);
+        memset(&cgp->cg_cs, 0, sizeof(cgp->cg_cs));
+        memset(cgp->cg_frsum, 0, sizeof(cgp->cg_frsum));
+
+        for (int64_t blk = 0; blk < fs->fs_fpg; blk += fs->fs_frag) {
+            int free_frags = 0, run = 0;
+            for (int f = 0; f < fs->fs_frag; f++) {
+                if (isset(blksfree, blk + f)) {
+                    free_frags++;
+                    run++;
+                } else {
+                    if (run) cgp->cg_frsum[run]++;
+                    run = 0;
+                }
+            }
+            if (free_frags == fs->fs_frag) {
+                cgp->cg_cs.cs_nbfree++;
+                continue;
+            }
+            if (run) cgp->cg_frsum[run]++;
+            cgp->cg_cs.cs_nffree += free_frags;
+        }
+
+        int used_inodes = 0;
+        u_int8_t *inosused = cg_inosused(cgp);
+        for (u_int32_t i = 0; i < fs->fs_ipg; i++) {
+            if (isset(inosused, i)) used_inodes++;
+        }
+        cgp->cg_cs.cs_nifree = fs->fs_ipg - used_inodes;
+        cgp->cg_cs.cs_ndir = b->cg_ndir[c];
+        cgp->cg_irotor = b->cg_next_ino[c];
+        cgp->cg_rotor = cgp->cg_frotor = b->cg_next_frag[c];
+
+        csums[c] = cgp->cg_cs;
+        fs->fs_cstotal.cs_ndir += cgp->cg_cs.cs_ndir;
+        fs->fs_cstotal.cs_nbfree += cgp->cg_cs.cs_nbfree;
+        fs->fs_cstotal.cs_nffree += cgp->cg_cs.cs_nffree;
+        fs->fs_cstotal.cs_nifree += cgp->cg_cs.cs_nifree;
+    }
+    fs->fs_old_cstotal.cs_ndir = fs->fs_cstotal.cs_ndir;
+    fs->fs_old_cstotal.cs_nbfree = fs->fs_cstotal.cs_nbfree;
+    fs->fs_old_cstotal.cs_nffree = fs->fs_cstotal.cs_nffree;
+    fs->fs_old_cstotal.cs_nifree = fs->fs_cstotal.cs_nifree;
+
+    // Backup superblocks
+    for (u_int32_t c = 0; c < fs->fs_ncg; c++) {
+        memcpy(b->base + lfragtosize(fs, cgsblock(fs, c)), fs, sizeof(struct fs));
+    }
+}
+
+static ino_t
+alloc_inode(struct builder *b, int cg, int is_dir) {
+    /**
+     * Takes the next free inode, starting at cylinder group cg
+     */
+    if (b->dry_run) return ++b->inodes;
+
+    struct fs *fs = b->sb;
+    for (u_int32_t i = 0; i < fs->fs_ncg; i++) {
+        int c = (cg + i) % fs->fs_ncg;
+        if (b->cg_next_ino[c] >= fs->fs_ipg) continue;
+
+        ino_t rel = b->cg_next_ino[c]++;
+        setbit(cg_inosused(cg_header(b, c)), rel);
+        if (is_dir) b->cg_ndir[c]++;
+        return (ino_t)c * fs->fs_ipg + rel;
+    }
+    fprintf(stderr, "fs-mkimage: out of inodes\n");
+    exit(1);
+}
+
+static struct ufs2_dinode *
+inode_at(struct builder *b, ino_t ino) {
+    struct fs *fs = b->sb;
+    return (struct ufs2_dinode *)(b->base + lfragtosize(fs, ino_to_fsba(fs, ino)) +
+                                  ino_to_fsbo(fs, ino) * sizeof(struct ufs2_dinode));
+}
+
+static ufs2_daddr_t
+alloc_frags(struct builder *b, int cg, int nfrags) {
+    /**
+     * Allocates nfrags fragments (a whole block when nfrags == fs_frag)
+     */
+    int frag = b->p->bsize / b->p->fsize;
+    if (b->dry_run) {
+        // Same carving as below, so wasted tail space is counted too
+        if (nfrags < frag && b->tail_blk && b->tail_used + nfrags <= frag) {
+            b->tail_used += nfrags;
+            return 1;
+        }
+        b->frags += frag;
+        if (nfrags < frag) {
+            b->tail_blk = 1;
+            b->tail_used = nfrags;
+        }
+        return 1;
+    }
+
+    struct fs *fs = b->sb;
+    if (nfrags < fs->fs_frag && b->tail_blk && b->tail_used + nfrags <= fs->fs_frag) {
+        ufs2_daddr_t blk = b->tail_blk + b->tail_used;
+        int c = dtog(fs, blk);
+        for (int f = 0; f < nfrags; f++) {
+            clrbit(cg_blksfree(cg_header(b, c)), dtogd(fs, blk) + f);
+        }
+        b->tail_used += nfrags;
+        return blk;
+    }
+
+    for (u_int32_t i = 0; i < fs->fs_ncg; i++) {
+        int c = (cg + i) % fs->fs_ncg;
+        if (b->cg_next_frag[c] + fs->fs_frag > fs->fs_fpg) continue;
+
+        int64_t rel = b->cg_next_frag[c];
+        b->cg_next_frag[c] += fs->fs_frag;
+        for (int f = 0; f < nfrags; f++) {
+            clrbit(cg_blksfree(cg_header(b, c)), rel + f);
+        }
+
+        ufs2_daddr_t blk = cgbase(fs, c) + rel;
+        if (nfrags < fs->fs_frag) {
+            b->tail_blk = blk;
+            b->tail_used = nfrags;
+        }
+        return blk;
+    }
+    fprintf(stderr, "fs-mkimage: out of space\n");
+    exit(1);
+}
+
+static ufs2_daddr_t *
+indirect_slot(struct builder *b, struct ufs2_dinode *inode, int cg, ufs2_daddr_t *slot) {
+    /**
+     * Returns the block a pointer slot refers to, allocating it if empty
+     */
+    if (!*slot) {
+        *slot = alloc_frags(b, cg, b->p->bsize / b->p->fsize);
+        inode->di_blocks += b->p->bsize / 512;
+    }
+    return (ufs2_daddr_t *)(b->base + lfragtosize(b->sb, *slot));
+}
+
+static void
+set_block(struct builder *b, struct ufs2_dinode *inode, int cg, int64_t lbn, ufs2_daddr_t blk) {
+    /**
+     * Points logical block lbn of inode at blk, building indirect blocks
+     */
+    if (b->dry_run) return;
+
+    if (lbn < UFS_NDADDR) {
+        inode->di_db[lbn] = blk;
+        return;
+    }
+    int64_t nindir = NINDIR(b->sb);
+    lbn -= UFS_NDADDR;
+
+    ufs2_daddr_t *ind;
+    if (lbn < nindir) {
+        ind = indirect_slot(b, inode, cg, &inode->di_ib[0]);
+        ind[lbn] = blk;
+        return;
+    }
+    lbn -= nindir;
+    if (lbn < nindir * nindir) {
+        ind = indirect_slot(b, inode, cg, &inode->di_ib[1]);
+        ind = indirect_slot(b, inode, cg, &ind[lbn / nindir]);
+        ind[lbn % nindir] = blk;
+        return;
+    }
+    lbn -= nindir * nindir;
+    ind = indirect_slot(b, inode, cg, &inode->di_ib[2]);
+    ind = indirect_slot(b, inode, cg, &ind[lbn / (nindir * nindir)]);
+    ind = indirect_slot(b, inode, cg, &ind[(lbn / nindir) % nindir]);
+    ind[lbn % nindir] = blk;
+}
+
+static int64_t
+indirect_blocks(struct builder *b, int64_t nblocks) {
+    /**
+     * Indirect blocks a dense file of nblocks needs (dry run accounting)
+     */
+    int64_t nindir = b->p->bsize / sizeof(ufs2_daddr_t);
+    int64_t count = 0;
+    nblocks -= UFS_NDADDR;
+    if (nblocks <= 0) return 0;
+
+    count++;
+    nblocks -= nindir;
+    if (nblocks <= 0) return count;
+
+    int64_t dbl = MIN(nblocks, nindir * nindir);
+    count += 1 + howmany(dbl, nindir);
+    nblocks -= dbl;
+    if (nblocks <= 0) return count;
+
+    count += 1 + howmany(nblocks, nindir * nindir) + howmany(nblocks, nindir);
+    return count;
+}
+
+static void
+fill_block(char *dst, size_t len, ino_t ino, int64_t lbn) {
+    /**
+     * Recognisable file contents: one repeated line per block
+     */
+    char line[64];
+    int line_len = snprintf(line, sizeof(line), "ino %ju lbn %jd\n", (uintmax_t)ino, (intmax_t)lbn);
+    for (size_t off = 0; off < len; off += line_len) {
+        memcpy(dst + off, line, MIN((size_t)line_len, len - off));
+    }
+}
+
+static void
+init_inode(struct builder *b, struct ufs2_dinode *inode, u_int16_t mode, uint64_t rnd) {
+    inode->di_mode = mode;
+    inode->di_uid = 1000 + (rnd & 3);
+    inode->di_gid = 1000 + ((rnd >> 2) & 3);
+    inode->di_mtime = b->p->now - (int64_t)((rnd >> 8) % (365 * 24 * 3600));
+    inode->di_atime = inode->di_ctime = inode->di_birthtime = inode->di_mtime;
+    inode->di_gen = (u_int32_t)(rnd >> 32);
+    inode->di_modrev = 1;
+}
+
+static ino_t
+make_file(struct builder *b, int cg, uint64_t size, int sparse, char *path) {
+    /**
+     * Creates a regular file of size bytes. Sparse files get random holes
+     * (the last block is always allocated, like ffs does)
+     */
+    uint64_t rnd = rng_next(b);
+    ino_t ino = alloc_inode(b, cg, 0);
+    struct fs *fs = b->sb;
+    int bsize = b->p->bsize, fsize = b->p->fsize;
+    int64_t nblocks = howmany(size, (uint64_t)bsize);
+
+    int mirror_fd = -1;
+    if (!b->dry_run && b->p->mirror) {
+        mirror_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (mirror_fd < 0) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    struct ufs2_dinode *inode = NULL;
+    if (!b->dry_run) {
+        inode = inode_at(b, ino);
+        init_inode(b, inode, IFREG | 0644, rnd);
+        inode->di_nlink = 1;
+        inode->di_size = size;
+    }
+
+    int64_t allocated = 0;
+    for (int64_t lbn = 0; lbn < nblocks; lbn++) {
+        // Huge sparse files only get data at the start, middle and end
+        int present;
+        if (sparse == 2) {
+            present = lbn == 0 || lbn == nblocks / 2 || lbn == nblocks - 1;
+        } else {
+            uint64_t coin = rng_next(b);
+            present = !sparse || lbn == nblocks - 1 || (coin & 1);
+        }
+        if (!present) continue;
+
+        uint64_t len = MIN((uint64_t)bsize, size - (uint64_t)lbn * bsize);
+        int nfrags = lbn < UFS_NDADDR ? howmany(len, (uint64_t)fsize) : bsize / fsize;
+        ufs2_daddr_t blk = alloc_frags(b, cg, nfrags);
+        allocated++;
+        if (b->dry_run) continue;
+
+        set_block(b, inode, cg, lbn, blk);
+        inode->di_blocks += (int64_t)nfrags * fsize / 512;
+
+        char *data = b->base + lfragtosize(fs, blk);
+        fill_block(data, len, ino, lbn);
+        if (mirror_fd >= 0 && pwrite(mirror_fd, data, len, lbn * bsize) != (ssize_t)len) {
+            perror("pwrite");
+            exit(1);
+        }
+    }
+
+    if (b->dry_run) {
+        // A sparse file may need a separate indirect chain per block
+        int64_t indirect = sparse ? allocated * UFS_NIADDR + UFS_NIADDR : indirect_blocks(b, nblocks);
+        b->frags += indirect * (bsize / fsize);
+    }
+    if (mirror_fd >= 0) {
+        if (ftruncate(mirror_fd, size) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+        close(mirror_fd);
+    }
+    return ino;
+}
+
+static void
+add_entry(struct entries *ents, const char *name, ino_t ino, u_int8_t type) {
+    if (ents->n == ents->cap) {
+        ents->cap = ents->cap ? ents->cap * 2 : 16;
+        ents->v = realloc(ents->v, ents->cap * sizeof(struct entry));
+        if (!ents->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ents->v[ents->n].name = strdup(name);
+    ents->v[ents->n].ino = ino;
+    ents->v[ents->n].type = type;
+    ents->n++;
+}
+
+static void
+write_directory(struct builder *b, ino_t ino, int cg, struct entries *ents) {
+    /**
+     * Packs entries into DIRBLKSIZ chunks and stores them in ino's blocks
+     */
+    size_t chunk_used = 0, size = DIRBLKSIZ;
+    for (size_t i = 0; i < ents->n; i++) {
+        size_t reclen = DIRECTSIZ(strlen(ents->v[i].name));
+        if (chunk_used + reclen > DIRBLKSIZ) {
+            size += DIRBLKSIZ;
+            chunk_used = 0;
+        }
+        chunk_used += reclen;
+    }
+
+    char *contents = NULL;
+    if (!b->dry_run) {
+        contents = calloc(1, size);
+        if (!contents) {
+            perror("calloc");
+            exit(1);
+        }
+
+        struct direct *prev = NULL;
+        size_t off = 0;
+        chunk_used = 0;
+        for (size_t i = 0; i < ents->n; i++) {
+            size_t namlen = strlen(ents->v[i].name);
+            size_t reclen = DIRECTSIZ(namlen);
+            if (chunk_used + reclen > DIRBLKSIZ) {
+                prev->d_reclen += DIRBLKSIZ - chunk_used;
+                off += DIRBLKSIZ - chunk_used;
+                chunk_used = 0;
+            }
+            struct direct *dir = (struct direct *)(contents + off);
+            dir->d_ino = ents->v[i].ino;
+            dir->d_reclen = reclen;
+            dir->d_type = ents->v[i].type;
+            dir->d_namlen = namlen;
+            memcpy(dir->d_name, ents->v[i].name, namlen);
+            prev = dir;
+            off += reclen;
+            chunk_used += reclen;
+        }
+        prev->d_reclen += DIRBLKSIZ - chunk_used;
+    }
+
+    struct ufs2_dinode *inode = b->dry_run ? NULL : inode_at(b, ino);
+    int bsize = b->p->bsize, fsize = b->p->fsize;
+    int64_t nblocks = howmany(size, (size_t)bsize);
+    for (int64_t lbn = 0; lbn < nblocks; lbn++) {
+        size_t len = MIN((size_t)bsize, size - lbn * bsize);
+        int nfrags = lbn < UFS_NDADDR ? howmany(len, (size_t)fsize) : bsize / fsize;
+        ufs2_daddr_t blk = alloc_frags(b, cg, nfrags);
+        if (b->dry_run) continue;
+
+        set_block(b, inode, cg, lbn, blk);
+        inode->di_blocks += (int64_t)nfrags * fsize / 512;
+        memcpy(b->base + lfragtosize(b->sb, blk), contents + lbn * bsize, len);
+    }
+    if (b->dry_run) {
+        b->frags += indirect_blocks(b, nblocks) * (bsize / fsize);
+    } else {
+        inode->di_size = size;
+    }
+
+    free(contents);
+    for (size_t i = 0; i < ents->n; i++) free(ents->v[i].name);
+    free(ents->v);
+}
+
+static uint64_t
+pick_size(struct builder *b) {
+    /**
+     * Log-uniform file size between min_file and max_file
+     */
+    struct params *p = b->p;
+    uint64_t rnd = rng_next(b);
+    if (p->max_file == p->min_file) return p->min_file;
+
+    int lo = 0, hi = 0;
+    while (lo < 63 && (1ULL << (lo + 1)) <= p->min_file + 1) lo++;
+    while (hi < 63 && (1ULL << (hi + 1)) <= p->max_file + 1) hi++;
+    int bits = lo + (int)((rnd & 0xff) % (hi - lo + 1));
+    uint64_t size = (1ULL << bits) - 1 + ((rnd >> 8) % (1ULL << bits));
+    if (size < p->min_file) size = p->min_file;
+    if (size > p->max_file) size = p->max_file;
+    return size;
+}
+
+static ino_t
+make_dir(struct builder *b, ino_t parent, int cg, int depth, char *path, size_t path_len) {
+    /**
+     * Creates a directory with its files and, below depth, its subdirectories
+     */
+    struct params *p = b->p;
+    uint64_t rnd = rng_next(b);
+    ino_t ino = alloc_inode(b, cg, 1);
+    if (!parent) parent = ino;
+
+    if (!b->dry_run && p->mirror && mkdir(path, 0755) == -1 &&
+        (ino != parent || errno != EEXIST)) {
+        perror(path);
+        exit(1);
+    }
+
+    struct entries ents = { 0 };
+    add_entry(&ents, ".", ino, DT_DIR);
+    add_entry(&ents, "..", parent, DT_DIR);
+
+    char name[64];
+    for (int i = 0; i < p->files; i++) {
+        // Name lengths vary so directory blocks have mixed record sizes
+        uint64_t shape = rng_next(b);
+        snprintf(name, sizeof(name), "f%d%.*s.dat", i,
+                 (int)(shape % 24), "_abcdefghijklmnopqrstuvwxyz");
+        snprintf(path + path_len, PATH_MAX - path_len, "/%s", name);
+
+        uint64_t size = pick_size(b);
+        int sparse = (int)(rng_next(b) % 100) < p->sparse_pct;
+        add_entry(&ents, name, make_file(b, cg, size, sparse, path), DT_REG);
+    }
+
+    int subdirs = 0;
+    if (depth > 0) {
+        for (int i = 0; i < p->fanout; i++) {
+            snprintf(name, sizeof(name), "d%d", i);
+            int name_len = snprintf(path + path_len, PATH_MAX - path_len, "/%s", name);
+
+            // Spread directories over the cylinder groups like ffs does
+            int child_cg = b->dry_run ? 0 : b->dir_rotor++ % b->sb->fs_ncg;
+            ino_t child = make_dir(b, ino, child_cg, depth - 1, path, path_len + name_len);
+            add_entry(&ents, name, child, DT_DIR);
+            subdirs++;
+        }
+    }
+
+    // Extras hang off the root
+    if (ino == parent) {
+        if (p->big_entries) {
+            int name_len = snprintf(path + path_len, PATH_MAX - path_len, "/big");
+            int big_cg = b->dry_run ? 0 : b->dir_rotor++ % b->sb->fs_ncg;
+            uint64_t big_rnd = rng_next(b);
+            ino_t big = alloc_inode(b, big_cg, 1);
+            if (!b->dry_run && p->mirror && mkdir(path, 0755) == -1) {
+                perror(path);
+                exit(1);
+            }
+
+            struct entries big_ents = { 0 };
+            add_entry(&big_ents, ".", big, DT_DIR);
+            add_entry(&big_ents, "..", ino, DT_DIR);
+            for (long i = 0; i < p->big_entries; i++) {
+                snprintf(name, sizeof(name), "entry%08ld", i);
+                snprintf(path + path_len + name_len, PATH_MAX - path_len - name_len, "/%s", name);
+                add_entry(&big_ents, name, make_file(b, big_cg, 0, 0, path), DT_REG);
+            }
+            if (!b->dry_run) {
+                struct ufs2_dinode *inode = inode_at(b, big);
+                init_inode(b, inode, IFDIR | 0755, big_rnd);
+                inode->di_nlink = 2;
+            }
+            write_directory(b, big, big_cg, &big_ents);
+            add_entry(&ents, "big", big, DT_DIR);
+            subdirs++;
+        }
+        if (p->huge_size) {
+            snprintf(path + path_len, PATH_MAX - path_len, "/sparse");
+            add_entry(&ents, "sparse", make_file(b, cg, p->huge_size, 2, path), DT_REG);
+        }
+    }
+    path[path_len] = '\0';
+
+    if (!b->dry_run) {
+        struct ufs2_dinode *inode = inode_at(b, ino);
+        init_inode(b, inode, IFDIR | 0755, rnd);
+        inode->di_nlink = 2 + subdirs;
+    }
+    write_directory(b, ino, cg, &ents);
+    return ino;
+}
+
+static void
+build_tree(struct builder *b) {
+    /**
+     * Runs one pass over the whole tree
+     */
+    char path[PATH_MAX];
+    size_t path_len = 0;
+    if (b->p->mirror) {
+        path_len = snprintf(path, sizeof(path), "%s", b->p->mirror);
+    }
+    path[path_len] = '\0';
+
+    b->rng = b->p->seed;
+    b->dir_rotor = 1;
+    b->tail_blk = 0;
+    b->tail_used = 0;
+    make_dir(b, 0, 0, b->p->depth, path, path_len);
+}
@@ -0,0 +1,157 @@
+/**
+ * fs-query.c
+ *
+ * Client for fs-serve: sends one request (serve.h) and writes the answer
+ * to stdout, so scripts get what fs-cat and fs-find would print without
+ * paying for opening and mapping the image every time.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE   // splice
+#endif
+#include <stdio.h>
+#include <stdlib.h>   // exit
+#include <string.h>   // strlen
+#include <unistd.h>   // read
+#include <fcntl.h>
+#include <limits.h>   // PATH_MAX
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.h"
+#include "ufsout.h" // ufs_write_all
+
+#define USAGE "usage: fs-query [-s socket] cat partition.img path\n" \
+              "       fs-query [-s socket] stat partition.img path\n" \
+              "       fs-query [-s socket] find partition.img [-0] [predicates]\n"
+
+// Predicates follow the image, glibc's getopt would pull them forward
+#ifdef __GLIBC__
+#define OPTIONS "+s:"
+#else
+#define OPTIONS "s:"
+#endif
+
+#define COPY_BUFSIZE (1 << 20)
+
+int
+main(int argc, char *argv[]) {
+    const char *socket_path = SERVE_SOCKET;
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 2 || ((!strcmp(argv[0], "cat") || !strcmp(argv[0], "stat")) && argc != 3) ||
+        (strcmp(argv[0], "cat") && strcmp(argv[0], "stat") && strcmp(argv[0], "find"))) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    // An empty string ends the request, so it cannot be an argument
+    for (int i = 0; i < argc; i++) {
+        if (!argv[i][0]) {
+            fprintf(stderr, "fs-query: empty argument\n");
+            exit(1);
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "fs-query: %s: socket path too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(socket_path);
+        exit(1);
+    }
+
+    // The daemon knows images by their real path
+    char image[PATH_MAX];
+    if (!realpath(argv[1], image)) snprintf(image, sizeof(image), "%s", argv[1]);
+    argv[1] = image;
+    int res = 0;
+    for (int i = 0; i < argc && !res; i++) res = ufs_write_all(sock, argv[i], strlen(argv[i]) + 1);
+    if (!res) res = ufs_write_all(sock, "", 1);
+    if (res == -1) {
+        perror("write");
+        exit(1);
+    }
+    shutdown(sock, SHUT_WR);
+
+    // Header line, maybe with the start of the body behind it
+    char *buffer = malloc(COPY_BUFSIZE);
+    if (!buffer) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t have = 0;
+    char *newline = NULL;
+    ssize_t n;
+    while (!newline && have < 4096) {
+        n = read(sock, buffer + have, 4096 - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "fs-query: no answer from %s\n", socket_path);
+            exit(1);
+        }
+        have += n;
+        newline = memchr(buffer, '\n', have);
+    }
+    if (!newline) {
+        fprintf(stderr, "fs-query: bad answer from %s\n", socket_path);
+        exit(1);
+    }
+    if (buffer[0] == '-') {
+        fprintf(stderr, "fs-query:%.*s\n", (int)(newline - buffer - 1), buffer + 1);
+        exit(1);
+    }
+    off_t left = strtoll(buffer, NULL, 10);
+
+    size_t body = have - (newline + 1 - buffer);
+    if ((off_t)body > left) body = left;
+    if (ufs_write_all(STDOUT_FILENO, newline + 1, body) == -1) {
+        perror("write");
+        exit(1);
+    }
+    left -= body;
+
+    // The rest goes straight from the socket into a pipe where it can
+#ifdef __linux__
+    while (left > 0) {
+        n = splice(sock, NULL, STDOUT_FILENO, NULL, left < (1 << 30) ? left : (1 << 30), SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= n;
+    }
+#endif
+    while (left > 0) {
+        n = read(sock, buffer, left < COPY_BUFSIZE ? left : COPY_BUFSIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "fs-query: answer cut short\n");
+            exit(1);
+        }
+        if (ufs_write_all(STDOUT_FILENO, buffer, n) == -1) {
+            perror("write");
+            exit(1);
+        }
+        left -= n;
+    }
+    free(buffer);
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,776 @@
+/**
+ * fs-serve.c
+ *
+ * Long-lived daemon for fs-query: keeps the images it was started with
+ * mapped and answers cat/stat/find requests on a Unix socket (serve.h),
+ * one thread per connection. Paths it resolved, and the dirhash tables of
+ * large directories on the way, are kept per image, so a repeated lookup
+ * is one probe. An image file that was replaced or touched (stat(2)) is
+ * opened afresh, and the caches of one whose superblock changed in place
+ * are dropped. File data goes to the socket with sendfile(2) where there
+ * is one (ufsout.c).
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memcpy
+#include <unistd.h>   // read, close
+#include <limits.h>   // PATH_MAX
+#include <stdint.h>   // intptr_t
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ufsread.h"
+#include "ufsout.h"
+#include "ufsindex.h" // ufs_index_hash
+#include "dirhash.h"
+#include "dirscan.h"
+#include "textout.h"
+#include "filter.h"
+#include "serve.h"
+
+#define USAGE "usage: fs-serve [-s socket] partition.img ...\n"
+
+// Resolved paths kept per image before the cache starts over
+#define PATH_CACHE_MAX (1 << 20)
+
+struct path_slot {
+    uint64_t hash;              // 0 marks an empty slot
+    const char *path;
+    size_t len;
+    ino_t inode_num;
+    int type;
+};
+
+// One opening of an image; a newer one takes over when the file changes
+struct served {
+    const char *path;           // real path, which clients name it by
+    struct ufs_image image;
+    struct stat file_info;      // when it was opened
+    int refs;                   // requests still using it, and the table while current
+
+    // Lookup caches, filled as requests come in. Lookups hold cache_lock
+    // for reading the whole way, so no table goes away under them, and
+    // lock just while they probe or add to a cache; directories are read
+    // outside it. Dropping the caches takes cache_lock for writing
+    pthread_rwlock_t cache_lock;
+    pthread_mutex_t lock;
+    int64_t fs_time;            // superblock the caches go with
+    int8_t fs_fmod;
+    struct ufs_dirhash_cache dirhash;
+    struct ufs_arena arena;     // cached paths
+    struct path_slot *slots;
+    size_t nslots, npaths;
+};
+
+static struct served **images;
+static int nimages;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct served *serve_open(const char *path);
+void serve_close(struct served *served);
+struct served *serve_acquire(const char *path, char *error, size_t error_size);
+void serve_release(struct served *served);
+void *serve_client(void *arg);
+int serve_request(struct ufs_out *out, char **args, int nargs);
+int reply_error(struct ufs_out *out, const char *what, const char *message);
+int reply_cat(struct ufs_out *out, struct served *served, char *path);
+int reply_stat(struct ufs_out *out, struct served *served, char *path);
+int reply_find(struct ufs_out *out, struct served *served, char **args, int nargs);
+int reply_text(struct ufs_out *out, struct ufs_text *text);
+int resolve(struct served *served, char *path, ino_t *inode_num, int *type);
+int lookup_entry(
+    struct served *served,
+    ino_t dir_inode,
+    const char *name,
+    size_t namlen,
+    ino_t *inode_num,
+    int *type
+);
+int cache_get(
+    struct served *served,
+    const char *path,
+    size_t len,
+    uint64_t hash,
+    ino_t *inode_num,
+    int *type
+);
+struct path_slot *cache_find(struct served *served, const char *path, size_t len, uint64_t hash);
+void cache_add(struct served *served, const char *path, size_t len, uint64_t hash, ino_t inode_num, int type);
+void cache_clear(struct served *served);
+void find_directory(
+    struct served *served,
+    struct ufs_filter *filter,
+    struct ufs_text *text,
+    char terminator,
+    ino_t inode_num,
+    char *path,
+    size_t path_len,
+    int depth
+);
+
+int
+main(int argc, char *argv[]) {
+    const char *socket_path = SERVE_SOCKET;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    // Every image is opened up front, so a bad one shows up now
+    images = calloc(argc, sizeof(struct served *));
+    if (!images) {
+        perror("calloc");
+        exit(1);
+    }
+    char real[PATH_MAX];
+    for (nimages = 0; nimages < argc; nimages++) {
+        if (!realpath(argv[nimages], real) || !(images[nimages] = serve_open(real))) {
+            perror(argv[nimages]);
+            exit(1);
+        }
+        images[nimages]->refs = 1; // the table's
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "fs-serve: %s: socket path too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // A socket someone still answers on is left alone, a stale one goes
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "fs-serve: %s: already being served\n", socket_path);
+        exit(1);
+    }
+    unlink(socket_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 128) == -1) {
+        perror(socket_path);
+        exit(1);
+    }
+
+    // A client hanging up is a failed write, not the end of the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int fd;
+    for (;;) {
+        fd = accept(sock, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(1);
+        }
+        if (pthread_create(&thread, &attr, serve_client, (void *)(intptr_t)fd)) {
+            fprintf(stderr, "fs-serve: no thread for a client, dropping it\n");
+            close(fd);
+        }
+    }
+}
+
+struct served *
+serve_open(const char *path) {
+    /**
+     * Maps an image with empty caches. Returns NULL with errno set
+     */
+    struct served *served = calloc(1, sizeof(struct served));
+    if (!served) return NULL;
+    if (stat(path, &served->file_info) == -1 ||
+        ufs_open(&served->image, path, UFS_BACKEND_MMAP) == -1) {
+        free(served);
+        return NULL;
+    }
+    served->path = strdup(path);
+    if (!served->path) {
+        perror("strdup");
+        exit(1);
+    }
+    pthread_rwlock_init(&served->cache_lock, NULL);
+    pthread_mutex_init(&served->lock, NULL);
+    ufs_dirhash_init(&served->dirhash, UFS_DIRHASH_MINSIZE);
+    served->fs_time = served->image.superblock->fs_time;
+    served->fs_fmod = served->image.superblock->fs_fmod;
+    return served;
+}
+
+void
+serve_close(struct served *served) {
+    cache_clear(served);
+    ufs_dirhash_free(&served->dirhash);
+    pthread_mutex_destroy(&served->lock);
+    pthread_rwlock_destroy(&served->cache_lock);
+    ufs_close(&served->image);
+    free((void *)served->path);
+    free(served);
+}
+
+struct served *
+serve_acquire(const char *path, char *error, size_t error_size) {
+    /**
+     * The current opening of the image at path, reopened first if the
+     * file is not the one that was mapped. NULL (and a message in error)
+     * for an image that is not served or cannot be opened any more. The
+     * new opening is mapped outside images_lock, so requests for other
+     * images carry on meanwhile
+     */
+    struct served *served, *fresh, *extra = NULL, *old = NULL;
+    struct stat file_info;
+    int i;
+
+    pthread_mutex_lock(&images_lock);
+    for (i = 0; i < nimages && strcmp(images[i]->path, path); i++);
+    if (i == nimages) {
+        pthread_mutex_unlock(&images_lock);
+        snprintf(error, error_size, "%s: not served", path);
+        return NULL;
+    }
+    served = images[i];
+    served->refs++;
+    pthread_mutex_unlock(&images_lock);
+
+    if (stat(path, &file_info) == 0 &&
+        file_info.st_dev == served->file_info.st_dev &&
+        file_info.st_ino == served->file_info.st_ino &&
+        file_info.st_size == served->file_info.st_size &&
+        file_info.st_mtime == served->file_info.st_mtime) {
+        return served;
+    }
+
+    fresh = serve_open(path);
+    if (!fresh) {
+        snprintf(error, error_size, "%s: %s", path, strerror(errno));
+        serve_release(served);
+        return NULL;
+    }
+
+    // Someone else may have swapped in a newer opening meanwhile: use theirs
+    pthread_mutex_lock(&images_lock);
+    if (images[i] == served) {
+        fresh->refs = 2; // the table's and ours
+        images[i] = fresh;
+        served->refs--;
+    } else {
+        extra = fresh;
+        fresh = images[i];
+        fresh->refs++;
+    }
+    if (!--served->refs) old = served;
+    pthread_mutex_unlock(&images_lock);
+
+    // Unmapping and freeing the caches can take a while, keep it unlocked
+    if (old) serve_close(old);
+    if (extra) serve_close(extra);
+    return fresh;
+}
+
+void
+serve_release(struct served *served) {
+    /**
+     * Ends a request's use of an image; the last user of a replaced one
+     * unmaps it, outside images_lock
+     */
+    pthread_mutex_lock(&images_lock);
+    int last = !--served->refs;
+    pthread_mutex_unlock(&images_lock);
+    if (last) serve_close(served);
+}
+
+void *
+serve_client(void *arg) {
+    /**
+     * Answers one connection's requests until it is closed
+     */
+    int fd = (intptr_t)arg;
+    char *request = malloc(SERVE_REQUEST_MAX);
+    struct ufs_out *out = malloc(sizeof(struct ufs_out));
+    if (!request || !out) {
+        perror("malloc");
+        exit(1);
+    }
+    ufs_out_init(out, fd);
+
+    char *args[SERVE_ARGS_MAX];
+    size_t have = 0, start, used;
+    ssize_t n;
+    int nargs, complete;
+    for (;;) {
+        // Split off strings until the empty one that ends the request
+        nargs = 0;
+        complete = 0;
+        start = 0;
+        for (used = 0; used < have; used++) {
+            if (request[used]) continue;
+            if (used == start) {
+                complete = 1;
+                used++;
+                break;
+            }
+            if (nargs < SERVE_ARGS_MAX) args[nargs] = request + start;
+            nargs++;
+            start = used + 1;
+        }
+
+        if (complete) {
+            if (nargs > SERVE_ARGS_MAX) {
+                if (reply_error(out, NULL, "too many arguments") == -1) break;
+            } else if (serve_request(out, args, nargs) == -1) {
+                break;
+            }
+            if (ufs_out_flush(out) == -1) break;
+            memmove(request, request + used, have - used);
+            have -= used;
+            continue;
+        }
+
+        if (have == SERVE_REQUEST_MAX) {
+            reply_error(out, NULL, "request too long");
+            ufs_out_flush(out);
+            break;
+        }
+        n = read(fd, request + have, SERVE_REQUEST_MAX - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+    }
+
+    close(fd);
+    free(out->bounce);
+    free(out);
+    free(request);
+    return NULL;
+}
+
+int
+serve_request(struct ufs_out *out, char **args, int nargs) {
+    /**
+     * Answers one request. Returns -1 when the client is gone
+     */
+    if (nargs < 2) return reply_error(out, NULL, "missing command or image");
+
+    char error[PATH_MAX + 64];
+    struct served *served = serve_acquire(args[1], error, sizeof(error));
+    if (!served) return reply_error(out, NULL, error);
+
+    int res;
+    if (!strcmp(args[0], "cat") && nargs == 3) {
+        res = reply_cat(out, served, args[2]);
+    } else if (!strcmp(args[0], "stat") && nargs == 3) {
+        res = reply_stat(out, served, args[2]);
+    } else if (!strcmp(args[0], "find")) {
+        res = reply_find(out, served, args + 2, nargs - 2);
+    } else {
+        res = reply_error(out, args[0], "bad command");
+    }
+    serve_release(served);
+    return res;
+}
+
+int
+reply_error(struct ufs_out *out, const char *what, const char *message) {
+    /**
+     * Answers "- <what>: <message>\n", or just the message
+     */
+    char line[PATH_MAX + 512];
+    int len = snprintf(line, sizeof(line), "- %s%s%s\n", what ? what : "", what ? ": " : "", message);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    return ufs_out_bytes(out, line, len);
+}
+
+int
+reply_cat(struct ufs_out *out, struct served *served, char *path) {
+    /**
+     * Answers with a regular file's contents, holes as zeros
+     */
+    ino_t inode_num;
+    int type;
+    if (!resolve(served, path, &inode_num, &type) || type != DT_REG) {
+        return reply_error(out, path, "no such file");
+    }
+
+    struct ufs_image *image = &served->image;
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+    char header[32];
+    int len = snprintf(header, sizeof(header), "%ju\n", (uintmax_t)inode->di_size);
+    if (ufs_out_bytes(out, header, len) == -1) return -1;
+
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    off_t written = 0;
+    int res = 0;
+    ufs_extent_begin(&iter, image, inode);
+    while (!res && ufs_extent_next(&iter, &extent)) {
+        res = ufs_out_zeros(out, extent.logical - written);
+        if (!res) res = ufs_out_extent(out, image, extent.physical, extent.length);
+        written = extent.logical + extent.length;
+    }
+    ufs_extent_end(&iter);
+    if (!res) res = ufs_out_zeros(out, (off_t)inode->di_size - written);
+    ufs_put(image, buf);
+    return res;
+}
+
+int
+reply_stat(struct ufs_out *out, struct served *served, char *path) {
+    /**
+     * Answers with the line fs-find -J prints for path
+     */
+    ino_t inode_num;
+    int type;
+    if (!resolve(served, path, &inode_num, &type)) {
+        return reply_error(out, path, "no such file or directory");
+    }
+
+    static const char letters[] = { [DT_REG] = 'f', [DT_DIR] = 'd', [DT_LNK] = 'l',
+        [DT_CHR] = 'c', [DT_BLK] = 'b', [DT_FIFO] = 'p', [DT_SOCK] = 's', [DT_WHT] = 'w' };
+    char letter[] = { '"', (type < (int)sizeof(letters) && letters[type]) ? letters[type] : '?', '"' };
+
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(&served->image, inode_num, &buf);
+    struct ufs_text text;
+    ufs_text_init(&text, -1);
+    ufs_text_bytes(&text, "{\"path\":", 8);
+    ufs_text_json(&text, path, strlen(path));
+    ufs_text_bytes(&text, ",\"ino\":", 7);
+    ufs_text_uint(&text, inode_num);
+    ufs_text_bytes(&text, ",\"type\":", 8);
+    ufs_text_bytes(&text, letter, sizeof(letter));
+    ufs_text_bytes(&text, ",\"size\":", 8);
+    ufs_text_uint(&text, inode->di_size);
+    ufs_text_bytes(&text, ",\"mtime\":", 9);
+    ufs_text_int(&text, inode->di_mtime);
+    ufs_text_bytes(&text, "}\n", 2);
+    ufs_put(&served->image, buf);
+    return reply_text(out, &text);
+}
+
+int
+reply_find(struct ufs_out *out, struct served *served, char **args, int nargs) {
+    /**
+     * Answers with the paths fs-find would print for the predicates, one
+     * per line or (after -0) each followed by a NUL
+     */
+    char terminator = '\n';
+    if (nargs && !strcmp(args[0], "-0")) {
+        terminator = '\0';
+        args++;
+        nargs--;
+    }
+
+    struct ufs_filter filter;
+    char error[256];
+    if (ufs_filter_parse(&filter, nargs, args, error, sizeof(error)) == -1) {
+        ufs_filter_free(&filter);
+        return reply_error(out, NULL, error);
+    }
+
+    struct ufs_text text;
+    char path[PATH_MAX];
+    path[0] = '\0';
+    ufs_text_init(&text, -1);
+    if (ufs_filter_descend(&filter, 0)) {
+        find_directory(served, &filter, &text, terminator, UFS_ROOTINO, path, 0, 1);
+    }
+    ufs_filter_free(&filter);
+    return reply_text(out, &text);
+}
+
+int
+reply_text(struct ufs_out *out, struct ufs_text *text) {
+    /**
+     * Answers with a buffer put together in memory
+     */
+    size_t len;
+    char *data = ufs_text_take(text, &len);
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "%zu\n", len);
+    int res = ufs_out_bytes(out, header, header_len);
+    if (!res && len) res = ufs_out_bytes(out, data, len);
+    if (!res) res = ufs_out_flush(out); // data is freed right after
+    free(data);
+    ufs_text_free(text);
+    return res;
+}
+
+int
+resolve(struct served *served, char *path, ino_t *inode_num, int *type) {
+    /**
+     * Finds path (normalized in place, ufs_normalize_path) from the root.
+     * Every directory on the way, and path itself, is remembered, so the
+     * next request below them starts where this one ended. Returns 0 when
+     * it is not there
+     */
+    size_t len = ufs_normalize_path(path);
+
+    *inode_num = UFS_ROOTINO;
+    *type = DT_DIR;
+    if (!len) return 1;
+
+    // The caches go with one version of the superblock
+    struct fs *superblock = served->image.superblock;
+    pthread_rwlock_rdlock(&served->cache_lock);
+    if (superblock->fs_time != served->fs_time || superblock->fs_fmod != served->fs_fmod) {
+        pthread_rwlock_unlock(&served->cache_lock);
+        pthread_rwlock_wrlock(&served->cache_lock);
+        if (superblock->fs_time != served->fs_time || superblock->fs_fmod != served->fs_fmod) {
+            cache_clear(served);
+            ufs_dirhash_free(&served->dirhash);
+            ufs_dirhash_init(&served->dirhash, UFS_DIRHASH_MINSIZE);
+            served->fs_time = superblock->fs_time;
+            served->fs_fmod = superblock->fs_fmod;
+        }
+        pthread_rwlock_unlock(&served->cache_lock);
+        pthread_rwlock_rdlock(&served->cache_lock);
+    }
+
+    // The whole path first, then one component at a time
+    int found = cache_get(served, path, len, ufs_index_hash(path, len), inode_num, type);
+    size_t end = 0, start;
+    uint64_t hash;
+    while (!found && end < len) {
+        start = end ? end + 1 : 0;
+        for (end = start; end < len && path[end] != '/'; end++);
+        hash = ufs_index_hash(path, end);
+        if (end < len && cache_get(served, path, end, hash, inode_num, type)) continue;
+        if (*type != DT_DIR ||
+            !lookup_entry(served, *inode_num, path + start, end - start, inode_num, type)) {
+            break;
+        }
+
+        pthread_mutex_lock(&served->lock);
+        if (!cache_find(served, path, end, hash)) cache_add(served, path, end, hash, *inode_num, *type);
+        pthread_mutex_unlock(&served->lock);
+        found = end == len;
+    }
+    pthread_rwlock_unlock(&served->cache_lock);
+    return found;
+}
+
+int
+lookup_entry(
+    struct served *served,
+    ino_t dir_inode,
+    const char *name,
+    size_t namlen,
+    ino_t *inode_num,
+    int *type
+) {
+    /**
+     * Finds name in a directory, through its dirhash table when it is
+     * large. A missing table is built outside the lock, so other lookups
+     * are not held up by it. Called with cache_lock held for reading.
+     * Returns 1 and fills in inode_num/type when it is there
+     */
+    struct ufs_image *image = &served->image;
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, dir_inode, &buf);
+    struct ufs_dirhash *table = NULL, *built;
+    if ((off_t)inode->di_size >= served->dirhash.minsize) {
+        pthread_mutex_lock(&served->lock);
+        table = ufs_dirhash_lookup(&served->dirhash, dir_inode);
+        pthread_mutex_unlock(&served->lock);
+        if (!table) {
+            struct ufs_arena arena = { 0 };
+            built = ufs_dirhash_build(&arena, image, dir_inode, inode);
+            pthread_mutex_lock(&served->lock);
+            table = ufs_dirhash_lookup(&served->dirhash, dir_inode);
+            if (!table) {
+                ufs_dirhash_insert(&served->dirhash, built, &arena);
+                table = built;
+            }
+            pthread_mutex_unlock(&served->lock);
+            ufs_arena_free(&arena); // only if another thread got there first
+        }
+    }
+    if (table) {
+        ufs_put(image, buf);
+        const struct ufs_dirhash_slot *slot = ufs_dirhash_find(table, name, namlen);
+        if (!slot) return 0;
+        *inode_num = slot->inode;
+        *type = slot->type;
+        return 1;
+    }
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir = NULL;
+    ufs_dir_begin(&iter, image, inode);
+    while (!dir && (data = ufs_dir_next(&iter, &physical, &length))) {
+        dir = ufs_dirscan_find(data, length, name, namlen);
+        if (dir) {
+            *inode_num = dir->d_ino;
+            *type = dir->d_type;
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    return dir != NULL;
+}
+
+int
+cache_get(
+    struct served *served,
+    const char *path,
+    size_t len,
+    uint64_t hash,
+    ino_t *inode_num,
+    int *type
+) {
+    /**
+     * cache_find under the lock, copying the answer out. Returns 0 when
+     * the first len bytes of path have not been resolved
+     */
+    pthread_mutex_lock(&served->lock);
+    struct path_slot *slot = cache_find(served, path, len, hash);
+    if (slot) {
+        *inode_num = slot->inode_num;
+        *type = slot->type;
+    }
+    pthread_mutex_unlock(&served->lock);
+    return slot != NULL;
+}
+
+struct path_slot *
+cache_find(struct served *served, const char *path, size_t len, uint64_t hash) {
+    /**
+     * The cached resolution of the first len bytes of path, or NULL
+     */
+    if (!served->nslots) return NULL;
+    size_t mask = served->nslots - 1;
+    struct path_slot *slot;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &served->slots[i];
+        if (!slot->hash) return NULL;
+        if (slot->hash == hash && slot->len == len && !memcmp(slot->path, path, len)) return slot;
+    }
+}
+
+void
+cache_add(struct served *served, const char *path, size_t len, uint64_t hash, ino_t inode_num, int type) {
+    /**
+     * Remembers a resolved path, starting over once PATH_CACHE_MAX are kept
+     */
+    if (served->npaths == PATH_CACHE_MAX) cache_clear(served);
+
+    // Grow at half full, rehashing what is there
+    if ((served->npaths + 1) * 2 > served->nslots) {
+        size_t nslots = served->nslots ? served->nslots * 2 : 1024, i;
+        struct path_slot *slots = calloc(nslots, sizeof(struct path_slot));
+        if (!slots) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t n = 0; n < served->nslots; n++) {
+            if (!served->slots[n].hash) continue;
+            for (i = served->slots[n].hash & (nslots - 1); slots[i].hash; i = (i + 1) & (nslots - 1));
+            slots[i] = served->slots[n];
+        }
+        free(served->slots);
+        served->slots = slots;
+        served->nslots = nslots;
+    }
+
+    char *copy = ufs_arena_alloc(&served->arena, len);
+    memcpy(copy, path, len);
+    size_t mask = served->nslots - 1, i;
+    for (i = hash & mask; served->slots[i].hash; i = (i + 1) & mask);
+    served->slots[i].hash = hash;
+    served->slots[i].path = copy;
+    served->slots[i].len = len;
+    served->slots[i].inode_num = inode_num;
+    served->slots[i].type = type;
+    served->npaths++;
+}
+
+void
+cache_clear(struct served *served) {
+    free(served->slots);
+    served->slots = NULL;
+    served->nslots = served->npaths = 0;
+    ufs_arena_free(&served->arena);
+}
+
+void
+find_directory(
+    struct served *served,
+    struct ufs_filter *filter,
+    struct ufs_text *text,
+    char terminator,
+    ino_t inode_num,
+    char *path,
+    size_t path_len,
+    int depth
+) {
+    /**
+     * Adds the entries below a directory that pass the filter, walking
+     * like fs-find: hidden entries are skipped, pruned directories and
+     * those past -maxdepth are not read. depth is that of the entries
+     */
+    struct ufs_image *image = &served->image;
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(image, inode_num, &buf);
+
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    struct direct *dir;
+    size_t len;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || dir->d_name[0] == '.') continue;
+
+            len = path_len;
+            if (len + dir->d_namlen + 2 > PATH_MAX) continue;
+            if (len) path[len++] = '/';
+            memcpy(path + len, dir->d_name, dir->d_namlen);
+            len += dir->d_namlen;
+            path[len] = '\0';
+
+            if (ufs_filter_pruned(filter, path, len)) continue;
+            if (ufs_filter_match(filter, image, dir, path, len, depth)) {
+                ufs_text_bytes(text, path, len);
+                ufs_text_char(text, terminator);
+            }
+            if (dir->d_type == DT_DIR && ufs_filter_descend(filter, depth)) {
+                find_directory(served, filter, text, terminator, dir->d_ino, path, len, depth + 1);
+            }
+        }
+    }
+    ufs_dir_end(&iter);
+    ufs_put(image, buf);
+    path[path_len] = '\0';
+}
@@ -0,0 +1,834 @@
+/**
+ * fs-stat.c
+ *
+ * Free space of an image from its cylinder group bitmaps: free blocks,
+ * free fragments and free inodes, the fragment runs of partly used blocks
+ * and a histogram of runs of free blocks. The counts are checked against
+ * each cg's own summary (cg_cs, cg_frsum) and the superblock's
+ * fs_cstotal. Cylinder groups are independent, so -j counts them on that
+ * many threads.
+ *
+ * Bitmaps are counted a 64-bit word at a time with popcount. With the
+ * usual eight fragments per block each block is one byte of the free
+ * map, so SSE2 compares 16 of them against 0xff (all free) and 0 (all
+ * used) at once; runs are then found with count-trailing-zeros jumps over
+ * the resulting one-bit-per-block maps.
+ *
+ * -F and -w N also look at how files and directories are laid out: each
+ * inode's blocks are walked with the extent iterator fs-cat reads them
+ * with, counting the physically discontiguous extents, the indirect blocks
+ * above them, the cylinder groups they are spread over and how far apart
+ * consecutive extents are. -F lists every file, -w N the N with the most
+ * extents; both add totals for files and for directories. The inode
+ * tables are scanned in the same cg tasks as the bitmaps.
+ */
+#include <stdio.h>
+#include <stdlib.h>   // exit
+#include <string.h>   // memcpy
+#include <getopt.h>   // getopt_long
+#include <stdint.h>
+#include <limits.h>   // PATH_MAX
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ufsread.h"
+#include "ufsscan.h"  // ufs_cg
+#include "ufsstats.h"
+#include "textout.h"
+#include "pool.h"
+
+#define USAGE "usage: fs-stat [-g] [-F | -w count] [-j threads] [-B mmap|pread|aio] [--stats[=mincore]] partition.img\n"
+
+// Long options have no short letter
+#define OPT_STATS 256
+
+static const struct option long_options[] = {
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { NULL, 0, NULL, 0 },
+};
+
+// Free runs are counted in power of two buckets of blocks: 1, 2-3, 4-7, ...
+#define RUN_BUCKETS 32
+
+// Layout of one file's blocks
+struct file_layout {
+    ino_t inode;
+    int dir;
+    off_t size;
+    int64_t extents;            // physically discontiguous runs of blocks
+    int64_t indirect;           // indirect blocks above them
+    int64_t cgs;                // cylinder groups they are in
+    int64_t seek;               // bytes between the end of a run and the next
+};
+
+struct layout_sum {
+    int64_t files, fragmented;  // fragmented: more than one extent
+    int64_t extents, indirect, cgs, seek;
+    int64_t gaps;               // between the extents of a file
+    off_t size;
+    int64_t buckets[RUN_BUCKETS]; // files by extents, power of two buckets
+};
+
+// Which indirect blocks a file's walk has counted, per tree and level
+struct indirect_walk {
+    int64_t last[UFS_NIADDR][UFS_NIADDR];
+    int64_t count;
+};
+
+struct cg_stat {
+    int cg;
+    int bad;                    // header missing or unreadable
+    int64_t nbfree, nffree, nifree;
+    int64_t frsum[MAXFRAG];     // free fragment runs inside partly used blocks
+    int64_t runs[RUN_BUCKETS], run_blocks[RUN_BUCKETS];
+    int64_t largest;            // longest run of free blocks
+
+    // What the cg header says, for the check
+    struct csum cs;
+    int64_t cg_frsum[MAXFRAG];
+
+    // -F and -w: totals for files (0) and directories (1), -F's records
+    struct layout_sum layout[2];
+    struct file_layout *files;
+    size_t nfiles, cap;
+
+    // Cylinder groups the current file has been seen in
+    uint8_t *cg_seen;
+    int *cg_list;
+    int ncgs;
+};
+
+static struct ufs_image *stat_image;
+static int layout_all;          // -F
+static struct ufs_parents stat_parents;
+
+// The -w worst files, in a min-heap on extents then seek
+static int worst_count, worst_len;
+static struct file_layout *worst;
+static pthread_mutex_t worst_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int count_bits(const uint8_t *bitmap, int64_t nbits);
+void stat_cg(void *arg);
+void block_maps(
+    const uint8_t *free_map,
+    int64_t nblocks,
+    int frag,
+    uint64_t *all_free,
+    uint64_t *any_free
+);
+void count_runs(struct cg_stat *stat, const uint64_t *all_free, int64_t nblocks);
+void count_fragments(
+    struct cg_stat *stat,
+    const uint8_t *free_map,
+    int64_t first,
+    int count
+);
+int64_t next_bit(const uint64_t *words, int64_t nbits, int64_t from, int set);
+int check_cg(const struct cg_stat *stat, int frag);
+void print_size(int64_t count, int64_t unit);
+void layout_inode(void *arg, ino_t inode_num, struct ufs2_dinode *inode);
+void count_indirect(
+    struct indirect_walk *walk,
+    const struct fs *superblock,
+    ufs_lbn_t start,
+    ufs_lbn_t end
+);
+void add_cgs(struct cg_stat *stat, const struct fs *superblock, off_t physical, off_t length);
+int worse(const struct file_layout *a, const struct file_layout *b);
+void worst_add(const struct file_layout *file);
+void print_layout_sum(const char *label, const struct layout_sum *sum, int64_t bsize);
+void print_file(struct ufs_text *text, const struct file_layout *file);
+const char *bucket_span(char *span, size_t size, int bucket);
+void text_column(struct ufs_text *text, uint64_t value, int width);
+
+static inline int
+popcount64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+static inline int
+ctz64(uint64_t word) {
+    /**
+     * Index of the lowest set bit; word is not 0
+     */
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+int
+main(int argc, char *argv[]) {
+    enum ufs_backend backend = UFS_BACKEND_MMAP;
+    int opt, num_threads = 0, per_cg = 0;
+    while ((opt = getopt_long(argc, argv, "B:Fgj:w:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "mincore")) {
+                fprintf(stderr, "fs-stat: --stats only takes =mincore\n");
+                exit(1);
+            }
+            ufs_stats_enable(optarg != NULL);
+            break;
+        case 'B':
+            if (ufs_backend_parse(optarg, &backend) == -1) {
+                fprintf(stderr, "fs-stat: -B takes mmap, pread or aio\n");
+                exit(1);
+            }
+            break;
+        case 'F':
+            layout_all = 1;
+            break;
+        case 'g':
+            per_cg = 1;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "fs-stat: -j needs a positive thread count\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            worst_count = atoi(optarg);
+            if (worst_count < 1) {
+                fprintf(stderr, "fs-stat: -w needs a positive count\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || (layout_all && worst_count)) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    struct ufs_image image;
+    ufs_stats_phase("open");
+    if (ufs_open(&image, argv[0], backend) == -1) {
+        perror(argv[0]);
+        exit(1);
+    }
+    ufs_stats_opened(&image);
+    struct fs *superblock = image.superblock;
+
+    // One task per cylinder group, added up in cg order afterwards
+    ufs_stats_phase("count");
+    int ncg = superblock->fs_ncg;
+    struct cg_stat *stats = calloc(ncg, sizeof(struct cg_stat));
+    if (!stats) {
+        perror("calloc");
+        exit(1);
+    }
+    stat_image = &image;
+    if (layout_all || worst_count) {
+        if (ufs_parents_init(&stat_parents, &image) == -1) {
+            perror("calloc");
+            exit(1);
+        }
+        if (worst_count && !(worst = calloc(worst_count, sizeof(struct file_layout)))) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    struct pool *pool = NULL;
+    if (num_threads) {
+        pool = pool_create(num_threads);
+        if (!pool) {
+            perror("pool_create");
+            exit(1);
+        }
+    }
+    for (int c = 0; c < ncg; c++) {
+        stats[c].cg = c;
+        if (pool) {
+            pool_submit(pool, stat_cg, &stats[c]);
+        } else {
+            stat_cg(&stats[c]);
+        }
+    }
+    if (pool) {
+        pool_wait(pool);
+        pool_destroy(pool);
+    }
+
+    ufs_stats_phase("report");
+    struct cg_stat total;
+    memset(&total, 0, sizeof(total));
+    int frag = superblock->fs_frag, mismatches = 0;
+    if (per_cg) printf("%6s %12s %12s %12s %12s\n", "cg", "free blocks", "free frags", "free inodes", "largest run");
+    for (int c = 0; c < ncg; c++) {
+        struct cg_stat *stat = &stats[c];
+        if (stat->bad) {
+            fprintf(stderr, "fs-stat: cg %d: bad cylinder group header\n", c);
+            mismatches++;
+            continue;
+        }
+        mismatches += check_cg(stat, frag);
+        if (per_cg) {
+            printf("%6d %12jd %12jd %12jd %12jd\n", c, (intmax_t)stat->nbfree, (intmax_t)stat->nffree,
+                   (intmax_t)stat->nifree, (intmax_t)stat->largest);
+        }
+
+        total.nbfree += stat->nbfree;
+        total.nffree += stat->nffree;
+        total.nifree += stat->nifree;
+        for (int i = 0; i < MAXFRAG; i++) total.frsum[i] += stat->frsum[i];
+        for (int i = 0; i < RUN_BUCKETS; i++) {
+            total.runs[i] += stat->runs[i];
+            total.run_blocks[i] += stat->run_blocks[i];
+        }
+        if (stat->largest > total.largest) total.largest = stat->largest;
+
+        for (int t = 0; t < 2; t++) {
+            struct layout_sum *sum = &total.layout[t], *add = &stat->layout[t];
+            sum->files += add->files;
+            sum->fragmented += add->fragmented;
+            sum->extents += add->extents;
+            sum->indirect += add->indirect;
+            sum->cgs += add->cgs;
+            sum->seek += add->seek;
+            sum->gaps += add->gaps;
+            sum->size += add->size;
+            for (int i = 0; i < RUN_BUCKETS; i++) sum->buckets[i] += add->buckets[i];
+        }
+    }
+    if (per_cg) printf("\n");
+
+    int64_t frags = superblock->fs_dsize, inodes = (int64_t)superblock->fs_ipg * ncg;
+    int64_t free_frags = total.nbfree * frag + total.nffree;
+    printf("size          %jd fragments of %d bytes, %d cylinder groups\n",
+           (intmax_t)superblock->fs_size, superblock->fs_fsize, ncg);
+    printf("free          %jd of %jd data fragments (%.1f%%), ",
+           (intmax_t)free_frags, (intmax_t)frags, frags ? 100.0 * free_frags / frags : 0.0);
+    print_size(free_frags, superblock->fs_fsize);
+    printf("free blocks   %jd, largest run %jd\n", (intmax_t)total.nbfree, (intmax_t)total.largest);
+    printf("free frags    %jd in partly used blocks, runs of", (intmax_t)total.nffree);
+    for (int i = 1; i < frag; i++) printf(" %d: %jd", i, (intmax_t)total.frsum[i]);
+    printf("\nfree inodes   %jd of %jd\n", (intmax_t)total.nifree, (intmax_t)inodes);
+    char span[32];
+    printf("free runs     %12s %12s %12s\n", "blocks", "runs", "total");
+    for (int i = 0; i < RUN_BUCKETS; i++) {
+        if (!total.runs[i]) continue;
+        printf("              %12s %12jd %12jd\n", bucket_span(span, sizeof(span), i),
+               (intmax_t)total.runs[i], (intmax_t)total.run_blocks[i]);
+    }
+
+    if (layout_all || worst_count) {
+        printf("layout        %12s %12s %12s %12s %12s %12s\n",
+               "files", "fragmented", "extents", "indirect", "cgs/file", "seek/gap");
+        print_layout_sum("files", &total.layout[0], superblock->fs_bsize);
+        print_layout_sum("directories", &total.layout[1], superblock->fs_bsize);
+        printf("extents       %12s %12s\n", "per file", "files");
+        for (int i = 0; i < RUN_BUCKETS; i++) {
+            int64_t files = total.layout[0].buckets[i] + total.layout[1].buckets[i];
+            if (!files) continue;
+            printf("              %12s %12jd\n", bucket_span(span, sizeof(span), i), (intmax_t)files);
+        }
+    }
+
+    // The superblock's totals are only current on a clean file system
+    struct csum_total *cstotal = &superblock->fs_cstotal;
+    if (cstotal->cs_nbfree != total.nbfree || cstotal->cs_nffree != total.nffree ||
+        cstotal->cs_nifree != total.nifree) {
+        fprintf(stderr, "fs-stat: fs_cstotal says %jd blocks, %jd frags, %jd inodes free%s\n",
+                (intmax_t)cstotal->cs_nbfree, (intmax_t)cstotal->cs_nffree, (intmax_t)cstotal->cs_nifree,
+                superblock->fs_clean ? "" : " (file system not clean)");
+        mismatches++;
+    }
+    printf("check         %s\n", mismatches ? "summaries differ from the bitmaps" : "summaries match the bitmaps");
+
+    fflush(stdout);
+
+    // Everything is named now that all the directories have been read
+    if (layout_all || worst_count) {
+        ufs_stats_phase("paths");
+        struct ufs_text text;
+        ufs_text_init(&text, 1);
+        if (layout_all || worst_len) {
+            static const char header[] = "\n   inode  extents indirect  cgs  seek/gap KiB         size path\n";
+            ufs_text_bytes(&text, header, sizeof(header) - 1);
+        }
+        for (int c = 0; c < ncg; c++) {
+            for (size_t n = 0; n < stats[c].nfiles; n++) print_file(&text, &stats[c].files[n]);
+        }
+
+        // Heap sort in place, which leaves the worst first
+        struct file_layout entry;
+        for (int n = worst_len - 1; n > 0; n--) {
+            entry = worst[0];
+            worst[0] = worst[n];
+            worst[n] = entry;
+            for (int i = 0, child; (child = 2 * i + 1) < n; i = child) {
+                if (child + 1 < n && worse(&worst[child], &worst[child + 1])) child++;
+                if (!worse(&worst[i], &worst[child])) break;
+                entry = worst[i];
+                worst[i] = worst[child];
+                worst[child] = entry;
+            }
+        }
+        for (int n = 0; n < worst_len; n++) print_file(&text, &worst[n]);
+        if (ufs_text_flush(&text) == -1) {
+            perror("write");
+            exit(1);
+        }
+        ufs_text_free(&text);
+        ufs_parents_free(&stat_parents);
+        free(worst);
+    }
+    for (int c = 0; c < ncg; c++) free(stats[c].files);
+    free(stats);
+    ufs_stats_report(stderr, &image);
+    return mismatches ? 1 : 0;
+}
+
+void
+stat_cg(void *arg) {
+    /**
+     * Pool entry point: counts one cylinder group's bitmaps, then (-F,
+     * -w) goes through its inode table. Only the cg's data fragments
+     * (cg_ndblk) and inodes (cg_niblk) are looked at
+     */
+    struct cg_stat *stat = arg;
+    struct fs *superblock = stat_image->superblock;
+    struct ufs_buf *buf;
+    struct cg *header = ufs_cg(stat_image, stat->cg, &buf);
+    if (!header || header->cg_freeoff + howmany((int64_t)header->cg_ndblk, NBBY) > (uint32_t)superblock->fs_cgsize ||
+        header->cg_iusedoff + howmany((int64_t)header->cg_niblk, NBBY) > (uint32_t)superblock->fs_cgsize ||
+        header->cg_ndblk > (uint32_t)superblock->fs_fpg || header->cg_niblk > superblock->fs_ipg) {
+        ufs_put(stat_image, buf);
+        stat->bad = 1;
+        return;
+    }
+    stat->cs = header->cg_cs;
+    for (int i = 0; i < MAXFRAG; i++) stat->cg_frsum[i] = header->cg_frsum[i];
+
+    int frag = superblock->fs_frag;
+    int64_t nfrags = header->cg_ndblk, nblocks = nfrags / frag;
+    const uint8_t *free_map = cg_blksfree(header);
+    stat->nifree = header->cg_niblk - count_bits(cg_inosused(header), header->cg_niblk);
+
+    // One bit per block: wholly free, and free at all
+    size_t nwords = nblocks / 64 + 1;
+    uint64_t *all_free = calloc(2 * nwords, sizeof(uint64_t));
+    if (!all_free) {
+        perror("calloc");
+        exit(1);
+    }
+    uint64_t *any_free = all_free + nwords;
+    block_maps(free_map, nblocks, frag, all_free, any_free);
+
+    for (size_t w = 0; w < nwords; w++) stat->nbfree += popcount64(all_free[w]);
+    stat->nffree = count_bits(free_map, nblocks * frag) - stat->nbfree * frag;
+    count_runs(stat, all_free, nblocks);
+
+    // Partly used blocks: set in any_free but not in all_free
+    for (size_t w = 0; w < nwords; w++) {
+        uint64_t partial = any_free[w] & ~all_free[w];
+        while (partial) {
+            int64_t block = (int64_t)w * 64 + ctz64(partial);
+            count_fragments(stat, free_map, block * frag, frag);
+            partial &= partial - 1;
+        }
+    }
+
+    // A last block cut short by the end of the file system holds loose fragments
+    if (nfrags % frag) {
+        int tail = nfrags % frag, free_tail = 0;
+        for (int f = 0; f < tail; f++) free_tail += isset(free_map, nblocks * frag + f) != 0;
+        stat->nffree += free_tail;
+        count_fragments(stat, free_map, nblocks * frag, tail);
+    }
+
+    free(all_free);
+    ufs_put(stat_image, buf);
+
+    if (layout_all || worst_count) {
+        stat->cg_seen = calloc(superblock->fs_ncg, 1);
+        stat->cg_list = malloc(superblock->fs_ncg * sizeof(int));
+        if (!stat->cg_seen || !stat->cg_list) {
+            perror("calloc");
+            exit(1);
+        }
+        ufs_scan_cg(stat_image, stat->cg, layout_inode, stat);
+        free(stat->cg_seen);
+        free(stat->cg_list);
+    }
+}
+
+int
+count_bits(const uint8_t *bitmap, int64_t nbits) {
+    /**
+     * Set bits among the first nbits of a bitmap, a word at a time
+     */
+    int64_t count = 0, bytes = nbits / NBBY, i;
+    uint64_t word;
+    for (i = 0; i + 8 <= bytes; i += 8) {
+        memcpy(&word, bitmap + i, sizeof(word));
+        count += popcount64(word);
+    }
+    for (; i < bytes; i++) count += popcount64(bitmap[i]);
+    if (nbits % NBBY) count += popcount64(bitmap[bytes] & ((1u << (nbits % NBBY)) - 1));
+    return count;
+}
+
+void
+block_maps(
+    const uint8_t *free_map,
+    int64_t nblocks,
+    int frag,
+    uint64_t *all_free,
+    uint64_t *any_free
+) {
+    /**
+     * Boils the fragment free map down to one bit per block: all_free when
+     * every fragment of the block is free, any_free when one is. With
+     * eight fragments a block is a byte, compared 16 at a time
+     */
+    int64_t block = 0;
+#ifdef __SSE2__
+    if (frag == 8) {
+        const __m128i ones = _mm_set1_epi8((char)0xff), zeros = _mm_setzero_si128();
+        for (; block + 16 <= nblocks; block += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(free_map + block));
+            uint64_t full = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, ones));
+            uint64_t empty = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zeros));
+            all_free[block / 64] |= full << (block % 64);
+            any_free[block / 64] |= (~empty & 0xffff) << (block % 64);
+        }
+    }
+#endif
+    uint32_t mask = (1u << frag) - 1, bits;
+    for (; block < nblocks; block++) {
+        int64_t first = block * frag;
+        bits = (free_map[first / NBBY] >> (first % NBBY)) & mask;
+        if (bits == mask) all_free[block / 64] |= (uint64_t)1 << (block % 64);
+        if (bits) any_free[block / 64] |= (uint64_t)1 << (block % 64);
+    }
+}
+
+void
+count_runs(struct cg_stat *stat, const uint64_t *all_free, int64_t nblocks) {
+    /**
+     * Histograms the runs of wholly free blocks, jumping from run edge to
+     * run edge a word at a time
+     */
+    int64_t start = 0, end, length;
+    int bucket;
+    while ((start = next_bit(all_free, nblocks, start, 1)) < nblocks) {
+        end = next_bit(all_free, nblocks, start, 0);
+        length = end - start;
+        for (bucket = 0; bucket < RUN_BUCKETS - 1 && length >> (bucket + 1); bucket++);
+        stat->runs[bucket]++;
+        stat->run_blocks[bucket] += length;
+        if (length > stat->largest) stat->largest = length;
+        start = end;
+    }
+}
+
+int64_t
+next_bit(const uint64_t *words, int64_t nbits, int64_t from, int set) {
+    /**
+     * The first bit at or after from that is set (or clear), nbits if none
+     */
+    int64_t w = from / 64;
+    uint64_t word = (set ? words[w] : ~words[w]) & (~(uint64_t)0 << (from % 64));
+    while (!word) {
+        if (++w * 64 >= nbits) return nbits;
+        word = set ? words[w] : ~words[w];
+    }
+    int64_t bit = w * 64 + ctz64(word);
+    return bit < nbits ? bit : nbits;
+}
+
+void
+count_fragments(struct cg_stat *stat, const uint8_t *free_map, int64_t first, int count) {
+    /**
+     * Adds the runs of free fragments among count fragments from first to
+     * frsum, like cg_frsum counts them
+     */
+    int run = 0;
+    for (int f = 0; f < count; f++) {
+        if (isset(free_map, first + f)) {
+            run++;
+            continue;
+        }
+        if (run) stat->frsum[run]++;
+        run = 0;
+    }
+    if (run) stat->frsum[run]++;
+}
+
+int
+check_cg(const struct cg_stat *stat, int frag) {
+    /**
+     * Compares the counts with the cg's own summary, complaining on stderr.
+     * Returns 1 when they differ
+     */
+    int differ = stat->cs.cs_nbfree != stat->nbfree || stat->cs.cs_nffree != stat->nffree ||
+                 stat->cs.cs_nifree != stat->nifree;
+    for (int i = 1; i < frag; i++) differ |= stat->cg_frsum[i] != stat->frsum[i];
+    if (differ) {
+        fprintf(stderr, "fs-stat: cg %d: summary says %d blocks, %d frags, %d inodes free, "
+                "bitmaps have %jd, %jd, %jd\n", stat->cg, stat->cs.cs_nbfree, stat->cs.cs_nffree,
+                stat->cs.cs_nifree, (intmax_t)stat->nbfree, (intmax_t)stat->nffree, (intmax_t)stat->nifree);
+    }
+    return differ;
+}
+
+void
+print_size(int64_t count, int64_t unit) {
+    /**
+     * Prints count units of bytes in the largest binary unit that keeps it
+     * above 1, ending the line
+     */
+    const char *units[] = { "bytes", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    double size = (double)count * unit;
+    int i = 0;
+    while (size >= 1024 && i < 5) {
+        size /= 1024;
+        i++;
+    }
+    printf("%.1f %s\n", size, units[i]);
+}
+
+void
+layout_inode(void *arg, ino_t inode_num, struct ufs2_dinode *inode) {
+    /**
+     * ufs_scan_cg callback: walks a file's or directory's blocks (a
+     * symlink's too, when it has any) and adds up how they are laid out.
+     * Runs that merely skip a hole stay one extent
+     */
+    struct cg_stat *stat = arg;
+    struct fs *superblock = stat_image->superblock;
+    if (inode_num < UFS_ROOTINO || !inode->di_mode) return;
+    int type = inode->di_mode & IFMT;
+    if (type == IFDIR) ufs_parents_add_dir(&stat_parents, stat_image, inode_num, inode);
+    if (type != IFREG && type != IFDIR && (type != IFLNK || !inode->di_blocks)) return;
+
+    struct file_layout file;
+    memset(&file, 0, sizeof(file));
+    file.inode = inode_num;
+    file.dir = type == IFDIR;
+    file.size = inode->di_size;
+
+    struct indirect_walk walk;
+    memset(&walk, 0xff, sizeof(walk.last));
+    walk.count = 0;
+
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    off_t end = -1;
+    ufs_extent_begin(&iter, stat_image, inode);
+    while (ufs_extent_next(&iter, &extent)) {
+        if (extent.physical != end) {
+            if (file.extents++) file.seek += extent.physical > end ? extent.physical - end : end - extent.physical;
+        }
+        end = extent.physical + extent.length;
+        count_indirect(&walk, superblock, lblkno(superblock, extent.logical),
+                       lblkno(superblock, extent.logical + extent.length - 1) + 1);
+        add_cgs(stat, superblock, extent.physical, extent.length);
+    }
+    ufs_extent_end(&iter);
+    file.indirect = walk.count;
+    file.cgs = stat->ncgs;
+    while (stat->ncgs) stat->cg_seen[stat->cg_list[--stat->ncgs]] = 0;
+
+    struct layout_sum *sum = &stat->layout[file.dir];
+    int bucket;
+    sum->files++;
+    sum->fragmented += file.extents > 1;
+    sum->extents += file.extents;
+    sum->indirect += file.indirect;
+    sum->cgs += file.cgs;
+    sum->seek += file.seek;
+    if (file.extents > 1) sum->gaps += file.extents - 1;
+    sum->size += file.size;
+    if (file.extents) {
+        for (bucket = 0; bucket < RUN_BUCKETS - 1 && file.extents >> (bucket + 1); bucket++);
+        sum->buckets[bucket]++;
+    }
+
+    if (worst_count && file.extents > 1) worst_add(&file);
+    if (!layout_all) return;
+    if (stat->nfiles == stat->cap) {
+        stat->cap = stat->cap ? stat->cap * 2 : 256;
+        stat->files = realloc(stat->files, stat->cap * sizeof(struct file_layout));
+        if (!stat->files) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    stat->files[stat->nfiles++] = file;
+}
+
+void
+count_indirect(
+    struct indirect_walk *walk,
+    const struct fs *superblock,
+    ufs_lbn_t start,
+    ufs_lbn_t end
+) {
+    /**
+     * Counts the indirect blocks that map logical blocks [start, end) and
+     * were not counted for an earlier range. Ranges come in increasing
+     * order, so at every level only the last block counted can be shared
+     */
+    ufs_lbn_t nindir = NINDIR(superblock), base = UFS_NDADDR, span = nindir;
+    if (start < base) start = base;
+    for (int tree = 0; tree < UFS_NIADDR && start < end; tree++) {
+        // This tree maps [base, base + span)
+        if (start < base + span) {
+            ufs_lbn_t first = start - base, last = (end < base + span ? end : base + span) - base - 1;
+
+            // Level 0 is the tree's root; each level down covers nindir times less
+            ufs_lbn_t covers = span;
+            for (int level = 0; level <= tree; level++) {
+                int64_t lo = first / covers, hi = last / covers;
+                walk->count += hi - lo + 1 - (lo == walk->last[tree][level]);
+                walk->last[tree][level] = hi;
+                covers /= nindir;
+            }
+            start = base + last + 1;
+        }
+        base += span;
+        span *= nindir;
+    }
+}
+
+void
+add_cgs(struct cg_stat *stat, const struct fs *superblock, off_t physical, off_t length) {
+    /**
+     * Notes the cylinder groups an extent lies in
+     */
+    int first = dtog(superblock, numfrags(superblock, physical));
+    int last = dtog(superblock, numfrags(superblock, physical + length - 1));
+    for (int c = first; c <= last && c < superblock->fs_ncg; c++) {
+        if (stat->cg_seen[c]) continue;
+        stat->cg_seen[c] = 1;
+        stat->cg_list[stat->ncgs++] = c;
+    }
+}
+
+int
+worse(const struct file_layout *a, const struct file_layout *b) {
+    /**
+     * Whether a ranks above b for -w: more extents, then more seeking
+     */
+    if (a->extents != b->extents) return a->extents > b->extents;
+    return a->seek > b->seek;
+}
+
+void
+worst_add(const struct file_layout *file) {
+    /**
+     * Offers a file to the -w heap, which keeps the worst
+     */
+    pthread_mutex_lock(&worst_lock);
+    int i;
+    if (worst_len < worst_count) {
+        i = worst_len++;
+        // Sift up from the new leaf
+        while (i > 0 && worse(&worst[(i - 1) / 2], file)) {
+            worst[i] = worst[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (worse(file, &worst[0])) {
+        // Replace the least bad and sift down
+        int child;
+        for (i = 0; (child = 2 * i + 1) < worst_len; i = child) {
+            if (child + 1 < worst_len && worse(&worst[child], &worst[child + 1])) child++;
+            if (!worse(file, &worst[child])) break;
+            worst[i] = worst[child];
+        }
+    } else {
+        pthread_mutex_unlock(&worst_lock);
+        return;
+    }
+    worst[i] = *file;
+    pthread_mutex_unlock(&worst_lock);
+}
+
+void
+print_layout_sum(const char *label, const struct layout_sum *sum, int64_t bsize) {
+    /**
+     * One line of layout totals. Seeks are averaged over the gaps between
+     * extents, in blocks
+     */
+    printf("  %-11s %12jd %12jd %12jd %12jd %12.2f %12.1f\n", label, (intmax_t)sum->files,
+           (intmax_t)sum->fragmented, (intmax_t)sum->extents, (intmax_t)sum->indirect,
+           sum->files ? (double)sum->cgs / sum->files : 0.0,
+           sum->gaps ? (double)sum->seek / sum->gaps / bsize : 0.0);
+}
+
+void
+print_file(struct ufs_text *text, const struct file_layout *file) {
+    /**
+     * A -F or -w line: the numbers, then the path ("." for the root,
+     * nothing when the inode is not linked from it)
+     */
+    char path[PATH_MAX];
+    int depth;
+    ssize_t len = ufs_parents_path(&stat_parents, stat_image, file->inode, path, sizeof(path), &depth);
+    int64_t gaps = file->extents > 1 ? file->extents - 1 : 1;
+    text_column(text, file->inode, 8);
+    text_column(text, file->extents, 9);
+    text_column(text, file->indirect, 9);
+    text_column(text, file->cgs, 5);
+    text_column(text, file->seek / gaps / 1024, 14);
+    text_column(text, file->size, 13);
+    ufs_text_char(text, ' ');
+    if (len == 0) {
+        ufs_text_char(text, '.');
+    } else if (len > 0) {
+        ufs_text_bytes(text, path, len);
+    }
+    if (file->dir && len > 0) ufs_text_char(text, '/');
+    ufs_text_char(text, '\n');
+}
+
+const char *
+bucket_span(char *span, size_t size, int bucket) {
+    /**
+     * The range a power of two bucket holds: "1", "2-3", "4-7", ...
+     */
+    if (bucket == 0) {
+        snprintf(span, size, "1");
+    } else {
+        snprintf(span, size, "%jd-%jd", (intmax_t)1 << bucket, ((intmax_t)2 << bucket) - 1);
+    }
+    return span;
+}
+
+void
+text_column(struct ufs_text *text, uint64_t value, int width) {
+    /**
+     * value right aligned in width characters
+     */
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    if (digits < width) ufs_text_spaces(text, width - digits);
+    ufs_text_uint(text, value);
+}
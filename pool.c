@@ -0,0 +1,257 @@
+/**
+ * pool.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc
+#include <pthread.h>
+
+#include "pool.h"
+
+struct task {
+    pool_func func;
+    void *arg;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct task *tasks;
+    size_t head;    // index of oldest task (stolen first)
+    size_t tail;    // one past newest task (popped by owner)
+    size_t cap;
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+    pthread_t thread;
+    struct deque deque;
+};
+
+struct pool {
+    int num_threads;
+    struct worker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;     // signalled when a task is submitted
+    pthread_cond_t done_cv;     // signalled when pending drops to zero
+    unsigned long work_seq;     // bumped on every submit, guards lost wakeups
+    long pending;               // submitted but not yet finished
+    int sleeping;
+    int shutdown;
+    unsigned next_victim;       // round robin for submits from outside
+};
+
+// Worker the calling thread belongs to, NULL for non-pool threads
+static __thread struct worker *current_worker;
+
+static void *worker_main(void *arg);
+static void deque_push(struct deque *deque, struct task task);
+static int deque_pop(struct deque *deque, struct task *task);
+static int deque_steal(struct deque *deque, struct task *task);
+
+struct pool *
+pool_create(int num_threads) {
+    /**
+     * Starts num_threads workers, returns NULL on failure
+     */
+    struct pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+
+    pool->num_threads = num_threads;
+    pool->workers = calloc(num_threads, sizeof(struct worker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void
+pool_submit(struct pool *pool, pool_func func, void *arg) {
+    /**
+     * Queues func(arg). Workers push onto their own deque, other threads
+     * spread tasks round robin
+     */
+    struct task task = { func, arg };
+    struct worker *worker = current_worker;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    if (!worker || worker->pool != pool) {
+        worker = &pool->workers[pool->next_victim++ % pool->num_threads];
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    deque_push(&worker->deque, task);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->work_seq++;
+    if (pool->sleeping) pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_wait(struct pool *pool) {
+    /**
+     * Blocks until every submitted task (and the tasks they submitted) ran
+     */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_destroy(struct pool *pool) {
+    /**
+     * Waits for outstanding work, then joins and frees the workers
+     */
+    pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.tasks);
+    }
+
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static int
+find_task(struct worker *self, struct task *task) {
+    /**
+     * Pops from our own deque, otherwise tries to steal from the others
+     */
+    if (deque_pop(&self->deque, task)) return 1;
+
+    struct pool *pool = self->pool;
+    for (int i = 1; i < pool->num_threads; i++) {
+        struct worker *victim = &pool->workers[(self->id + i) % pool->num_threads];
+        if (deque_steal(&victim->deque, task)) return 1;
+    }
+    return 0;
+}
+
+static void *
+worker_main(void *arg) {
+    /**
+     * Runs tasks until the pool shuts down
+     */
+    struct worker *self = arg;
+    struct pool *pool = self->pool;
+    current_worker = self;
+
+    struct task task;
+    unsigned long seq;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        seq = pool->work_seq;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (find_task(self, &task)) {
+            task.func(task.arg);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) pthread_cond_broadcast(&pool->done_cv);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        // Nothing to run: sleep until somebody submits after our scan
+        pthread_mutex_lock(&pool->lock);
+        while (pool->work_seq == seq && !pool->shutdown) {
+            pool->sleeping++;
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+            pool->sleeping--;
+        }
+        if (pool->shutdown && pool->pending == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void
+deque_push(struct deque *deque, struct task task) {
+    /**
+     * Appends task at the tail, growing the ring if needed
+     */
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->cap) {
+        size_t new_cap = deque->cap ? deque->cap * 2 : 64;
+        struct task *tasks = malloc(new_cap * sizeof(struct task));
+        if (!tasks) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = deque->head; i < deque->tail; i++) {
+            tasks[i - deque->head] = deque->tasks[i % deque->cap];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->tail -= deque->head;
+        deque->head = 0;
+        deque->cap = new_cap;
+    }
+    deque->tasks[deque->tail++ % deque->cap] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int
+deque_pop(struct deque *deque, struct task *task) {
+    /**
+     * Takes the newest task (owner side)
+     */
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head) {
+        *task = deque->tasks[--deque->tail % deque->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int
+deque_steal(struct deque *deque, struct task *task) {
+    /**
+     * Takes the oldest task (thief side)
+     */
+    int found = 0;
+    if (pthread_mutex_trylock(&deque->lock)) return 0;
+    if (deque->tail != deque->head) {
+        *task = deque->tasks[deque->head++ % deque->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
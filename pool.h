@@ -0,0 +1,21 @@
+/**
+ * pool.h
+ *
+ * Small work-stealing thread pool. Every worker owns a deque: tasks it
+ * submits itself are pushed and popped at the tail (depth first, like the
+ * serial walk), idle workers steal the oldest task from the head of
+ * someone else's deque.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+typedef void (*pool_func)(void *arg);
+
+struct pool;
+
+struct pool *pool_create(int num_threads);
+void pool_submit(struct pool *pool, pool_func func, void *arg);
+void pool_wait(struct pool *pool);
+void pool_destroy(struct pool *pool);
+
+#endif
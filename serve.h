@@ -0,0 +1,24 @@
+/**
+ * serve.h
+ *
+ * Wire format between fs-serve and fs-query, over a Unix stream socket.
+ *
+ * A request is a run of NUL terminated strings: the command, the image
+ * (its real path) and the command's arguments, closed by an empty string
+ * (so no argument can be empty).
+ *     cat <image> <path>            the file's contents
+ *     stat <image> <path>           one fs-find -J style JSON line
+ *     find <image> [-0] [preds]     matching paths, as fs-find prints them
+ * The answer starts with a header line: "<length>\n" followed by exactly
+ * length bytes, or "- <message>\n" with nothing after it. A connection
+ * can carry any number of requests, answered in order.
+ */
+#ifndef SERVE_H
+#define SERVE_H
+
+#define SERVE_SOCKET "/var/run/fs-serve.sock"
+
+#define SERVE_REQUEST_MAX 65536         // bytes of one request
+#define SERVE_ARGS_MAX 256              // strings in one request
+
+#endif
@@ -0,0 +1,188 @@
+/**
+ * textout.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc
+#include <string.h>   // memcpy
+#include <errno.h>
+
+#include "textout.h"
+#include "ufsstats.h"
+#include "ufsout.h" // ufs_write_all
+
+static void reserve(struct ufs_text *text, size_t length);
+static void write_out(struct ufs_text *text, const char *data, size_t length);
+
+void
+ufs_text_init(struct ufs_text *text, int fd) {
+    /**
+     * A descriptor-backed buffer gets its full size up front, a memory
+     * buffer starts empty and doubles as needed
+     */
+    text->fd = fd;
+    text->len = 0;
+    text->error = 0;
+    text->cap = fd < 0 ? 0 : UFS_TEXT_BUFSIZE;
+    text->data = NULL;
+    if (text->cap && !(text->data = malloc(text->cap))) {
+        perror("malloc");
+        exit(1);
+    }
+}
+
+void
+ufs_text_bytes(struct ufs_text *text, const void *data, size_t length) {
+    if (text->len + length > text->cap) {
+        // Too big to be worth copying: write it straight through
+        if (text->fd >= 0 && length >= text->cap) {
+            ufs_text_flush(text);
+            write_out(text, data, length);
+            return;
+        }
+        reserve(text, length);
+    }
+    memcpy(text->data + text->len, data, length);
+    text->len += length;
+}
+
+void
+ufs_text_char(struct ufs_text *text, char c) {
+    if (text->len == text->cap) reserve(text, 1);
+    text->data[text->len++] = c;
+}
+
+void
+ufs_text_spaces(struct ufs_text *text, int count) {
+    if (count <= 0) return;
+    if (text->len + count > text->cap) reserve(text, count);
+    memset(text->data + text->len, ' ', count);
+    text->len += count;
+}
+
+void
+ufs_text_uint(struct ufs_text *text, uint64_t value) {
+    /**
+     * Appends value in decimal
+     */
+    char digits[20];
+    int n = sizeof(digits);
+    do {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    ufs_text_bytes(text, digits + n, sizeof(digits) - n);
+}
+
+void
+ufs_text_int(struct ufs_text *text, int64_t value) {
+    if (value < 0) {
+        ufs_text_char(text, '-');
+        ufs_text_uint(text, -(uint64_t)value);
+    } else {
+        ufs_text_uint(text, value);
+    }
+}
+
+void
+ufs_text_json(struct ufs_text *text, const char *string, size_t length) {
+    /**
+     * Appends string as a quoted JSON string. Quotes, backslashes and
+     * control characters are escaped; other bytes go through untouched, so
+     * names that are not UTF-8 stay byte for byte what is on disk
+     */
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    ufs_text_char(text, '"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = string[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        ufs_text_bytes(text, string + start, i - start);
+        start = i + 1;
+        switch (c) {
+        case '"': ufs_text_bytes(text, "\\\"", 2); break;
+        case '\\': ufs_text_bytes(text, "\\\\", 2); break;
+        case '\n': ufs_text_bytes(text, "\\n", 2); break;
+        case '\t': ufs_text_bytes(text, "\\t", 2); break;
+        default: {
+            char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            ufs_text_bytes(text, escape, sizeof(escape));
+        }
+        }
+    }
+    ufs_text_bytes(text, string + start, length - start);
+    ufs_text_char(text, '"');
+}
+
+char *
+ufs_text_take(struct ufs_text *text, size_t *length) {
+    /**
+     * Hands the contents of a memory buffer to the caller (to free) and
+     * leaves the buffer empty
+     */
+    char *data = text->data;
+    *length = text->len;
+    text->data = NULL;
+    text->len = text->cap = 0;
+    return data;
+}
+
+int
+ufs_text_flush(struct ufs_text *text) {
+    /**
+     * Writes out what is buffered. Returns -1 with errno set if this or
+     * any earlier write failed
+     */
+    if (text->fd >= 0 && text->len) {
+        write_out(text, text->data, text->len);
+        text->len = 0;
+    }
+    if (text->error) {
+        errno = text->error;
+        return -1;
+    }
+    return 0;
+}
+
+void
+ufs_text_free(struct ufs_text *text) {
+    free(text->data);
+    text->data = NULL;
+    text->len = text->cap = 0;
+}
+
+static void
+reserve(struct ufs_text *text, size_t length) {
+    /**
+     * Makes room for length more bytes: a descriptor-backed buffer is
+     * flushed, a memory buffer grows
+     */
+    if (text->fd >= 0) {
+        ufs_text_flush(text);
+        if (length <= text->cap) return;
+    }
+
+    size_t new_cap = text->cap ? text->cap * 2 : 4096;
+    while (text->len + length > new_cap) new_cap *= 2;
+    text->data = realloc(text->data, new_cap);
+    if (!text->data) {
+        perror("realloc");
+        exit(1);
+    }
+    text->cap = new_cap;
+}
+
+static void
+write_out(struct ufs_text *text, const char *data, size_t length) {
+    /**
+     * write until everything went out. After the first error the rest is
+     * dropped; the error comes back from ufs_text_flush
+     */
+    if (text->error) return;
+    if (ufs_write_all(text->fd, data, length) == -1) {
+        text->error = errno;
+        return;
+    }
+    UFS_STAT(bytes_out, length);
+}
@@ -0,0 +1,35 @@
+/**
+ * textout.h
+ *
+ * Formatting-free text output: bytes are appended to a large buffer and
+ * written out with big write(2)s, no stdio and no format strings. A buffer
+ * either drains into a file descriptor or, with fd -1, just grows in
+ * memory. Write errors are latched and reported by ufs_text_flush.
+ */
+#ifndef TEXTOUT_H
+#define TEXTOUT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define UFS_TEXT_BUFSIZE (1 << 20)      // bytes buffered before a write
+
+struct ufs_text {
+    int fd;                     // -1: memory only
+    char *data;
+    size_t len, cap;
+    int error;                  // errno of the first failed write, or 0
+};
+
+void ufs_text_init(struct ufs_text *text, int fd);
+void ufs_text_bytes(struct ufs_text *text, const void *data, size_t length);
+void ufs_text_char(struct ufs_text *text, char c);
+void ufs_text_spaces(struct ufs_text *text, int count);
+void ufs_text_uint(struct ufs_text *text, uint64_t value);
+void ufs_text_int(struct ufs_text *text, int64_t value);
+void ufs_text_json(struct ufs_text *text, const char *string, size_t length);
+char *ufs_text_take(struct ufs_text *text, size_t *length);
+int ufs_text_flush(struct ufs_text *text);
+void ufs_text_free(struct ufs_text *text);
+
+#endif
@@ -0,0 +1,421 @@
+/**
+ * ufscache.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memset
+#include <unistd.h>   // pread
+#include <fcntl.h>    // posix_fadvise
+#include <errno.h>
+#include <aio.h>
+#include <pthread.h>
+
+#include "ufscache.h"
+#include "ufsstats.h"
+
+enum buf_state {
+    BUF_READING,                // a thread is pread()ing it
+    BUF_QUEUED,                 // in the next lio_listio batch
+    BUF_INFLIGHT,               // aio read submitted
+    BUF_VALID,
+};
+
+struct ufs_buf {
+    off_t offset;               // image offset of the block
+    char *data;
+    int refs;
+    enum buf_state state;
+    struct aiocb cb;
+
+    struct ufs_buf *hash_next;
+    struct ufs_buf *prev, *next;    // idle list or in-flight list
+};
+
+struct ufs_cache {
+    int fd;
+    off_t size;
+    size_t block_size;
+    int aio;                    // cleared when the system will not do aio
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // some BUF_READING buffer became valid
+
+    // Block number -> buffer, chained
+    struct ufs_buf **hash;
+    size_t hash_mask;
+    size_t nbufs, max_bufs;
+
+    // Valid and unpinned, least recently used first
+    struct ufs_buf idle;
+
+    // Queued and submitted aio reads
+    struct ufs_buf inflight;
+    size_t ninflight;
+    struct ufs_buf *batch[UFS_CACHE_BATCH];
+    struct aiocb *cbs[UFS_CACHE_BATCH];
+    int nbatch;
+};
+
+static struct ufs_buf *lookup(struct ufs_cache *cache, off_t block);
+static void hash_insert(struct ufs_cache *cache, struct ufs_buf *buf);
+static void hash_remove(struct ufs_cache *cache, struct ufs_buf *buf);
+static void list_add(struct ufs_buf *head, struct ufs_buf *buf);
+static void list_remove(struct ufs_buf *buf);
+static struct ufs_buf *take_buf(struct ufs_cache *cache, int grow);
+static void drop_buf(struct ufs_cache *cache, struct ufs_buf *buf);
+static void read_block(struct ufs_cache *cache, struct ufs_buf *buf, size_t done);
+static void wait_valid(struct ufs_cache *cache, struct ufs_buf *buf);
+static void submit(struct ufs_cache *cache);
+static void reap(struct ufs_cache *cache);
+static void complete(struct ufs_cache *cache, struct ufs_buf *buf);
+
+struct ufs_cache *
+ufs_cache_create(int fd, off_t size, size_t block_size, int aio) {
+    /**
+     * A cache of UFS_CACHE_SIZE bytes of block_size (a power of two)
+     * buffers over fd. Returns NULL with errno set when out of memory
+     */
+    struct ufs_cache *cache = calloc(1, sizeof(struct ufs_cache));
+    if (!cache) return NULL;
+
+    cache->fd = fd;
+    cache->size = size;
+    cache->block_size = block_size;
+    cache->aio = aio;
+    cache->max_bufs = UFS_CACHE_SIZE / block_size;
+
+    size_t nslots = 16;
+    while (nslots < cache->max_bufs * 2) nslots *= 2;
+    cache->hash = calloc(nslots, sizeof(struct ufs_buf *));
+    if (!cache->hash) {
+        free(cache);
+        return NULL;
+    }
+    cache->hash_mask = nslots - 1;
+
+    cache->idle.prev = cache->idle.next = &cache->idle;
+    cache->inflight.prev = cache->inflight.next = &cache->inflight;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    return cache;
+}
+
+void
+ufs_cache_destroy(struct ufs_cache *cache) {
+    /**
+     * Waits for the reads still in flight and frees every buffer
+     */
+    struct ufs_buf *buf, *next;
+    for (buf = cache->inflight.next; buf != &cache->inflight; buf = buf->next) {
+        if (buf->state != BUF_INFLIGHT) continue;
+        const struct aiocb *list[1] = { &buf->cb };
+        while (aio_error(&buf->cb) == EINPROGRESS) aio_suspend(list, 1, NULL);
+        aio_return(&buf->cb);
+    }
+
+    for (size_t i = 0; i <= cache->hash_mask; i++) {
+        for (buf = cache->hash[i]; buf; buf = next) {
+            next = buf->hash_next;
+            free(buf->data);
+            free(buf);
+        }
+    }
+    free(cache->hash);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache);
+}
+
+char *
+ufs_cache_get(struct ufs_cache *cache, off_t offset, struct ufs_buf **buf) {
+    /**
+     * Pins the block holding offset, reading it if it is not cached, and
+     * returns a pointer to offset in it. A read error is fatal, as the
+     * SIGBUS of a fault on a mapping would be; past the end of the image
+     * reads back as zeros
+     */
+    off_t block = offset & ~(off_t)(cache->block_size - 1);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->nbatch) submit(cache);
+
+    struct ufs_buf *found = lookup(cache, block);
+    if (found) {
+        UFS_STAT(cache_hits, 1);
+        if (found->state == BUF_VALID && !found->refs) list_remove(found);
+        found->refs++;
+        wait_valid(cache, found);
+    } else {
+        UFS_STAT(cache_misses, 1);
+        found = take_buf(cache, 1);
+        found->offset = block;
+        found->refs = 1;
+        found->state = BUF_READING;
+        hash_insert(cache, found);
+
+        pthread_mutex_unlock(&cache->lock);
+        read_block(cache, found, 0);
+        pthread_mutex_lock(&cache->lock);
+
+        found->state = BUF_VALID;
+        pthread_cond_broadcast(&cache->loaded);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    *buf = found;
+    return found->data + (offset - block);
+}
+
+void
+ufs_cache_put(struct ufs_cache *cache, struct ufs_buf *buf) {
+    /**
+     * Unpins a block. Buffers beyond the cache size, made while everything
+     * was pinned, are freed as soon as they are idle again
+     */
+    pthread_mutex_lock(&cache->lock);
+    if (!--buf->refs) {
+        if (cache->nbufs > cache->max_bufs) {
+            hash_remove(cache, buf);
+            drop_buf(cache, buf);
+        } else {
+            list_add(&cache->idle, buf);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+ufs_cache_prefetch(struct ufs_cache *cache, off_t offset, off_t length) {
+    /**
+     * Starts reading the blocks of a byte range that are not cached. With
+     * aio they are queued for the next batch, as far as free buffers and
+     * half the cache go; without, the kernel is asked to read ahead
+     */
+    pthread_mutex_lock(&cache->lock);
+    if (!cache->aio) {
+        pthread_mutex_unlock(&cache->lock);
+        posix_fadvise(cache->fd, offset, length, POSIX_FADV_WILLNEED);
+        return;
+    }
+
+    off_t end = offset + length < cache->size ? offset + length : cache->size;
+    off_t block = offset & ~(off_t)(cache->block_size - 1);
+    struct ufs_buf *buf;
+    for (; block < end; block += cache->block_size) {
+        if (cache->ninflight >= cache->max_bufs / 2) {
+            reap(cache);
+            if (cache->ninflight >= cache->max_bufs / 2) break;
+        }
+        if (lookup(cache, block)) continue;
+        if (!(buf = take_buf(cache, 0))) break;
+
+        buf->offset = block;
+        buf->refs = 0;
+        buf->state = BUF_QUEUED;
+        hash_insert(cache, buf);
+        list_add(&cache->inflight, buf);
+        cache->ninflight++;
+
+        memset(&buf->cb, 0, sizeof(buf->cb));
+        buf->cb.aio_fildes = cache->fd;
+        buf->cb.aio_offset = block;
+        buf->cb.aio_buf = buf->data;
+        buf->cb.aio_nbytes = cache->block_size;
+        buf->cb.aio_lio_opcode = LIO_READ;
+        buf->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+        cache->cbs[cache->nbatch] = &buf->cb;
+        cache->batch[cache->nbatch++] = buf;
+        if (cache->nbatch == UFS_CACHE_BATCH) submit(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static struct ufs_buf *
+lookup(struct ufs_cache *cache, off_t block) {
+    struct ufs_buf *buf = cache->hash[(size_t)(block / cache->block_size) & cache->hash_mask];
+    while (buf && buf->offset != block) buf = buf->hash_next;
+    return buf;
+}
+
+static void
+hash_insert(struct ufs_cache *cache, struct ufs_buf *buf) {
+    struct ufs_buf **slot = &cache->hash[(size_t)(buf->offset / cache->block_size) & cache->hash_mask];
+    buf->hash_next = *slot;
+    *slot = buf;
+}
+
+static void
+hash_remove(struct ufs_cache *cache, struct ufs_buf *buf) {
+    struct ufs_buf **slot = &cache->hash[(size_t)(buf->offset / cache->block_size) & cache->hash_mask];
+    while (*slot != buf) slot = &(*slot)->hash_next;
+    *slot = buf->hash_next;
+}
+
+static void
+list_add(struct ufs_buf *head, struct ufs_buf *buf) {
+    /**
+     * Appends buf at the tail (most recently used end) of a list
+     */
+    buf->prev = head->prev;
+    buf->next = head;
+    head->prev->next = buf;
+    head->prev = buf;
+}
+
+static void
+list_remove(struct ufs_buf *buf) {
+    buf->prev->next = buf->next;
+    buf->next->prev = buf->prev;
+}
+
+static struct ufs_buf *
+take_buf(struct ufs_cache *cache, int grow) {
+    /**
+     * A buffer to read a block into: a new one while the cache is below
+     * its size, else the least recently used idle one. With nothing idle,
+     * a get (grow) goes over the size for a while and a prefetch gets NULL
+     */
+    struct ufs_buf *buf;
+    if (cache->nbufs >= cache->max_bufs && cache->idle.next == &cache->idle && cache->ninflight) {
+        reap(cache);
+    }
+
+    if (cache->nbufs < cache->max_bufs || (grow && cache->idle.next == &cache->idle)) {
+        buf = malloc(sizeof(struct ufs_buf));
+        if (!buf || !(buf->data = malloc(cache->block_size))) {
+            perror("malloc");
+            exit(1);
+        }
+        cache->nbufs++;
+        return buf;
+    }
+    if (cache->idle.next == &cache->idle) return NULL;
+
+    buf = cache->idle.next;
+    list_remove(buf);
+    hash_remove(cache, buf);
+    return buf;
+}
+
+static void
+drop_buf(struct ufs_cache *cache, struct ufs_buf *buf) {
+    /**
+     * Frees a buffer that is in no list and not hashed
+     */
+    free(buf->data);
+    free(buf);
+    cache->nbufs--;
+}
+
+static void
+read_block(struct ufs_cache *cache, struct ufs_buf *buf, size_t done) {
+    /**
+     * Reads a block from byte done on, synchronously and without the lock.
+     * What lies past the end of the image is zeroed
+     */
+    ssize_t n;
+    while (done < cache->block_size) {
+        n = pread(cache->fd, buf->data + done, cache->block_size - done, buf->offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pread");
+            exit(1);
+        }
+        if (!n) break;
+        done += n;
+    }
+    memset(buf->data + done, 0, cache->block_size - done);
+}
+
+static void
+wait_valid(struct ufs_cache *cache, struct ufs_buf *buf) {
+    /**
+     * Waits, pinned, until another thread's read or an aio read of buf is
+     * done. Called with the lock held
+     */
+    while (buf->state != BUF_VALID) {
+        if (buf->state != BUF_INFLIGHT) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+            continue;
+        }
+
+        const struct aiocb *list[1] = { &buf->cb };
+        pthread_mutex_unlock(&cache->lock);
+        aio_suspend(list, 1, NULL);
+        pthread_mutex_lock(&cache->lock);
+        if (buf->state == BUF_INFLIGHT && aio_error(&buf->cb) != EINPROGRESS) complete(cache, buf);
+    }
+}
+
+static void
+submit(struct ufs_cache *cache) {
+    /**
+     * Sends the queued reads to the kernel in one lio_listio(2). Reads it
+     * did not take are dropped again. If the system cannot do aio at all,
+     * later prefetches fall back to posix_fadvise(2)
+     */
+    int count = cache->nbatch, err;
+    cache->nbatch = 0;
+    UFS_STAT(aio_batches, 1);
+    UFS_STAT(aio_reads, count);
+
+    int all = lio_listio(LIO_NOWAIT, cache->cbs, count, NULL) == 0;
+    if (!all && (errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) cache->aio = 0;
+
+    struct ufs_buf *buf;
+    for (int i = 0; i < count; i++) {
+        buf = cache->batch[i];
+        if (!all && (err = aio_error(&buf->cb)) != EINPROGRESS && err != 0) {
+            aio_return(&buf->cb);
+            list_remove(buf);
+            cache->ninflight--;
+            hash_remove(cache, buf);
+            drop_buf(cache, buf);
+            continue;
+        }
+        buf->state = BUF_INFLIGHT;
+    }
+}
+
+static void
+reap(struct ufs_cache *cache) {
+    /**
+     * Picks up the aio reads that have finished, without waiting. Pinned
+     * ones are left to their waiters
+     */
+    struct ufs_buf *buf, *next;
+    for (buf = cache->inflight.next; buf != &cache->inflight; buf = next) {
+        next = buf->next;
+        if (buf->state != BUF_INFLIGHT || buf->refs) continue;
+        if (aio_error(&buf->cb) != EINPROGRESS) complete(cache, buf);
+    }
+}
+
+static void
+complete(struct ufs_cache *cache, struct ufs_buf *buf) {
+    /**
+     * Finishes an aio read. A failed or short one is dropped when nobody
+     * waits for it (the next get reads it again), else read synchronously,
+     * which drops the lock for a while
+     */
+    ssize_t n = aio_return(&buf->cb);
+    list_remove(buf);
+    cache->ninflight--;
+
+    if (n >= 0 && ((size_t)n == cache->block_size || buf->offset + n >= cache->size)) {
+        memset(buf->data + n, 0, cache->block_size - n);
+    } else if (!buf->refs) {
+        hash_remove(cache, buf);
+        drop_buf(cache, buf);
+        return;
+    } else {
+        buf->state = BUF_READING;
+        pthread_mutex_unlock(&cache->lock);
+        read_block(cache, buf, n < 0 ? 0 : n);
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    buf->state = BUF_VALID;
+    if (!buf->refs) list_add(&cache->idle, buf);
+    pthread_cond_broadcast(&cache->loaded);
+}
@@ -0,0 +1,33 @@
+/**
+ * ufscache.h
+ *
+ * Block cache behind the pread and aio backends of libufsread. The image is
+ * read one file system block at a time into a bounded pool of buffers that
+ * are reused least recently used first. A buffer stays pinned while anyone
+ * holds it, so pointers into it are good until the matching put. With aio,
+ * prefetches are collected and go out together as one lio_listio(2) batch
+ * the next time a block is asked for; completions are picked up when the
+ * block is needed or its buffer is.
+ */
+#ifndef UFSCACHE_H
+#define UFSCACHE_H
+
+#include <sys/types.h>
+#include <stddef.h>   // size_t
+
+// Cache size for the pread and aio backends
+#define UFS_CACHE_SIZE ((size_t)64 << 20)
+
+// Reads per lio_listio(2) batch
+#define UFS_CACHE_BATCH 64
+
+struct ufs_cache;
+struct ufs_buf;
+
+struct ufs_cache *ufs_cache_create(int fd, off_t size, size_t block_size, int aio);
+void ufs_cache_destroy(struct ufs_cache *cache);
+char *ufs_cache_get(struct ufs_cache *cache, off_t offset, struct ufs_buf **buf);
+void ufs_cache_put(struct ufs_cache *cache, struct ufs_buf *buf);
+void ufs_cache_prefetch(struct ufs_cache *cache, off_t offset, off_t length);
+
+#endif
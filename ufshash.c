@@ -0,0 +1,194 @@
+/**
+ * ufshash.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memcpy
+
+#include "ufshash.h"
+#include "ufsout.h"   // UFS_OUT_BOUNCE
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static const char zeros[65536];
+
+static inline uint64_t
+rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const unsigned char *p) {
+    /**
+     * Little endian load, whatever the host
+     */
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t
+read32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t
+round64(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    return rotl(lane, 31) * PRIME1;
+}
+
+static inline uint64_t
+merge64(uint64_t hash, uint64_t lane) {
+    hash ^= round64(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+static const unsigned char *
+stripes(uint64_t *lanes, const unsigned char *p, const unsigned char *end) {
+    /**
+     * Runs the four lanes over every whole 32 byte stripe in [p, end)
+     */
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    while (end - p >= 32) {
+        v1 = round64(v1, read64(p));
+        v2 = round64(v2, read64(p + 8));
+        v3 = round64(v3, read64(p + 16));
+        v4 = round64(v4, read64(p + 24));
+        p += 32;
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+    return p;
+}
+
+void
+ufs_xxh64_init(struct ufs_xxh64 *state, uint64_t seed) {
+    state->lanes[0] = seed + PRIME1 + PRIME2;
+    state->lanes[1] = seed + PRIME2;
+    state->lanes[2] = seed;
+    state->lanes[3] = seed - PRIME1;
+    state->total = 0;
+    state->buffered = 0;
+    state->seed = seed;
+}
+
+void
+ufs_xxh64_update(struct ufs_xxh64 *state, const void *data, size_t length) {
+    /**
+     * Hashes length more bytes. Any split of the input gives the same digest
+     */
+    const unsigned char *p = data, *end = p + length;
+    state->total += length;
+
+    if (state->buffered + length < 32) {
+        memcpy(state->stripe + state->buffered, p, length);
+        state->buffered += length;
+        return;
+    }
+    if (state->buffered) {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->stripe + state->buffered, p, fill);
+        stripes(state->lanes, state->stripe, state->stripe + 32);
+        p += fill;
+        state->buffered = 0;
+    }
+    p = stripes(state->lanes, p, end);
+    memcpy(state->stripe, p, end - p);
+    state->buffered = end - p;
+}
+
+void
+ufs_xxh64_zeros(struct ufs_xxh64 *state, uint64_t length) {
+    /**
+     * Hashes length zero bytes, for a hole
+     */
+    size_t chunk;
+    while (length) {
+        chunk = length < sizeof(zeros) ? length : sizeof(zeros);
+        ufs_xxh64_update(state, zeros, chunk);
+        length -= chunk;
+    }
+}
+
+uint64_t
+ufs_xxh64_digest(const struct ufs_xxh64 *state) {
+    /**
+     * The hash of everything so far; the state can keep going
+     */
+    const unsigned char *p = state->stripe, *end = p + state->buffered;
+    const uint64_t *v = state->lanes;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) hash = merge64(hash, v[i]);
+    } else {
+        hash = state->seed + PRIME5;
+    }
+    hash += state->total;
+
+    for (; end - p >= 8; p += 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (end - p >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t
+ufs_hash_file(const struct ufs_image *image, const struct ufs2_dinode *inode) {
+    /**
+     * XXH64 (seed 0) of a file's contents: mapped extents are hashed in
+     * place, an unmapped image goes through a UFS_OUT_BOUNCE buffer
+     */
+    struct ufs_xxh64 state;
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    char *bounce = NULL;
+    off_t hashed = 0, done;
+    size_t chunk;
+
+    ufs_xxh64_init(&state, 0);
+    ufs_extent_begin(&iter, image, inode);
+    while (ufs_extent_next(&iter, &extent)) {
+        ufs_xxh64_zeros(&state, extent.logical - hashed);
+        if (image->base) {
+            ufs_xxh64_update(&state, image->base + extent.physical, extent.length);
+        } else {
+            if (!bounce && !(bounce = malloc(UFS_OUT_BOUNCE))) {
+                perror("malloc");
+                exit(1);
+            }
+            for (done = 0; done < extent.length; done += chunk) {
+                chunk = extent.length - done < UFS_OUT_BOUNCE ? extent.length - done : UFS_OUT_BOUNCE;
+                ufs_read(image, bounce, chunk, extent.physical + done);
+                ufs_xxh64_update(&state, bounce, chunk);
+            }
+        }
+        hashed = extent.logical + extent.length;
+    }
+    ufs_extent_end(&iter);
+    ufs_xxh64_zeros(&state, (off_t)inode->di_size - hashed);
+    free(bounce);
+    return ufs_xxh64_digest(&state);
+}
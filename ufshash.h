@@ -0,0 +1,34 @@
+/**
+ * ufshash.h
+ *
+ * Content hashing straight out of the image: XXH64 (xxHash's 64-bit
+ * variant, written out here so there is nothing to depend on) over a
+ * file's extents, with holes hashed as the zeros they read back as. Four
+ * independent lanes of multiply-rotate per 32 bytes, so it runs at memory
+ * speed without any SIMD of its own.
+ */
+#ifndef UFSHASH_H
+#define UFSHASH_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>   // size_t
+
+#include "ufsread.h"
+
+struct ufs_xxh64 {
+    uint64_t lanes[4];
+    uint64_t total;             // bytes hashed
+    unsigned char stripe[32];   // input not yet a whole stripe
+    size_t buffered;
+    uint64_t seed;
+};
+
+void ufs_xxh64_init(struct ufs_xxh64 *state, uint64_t seed);
+void ufs_xxh64_update(struct ufs_xxh64 *state, const void *data, size_t length);
+void ufs_xxh64_zeros(struct ufs_xxh64 *state, uint64_t length);
+uint64_t ufs_xxh64_digest(const struct ufs_xxh64 *state);
+
+uint64_t ufs_hash_file(const struct ufs_image *image, const struct ufs2_dinode *inode);
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * ufsindex.c
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdlib.h>   // malloc
+#include <string.h>   // memcpy
+#include <sys/stat.h> // stat
+#include <unistd.h>   // write, close
+#include <errno.h>
+
+#include "ufsindex.h"
+#include "ufsout.h" // ufs_write_all
+
+#ifndef EFTYPE
+#define EFTYPE EINVAL
+#endif
+
+uint64_t
+ufs_index_hash(const char *path, size_t len) {
+    /**
+     * 64-bit FNV-1a. Never 0, that value marks empty slots
+     */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+int
+ufs_index_open(struct ufs_index *index, const char *path, const struct ufs_image *image) {
+    /**
+     * Maps an index and checks it belongs to image. Returns -1 with errno
+     * set on failure, ESTALE when the image changed since the index was built
+     */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1) {
+        close(fd);
+        return -1;
+    }
+    index->size = file_info.st_size;
+    if (index->size < sizeof(struct ufs_index_header)) {
+        close(fd);
+        errno = EFTYPE;
+        return -1;
+    }
+
+    index->base = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->base == MAP_FAILED) return -1;
+
+    const struct ufs_index_header *header = (void *)index->base;
+    index->header = header;
+    if (memcmp(header->magic, UFS_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->version != UFS_INDEX_VERSION ||
+        header->header_size != sizeof(struct ufs_index_header) ||
+        header->slots_offset + header->nslots * sizeof(struct ufs_index_slot) > index->size ||
+        header->strings_offset + header->strings_size > index->size) {
+        ufs_index_close(index);
+        errno = EFTYPE;
+        return -1;
+    }
+
+    struct fs *superblock = image->superblock;
+    if (header->fs_time != superblock->fs_time ||
+        header->fs_fmod != superblock->fs_fmod ||
+        header->fs_id[0] != superblock->fs_id[0] ||
+        header->fs_id[1] != superblock->fs_id[1] ||
+        header->fs_size != superblock->fs_size) {
+        ufs_index_close(index);
+        errno = ESTALE;
+        return -1;
+    }
+
+    index->slots = (void *)(index->base + header->slots_offset);
+    index->strings = index->base + header->strings_offset;
+    return 0;
+}
+
+int
+ufs_index_lookup(
+    const struct ufs_index *index,
+    const char *path,
+    ino_t *inode_num,
+    int *type
+) {
+    /**
+     * Looks path up. Returns 1 and fills in inode_num/type when found
+     */
+    size_t len = strlen(path);
+    uint64_t hash = ufs_index_hash(path, len);
+    uint64_t mask = index->header->nslots - 1;
+
+    // Linear probing; the table is at most half full
+    const struct ufs_index_slot *slot;
+    for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &index->slots[i];
+        if (!slot->hash) return 0;
+        if (slot->hash == hash && slot->path_len == len &&
+            !memcmp(index->strings + slot->path_offset, path, len)) {
+            *inode_num = slot->inode;
+            *type = slot->type;
+            return 1;
+        }
+    }
+}
+
+void
+ufs_index_close(struct ufs_index *index) {
+    munmap(index->base, index->size);
+}
+
+void
+ufs_index_add(
+    struct ufs_index_builder *builder,
+    const char *path,
+    size_t len,
+    ino_t inode_num,
+    int type
+) {
+    /**
+     * Records one path, copying it into the builder's string table
+     */
+    if (builder->nentries == builder->cap) {
+        builder->cap = builder->cap ? builder->cap * 2 : 1024;
+        builder->entries = realloc(builder->entries, builder->cap * sizeof(struct ufs_index_slot));
+        if (!builder->entries) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if (builder->strings_size + len + 1 > builder->strings_cap) {
+        while (builder->strings_size + len + 1 > builder->strings_cap) {
+            builder->strings_cap = builder->strings_cap ? builder->strings_cap * 2 : 65536;
+        }
+        builder->strings = realloc(builder->strings, builder->strings_cap);
+        if (!builder->strings) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    struct ufs_index_slot *entry = &builder->entries[builder->nentries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->hash = ufs_index_hash(path, len);
+    entry->path_offset = builder->strings_size;
+    entry->path_len = len;
+    entry->inode = inode_num;
+    entry->type = type;
+
+    memcpy(builder->strings + builder->strings_size, path, len);
+    builder->strings[builder->strings_size + len] = '\0';
+    builder->strings_size += len + 1;
+}
+
+int
+ufs_index_write(
+    struct ufs_index_builder *builder,
+    const struct ufs_image *image,
+    const char *path
+) {
+    /**
+     * Lays the collected entries out as a hash table and writes the index.
+     * The file is written under a temporary name and renamed into place
+     */
+    uint64_t nslots = 16;
+    while (nslots < builder->nentries * 2) nslots *= 2;
+
+    struct ufs_index_slot *slots = calloc(nslots, sizeof(struct ufs_index_slot));
+    if (!slots) return -1;
+
+    uint64_t mask = nslots - 1, i;
+    for (size_t n = 0; n < builder->nentries; n++) {
+        for (i = builder->entries[n].hash & mask; slots[i].hash; i = (i + 1) & mask);
+        slots[i] = builder->entries[n];
+    }
+
+    struct fs *superblock = image->superblock;
+    struct ufs_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UFS_INDEX_MAGIC, sizeof(header.magic));
+    header.version = UFS_INDEX_VERSION;
+    header.header_size = sizeof(header);
+    header.fs_time = superblock->fs_time;
+    header.fs_fmod = superblock->fs_fmod;
+    header.fs_id[0] = superblock->fs_id[0];
+    header.fs_id[1] = superblock->fs_id[1];
+    header.fs_size = superblock->fs_size;
+    header.nslots = nslots;
+    header.nentries = builder->nentries;
+    header.slots_offset = sizeof(header);
+    header.strings_offset = header.slots_offset + nslots * sizeof(struct ufs_index_slot);
+    header.strings_size = builder->strings_size;
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(slots);
+        return -1;
+    }
+
+    int res = ufs_write_all(fd, &header, sizeof(header));
+    if (!res) res = ufs_write_all(fd, slots, nslots * sizeof(struct ufs_index_slot));
+    if (!res) res = ufs_write_all(fd, builder->strings, builder->strings_size);
+    if (close(fd) == -1) res = -1;
+    free(slots);
+
+    if (!res) res = rename(tmp_path, path);
+    if (res) unlink(tmp_path);
+    return res;
+}
@@ -0,0 +1,92 @@
+/**
+ * ufsindex.h
+ *
+ * On-disk path index written by fs-index: an open addressing hash table of
+ * every path in an image, mapped by fs-cat so a lookup is one probe instead
+ * of a walk from UFS_ROOTINO. The header carries the superblock's fs_time,
+ * fs_fmod and fs_id; an index that does not match its image is rejected.
+ *
+ * Layout (host endian): header, nslots slots, then the NUL terminated
+ * paths the slots point at. Paths are relative to the root, without a
+ * leading '/', the way fs-cat takes them.
+ */
+#ifndef UFSINDEX_H
+#define UFSINDEX_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "ufsread.h"
+
+#define UFS_INDEX_MAGIC "UFSIDX1"
+#define UFS_INDEX_VERSION 1
+
+struct ufs_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+
+    // Superblock fields the index was built against
+    int64_t fs_time;
+    int32_t fs_id[2];
+    int64_t fs_size;
+    int8_t fs_fmod;
+    int8_t pad[7];
+
+    uint64_t nslots;            // power of two
+    uint64_t nentries;
+    uint64_t slots_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct ufs_index_slot {
+    uint64_t hash;              // 0 marks an empty slot
+    uint64_t path_offset;       // into the string table
+    uint64_t inode;
+    uint32_t path_len;
+    uint8_t type;               // DT_*
+    uint8_t pad[3];
+};
+
+struct ufs_index {
+    char *base;
+    size_t size;
+    const struct ufs_index_header *header;
+    const struct ufs_index_slot *slots;
+    const char *strings;
+};
+
+// Entries collected by fs-index before the table is laid out
+struct ufs_index_builder {
+    struct ufs_index_slot *entries;
+    size_t nentries, cap;
+    char *strings;
+    size_t strings_size, strings_cap;
+};
+
+uint64_t ufs_index_hash(const char *path, size_t len);
+
+int ufs_index_open(struct ufs_index *index, const char *path, const struct ufs_image *image);
+int ufs_index_lookup(
+    const struct ufs_index *index,
+    const char *path,
+    ino_t *inode_num,
+    int *type
+);
+void ufs_index_close(struct ufs_index *index);
+
+void ufs_index_add(
+    struct ufs_index_builder *builder,
+    const char *path,
+    size_t len,
+    ino_t inode_num,
+    int type
+);
+int ufs_index_write(
+    struct ufs_index_builder *builder,
+    const struct ufs_image *image,
+    const char *path
+);
+
+#endif
@@ -0,0 +1,446 @@
+/**
+ * ufsout.c
+ */
+#ifdef __linux__
+#define _GNU_SOURCE   // splice, copy_file_range
+#endif
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <fcntl.h>
+#include <unistd.h>   // copy_file_range
+#include <string.h>   // memcpy
+#include <errno.h>
+#include <sys/stat.h> // stat
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "ufsout.h"
+#include "ufsstats.h"
+
+static const char zeros[65536];
+
+static off_t kernel_copy(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+);
+static int read_through(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+);
+static char *bounce_buffer(char **bounce);
+static int queue(struct ufs_out *out, const void *data, size_t length);
+static int write_pending(struct ufs_out *out);
+static int seek_hole(struct ufs_out *out, off_t length);
+static int queue_zeros(struct ufs_out *out, off_t length);
+
+void
+ufs_out_init(struct ufs_out *out, int fd) {
+    /**
+     * Picks the copy strategy from what fd turns out to be
+     */
+    struct stat file_info;
+
+    out->fd = fd;
+    out->iovcnt = 0;
+    out->pending = 0;
+    out->staged = 0;
+    out->zero_copy = 1;
+    out->sparse = 0;
+    out->extend = 0;
+    out->old_end = 0;
+    out->bounce = NULL;
+
+    if (fstat(fd, &file_info) == -1) {
+        out->kind = UFS_OUT_OTHER;
+    } else if (S_ISFIFO(file_info.st_mode)) {
+        out->kind = UFS_OUT_PIPE;
+    } else if (S_ISREG(file_info.st_mode)) {
+        out->kind = UFS_OUT_FILE;
+
+        // Seeking does not move O_APPEND writes, those need real zeros
+        int flags = fcntl(fd, F_GETFL);
+        out->sparse = flags != -1 && !(flags & O_APPEND);
+
+        // A file opened without O_TRUNC still has its old bytes under holes
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        if (start != -1 && file_info.st_size > start) out->old_end = file_info.st_size;
+    } else if (S_ISSOCK(file_info.st_mode)) {
+        out->kind = UFS_OUT_SOCKET;
+    } else {
+        out->kind = UFS_OUT_OTHER;
+    }
+}
+
+int
+ufs_out_extent(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+) {
+    /**
+     * Writes length bytes starting at byte physical of the image.
+     * Returns -1 with errno set on a write error
+     */
+    if (out->zero_copy && out->kind != UFS_OUT_OTHER) {
+        // Anything batched has to reach fd before the kernel copies more
+        if (write_pending(out) == -1) return -1;
+
+        off_t done = kernel_copy(out, image, physical, length);
+        if (done < 0) return -1;
+        if (done) out->extend = 0;
+        physical += done;
+        length -= done;
+    }
+
+    // Fallback: batch pointers into the mapping for writev
+    if (!image->base) return read_through(out, image, physical, length);
+    size_t chunk;
+    while (length > 0) {
+        chunk = length < UFS_OUT_BATCH ? length : UFS_OUT_BATCH;
+        if (queue(out, image->base + physical, chunk) == -1) return -1;
+        physical += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int
+ufs_out_pextent(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length,
+    off_t offset
+) {
+    /**
+     * Positional ufs_out_extent for regular files: writes the bytes at
+     * offset in the file and leaves the file offset and the batch alone,
+     * so several threads can fill in different parts of one file
+     */
+    int zero_copy = out->zero_copy;
+    off_t in_offset, out_offset;
+    char *bounce = NULL;
+    size_t chunk;
+    ssize_t n;
+    int res = 0;
+
+    while (length > 0) {
+        chunk = length < (off_t)(1 << 30) ? length : (1 << 30);
+        if (zero_copy) {
+            in_offset = physical;
+            out_offset = offset;
+            n = copy_file_range(image->fd, &in_offset, out->fd, &out_offset, chunk, 0);
+        } else if (image->base) {
+            n = pwrite(out->fd, image->base + physical, chunk, offset);
+        } else {
+            // Not mapped: through a buffer of this call's own
+            if (chunk > UFS_OUT_BOUNCE) chunk = UFS_OUT_BOUNCE;
+            ufs_read(image, bounce_buffer(&bounce), chunk, physical);
+            n = pwrite(out->fd, bounce, chunk, offset);
+        }
+
+        if (n > 0) {
+            UFS_STAT(bytes_out, n);
+            physical += n;
+            offset += n;
+            length -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (!zero_copy || (n < 0 && (errno == EPIPE || errno == EIO || errno == ENOSPC ||
+                                     errno == EDQUOT || errno == EFBIG))) {
+            if (!n) errno = EIO;
+            res = -1;
+            break;
+        }
+
+        // Kernel would not copy this pair: pwrite from the mapping instead
+        zero_copy = 0;
+    }
+    free(bounce);
+    return res;
+}
+
+int
+ufs_out_zeros(struct ufs_out *out, off_t length) {
+    /**
+     * Writes length zero bytes (a hole in the file being copied)
+     */
+    if (out->sparse && length > 0) return seek_hole(out, length);
+    return queue_zeros(out, length);
+}
+
+int
+ufs_out_pzeros(struct ufs_out *out, off_t length, off_t offset) {
+    /**
+     * Positional ufs_out_zeros for ufs_out_pextent's callers: only the part
+     * of a hole over the file's old contents is written, what lies past
+     * them is left to be extended over
+     */
+    if (offset + length > out->old_end) length = out->old_end - offset;
+
+    size_t chunk;
+    ssize_t n;
+    while (length > 0) {
+        chunk = length < (off_t)sizeof(zeros) ? length : sizeof(zeros);
+        n = pwrite(out->fd, zeros, chunk, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        UFS_STAT(bytes_out, n);
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int
+ufs_out_bytes(struct ufs_out *out, const void *data, size_t length) {
+    /**
+     * Writes a small caller-owned buffer. It is copied into the stage so
+     * it can ride along in the same writev as the extents around it
+     */
+    if (length > UFS_OUT_STAGE) {
+        if (queue(out, data, length) == -1) return -1;
+        return write_pending(out);
+    }
+    if (out->staged + length > UFS_OUT_STAGE && write_pending(out) == -1) return -1;
+
+    char *copy = out->stage + out->staged;
+    memcpy(copy, data, length);
+    out->staged += length;
+    return queue(out, copy, length);
+}
+
+int
+ufs_out_flush(struct ufs_out *out) {
+    /**
+     * Writes out the pending writev batch. A copy that ended in a hole is
+     * extended to its full length
+     */
+    if (write_pending(out) == -1) return -1;
+    if (!out->extend) return 0;
+
+    struct stat file_info;
+    off_t end = lseek(out->fd, 0, SEEK_CUR);
+    if (end == -1 || fstat(out->fd, &file_info) == -1) return -1;
+    if (end > file_info.st_size && ftruncate(out->fd, end) == -1) return -1;
+    out->extend = 0;
+    return 0;
+}
+
+static off_t
+kernel_copy(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+) {
+    /**
+     * Lets the kernel move the bytes from the image fd without them
+     * passing through user space. Returns how much it copied; on the first
+     * refusal (unsupported fd pair, O_APPEND, ...) zero copy is switched off
+     */
+    off_t done = 0, in_offset;
+    size_t chunk;
+    ssize_t n;
+
+    while (done < length) {
+        in_offset = physical + done;
+        chunk = length - done < (off_t)(1 << 30) ? length - done : (1 << 30);
+
+        if (out->kind == UFS_OUT_PIPE) {
+#ifdef __linux__
+            n = splice(image->fd, &in_offset, out->fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+#else
+            n = -1;
+            errno = EOPNOTSUPP;
+#endif
+        } else if (out->kind == UFS_OUT_SOCKET) {
+#if defined(__linux__)
+            n = sendfile(out->fd, image->fd, &in_offset, chunk);
+#elif defined(__FreeBSD__)
+            // Counts what went out even when it stops early with an error
+            off_t sent = 0;
+            n = sendfile(image->fd, out->fd, in_offset, chunk, NULL, &sent, 0);
+            if (sent > 0) n = sent;
+#else
+            n = -1;
+            errno = EOPNOTSUPP;
+#endif
+        } else {
+            n = copy_file_range(image->fd, &in_offset, out->fd, NULL, chunk, 0);
+        }
+
+        if (n > 0) {
+            UFS_STAT(bytes_out, n);
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EPIPE || errno == EIO || errno == ENOSPC ||
+                      errno == EDQUOT || errno == EFBIG)) {
+            return -1;
+        }
+
+        out->zero_copy = 0;
+        break;
+    }
+    return done;
+}
+
+static int
+read_through(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+) {
+    /**
+     * The writev fallback for an image that is not mapped: each chunk is
+     * read into the bounce buffer and goes out with whatever is batched
+     * in front of it before the buffer is reused
+     */
+    bounce_buffer(&out->bounce);
+
+    size_t chunk;
+    while (length > 0) {
+        chunk = length < UFS_OUT_BOUNCE ? length : UFS_OUT_BOUNCE;
+        ufs_read(image, out->bounce, chunk, physical);
+        if (queue(out, out->bounce, chunk) == -1 || write_pending(out) == -1) return -1;
+        physical += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+static char *
+bounce_buffer(char **bounce) {
+    /**
+     * Allocates a bounce buffer the first time it is needed
+     */
+    if (!*bounce && !(*bounce = malloc(UFS_OUT_BOUNCE))) {
+        perror("malloc");
+        exit(1);
+    }
+    return *bounce;
+}
+
+static int
+write_pending(struct ufs_out *out) {
+    /**
+     * Writes out the pending writev batch
+     */
+    if (!out->iovcnt) return 0;
+
+    int res = ufs_writev_all(out->fd, out->iov, out->iovcnt);
+    if (!res) UFS_STAT(bytes_out, out->pending);
+    out->iovcnt = 0;
+    out->pending = 0;
+    out->staged = 0;
+    return res;
+}
+
+static int
+seek_hole(struct ufs_out *out, off_t length) {
+    /**
+     * Skips over a hole instead of writing it. The part still over the
+     * file's old contents is written as zeros. Falls back to writing
+     * zeros for good if fd turns out not to be seekable
+     */
+    if (write_pending(out) == -1) return -1;
+    if (out->old_end) {
+        off_t pos = lseek(out->fd, 0, SEEK_CUR);
+        if (pos != -1 && pos < out->old_end) {
+            off_t below = out->old_end - pos < length ? out->old_end - pos : length;
+            if (queue_zeros(out, below) == -1 || write_pending(out) == -1) return -1;
+            length -= below;
+            if (!length) return 0;
+        }
+    }
+    if (lseek(out->fd, length, SEEK_CUR) == -1) {
+        if (errno != ESPIPE && errno != EINVAL) return -1;
+        out->sparse = 0;
+        return ufs_out_zeros(out, length);
+    }
+    UFS_STAT(bytes_skipped, length);
+    out->extend = 1;
+    return 0;
+}
+
+static int
+queue_zeros(struct ufs_out *out, off_t length) {
+    /**
+     * Batches length real zero bytes
+     */
+    size_t chunk;
+    while (length > 0) {
+        chunk = length < (off_t)sizeof(zeros) ? length : sizeof(zeros);
+        if (queue(out, zeros, chunk) == -1) return -1;
+        length -= chunk;
+    }
+    return 0;
+}
+
+static int
+queue(struct ufs_out *out, const void *data, size_t length) {
+    /**
+     * Adds one buffer to the writev batch, flushing when it is full
+     */
+    out->extend = 0;
+    out->iov[out->iovcnt].iov_base = (void *)data;
+    out->iov[out->iovcnt].iov_len = length;
+    out->iovcnt++;
+    out->pending += length;
+
+    if (out->iovcnt == UFS_OUT_IOV || out->pending >= UFS_OUT_BATCH) {
+        return write_pending(out);
+    }
+    return 0;
+}
+
+int
+ufs_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    /**
+     * writev until everything went out, picking up after short writes.
+     * iov is used up on the way. Returns -1 with errno set on an error
+     */
+    ssize_t n;
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Drop what was written, trim a partly written iovec
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int
+ufs_write_all(int fd, const void *data, size_t length) {
+    /**
+     * Writes all of data, picking up after short writes and EINTR.
+     * Returns -1 with errno set on an error
+     */
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = length };
+    return ufs_writev_all(fd, &iov, 1);
+}
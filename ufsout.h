@@ -0,0 +1,76 @@
+/**
+ * ufsout.h
+ *
+ * Writes file extents from an image to a file descriptor with as few
+ * copies as the descriptor allows: splice(2) into pipes (Linux),
+ * copy_file_range(2) into regular files, sendfile(2) into sockets,
+ * batched writev(2) otherwise.
+ * Holes are seeked over in regular files, so the copy stays sparse, as
+ * far as they lie past where the file ended when it was opened; a file
+ * that was not truncated gets real zeros over its old bytes. An
+ * image that is not mapped is read into a bounce buffer for the writev.
+ */
+#ifndef UFSOUT_H
+#define UFSOUT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ufsread.h"
+
+#define UFS_OUT_IOV 64                  // iovecs per writev batch
+#define UFS_OUT_BATCH (16 << 20)        // bytes per writev batch
+#define UFS_OUT_STAGE 16384             // bytes of small writes per batch
+#define UFS_OUT_BOUNCE (1 << 20)        // bytes per read of an unmapped image
+
+enum ufs_out_kind {
+    UFS_OUT_PIPE,
+    UFS_OUT_FILE,
+    UFS_OUT_SOCKET,
+    UFS_OUT_OTHER,
+};
+
+struct ufs_out {
+    int fd;
+    enum ufs_out_kind kind;
+    int zero_copy;              // cleared once the kernel refuses it
+    int sparse;                 // holes become lseek(2)s
+    int extend;                 // last thing done was seeking over a hole
+    off_t old_end;              // old contents end here, 0 when there are none past the start
+
+    // Pending writev batch, pointing into the mapped image
+    struct iovec iov[UFS_OUT_IOV];
+    int iovcnt;
+    size_t pending;
+
+    // Copies of small writes (frame headers) the batch points into
+    char stage[UFS_OUT_STAGE];
+    size_t staged;
+
+    // Image data read for the writev when there is no mapping, allocated on first use
+    char *bounce;
+};
+
+void ufs_out_init(struct ufs_out *out, int fd);
+int ufs_out_extent(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length
+);
+int ufs_out_pextent(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    off_t physical,
+    off_t length,
+    off_t offset
+);
+int ufs_out_zeros(struct ufs_out *out, off_t length);
+int ufs_out_pzeros(struct ufs_out *out, off_t length, off_t offset);
+int ufs_out_bytes(struct ufs_out *out, const void *data, size_t length);
+int ufs_out_flush(struct ufs_out *out);
+
+int ufs_write_all(int fd, const void *data, size_t length);
+int ufs_writev_all(int fd, struct iovec *iov, int iovcnt);
+
+#endif
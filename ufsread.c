@@ -0,0 +1,601 @@
+/**
+ * ufsread.c
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h> // stat
+#include <sys/ioctl.h>
+#include <unistd.h>   // close, sysconf, pread
+#include <stdlib.h>   // qsort, malloc
+#include <string.h>   // strcmp, memcpy
+#include <errno.h>
+#ifdef __FreeBSD__
+#include <sys/disk.h> // DIOCGMEDIASIZE
+#endif
+#ifdef __linux__
+#include <linux/fs.h> // BLKGETSIZE64
+#endif
+
+#include "ufsread.h"
+#include "ufscache.h"
+#include "ufsstats.h"
+
+#ifndef EFTYPE
+#define EFTYPE EINVAL
+#endif
+#ifndef MAXBSIZE
+#define MAXBSIZE 65536
+#endif
+
+// Inode blocks closer than this are prefetched as one range
+#define PREFETCH_GAP (64 * 1024)
+
+static int device_size(int fd, off_t *size);
+static void count_block(struct ufs_extent_iter *iter, ufs_lbn_t lbn);
+static int compare_inodes(const void *a, const void *b);
+static ufs2_daddr_t lookup_block(
+    struct ufs_extent_iter *iter,
+    ufs_lbn_t lbn,
+    ufs_lbn_t *hole_span
+);
+
+int
+ufs_open(struct ufs_image *image, const char *path, enum ufs_backend backend) {
+    /**
+     * Opens a partition image, or a disk device holding one, to be read
+     * through backend. Returns -1 with errno set on failure
+     */
+    image->base = NULL;
+    image->superblock = NULL;
+    image->cache = NULL;
+    image->backend = backend;
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0) return -1;
+
+    // Get size of partition.img; devices are asked for theirs
+    struct stat file_info;
+    off_t size;
+    if (fstat(image->fd, &file_info) == -1) goto fail;
+    size = file_info.st_size;
+    if (!S_ISREG(file_info.st_mode) && device_size(image->fd, &size) == -1) goto fail;
+    image->size = size;
+    if (image->size < SBLOCK_UFS2 + sizeof(struct fs)) {
+        errno = EFTYPE;
+        goto fail;
+    }
+
+    if (backend == UFS_BACKEND_MMAP) {
+        // mmaping entire partition dump
+        image->base = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->fd, 0);
+        if (image->base == MAP_FAILED) {
+            image->base = NULL;
+            goto fail;
+        }
+        image->superblock = (struct fs *)(image->base + SBLOCK_UFS2);
+    } else {
+        // The superblock is kept aside, everything else goes through the cache
+        image->superblock = malloc(sizeof(struct fs));
+        if (!image->superblock) goto fail;
+        ufs_read(image, image->superblock, sizeof(struct fs), SBLOCK_UFS2);
+    }
+
+    struct fs *superblock = image->superblock;
+    if (superblock->fs_magic != FS_UFS2_MAGIC || superblock->fs_bsize < MINBSIZE ||
+        superblock->fs_bsize > MAXBSIZE || (superblock->fs_bsize & (superblock->fs_bsize - 1))) {
+        errno = EFTYPE;
+        goto fail;
+    }
+    ufs_geometry_init(&image->geometry, superblock);
+    if (backend != UFS_BACKEND_MMAP) {
+        image->cache = ufs_cache_create(image->fd, size, superblock->fs_bsize,
+                                        backend == UFS_BACKEND_AIO);
+        if (!image->cache) goto fail;
+    }
+    return 0;
+
+fail:
+    if (image->base) {
+        munmap(image->base, image->size);
+    } else {
+        free(image->superblock);
+    }
+    image->base = NULL;
+    image->superblock = NULL;
+    close(image->fd);
+    image->fd = -1;
+    return -1;
+}
+
+void
+ufs_close(struct ufs_image *image) {
+    if (image->base) {
+        munmap(image->base, image->size);
+    } else {
+        ufs_cache_destroy(image->cache);
+        free(image->superblock);
+    }
+    close(image->fd);
+    image->fd = -1;
+}
+
+int
+ufs_backend_parse(const char *name, enum ufs_backend *backend) {
+    /**
+     * Looks a backend up by name: mmap, pread or aio. Returns -1 for any
+     * other name
+     */
+    if (!strcmp(name, "mmap")) {
+        *backend = UFS_BACKEND_MMAP;
+    } else if (!strcmp(name, "pread")) {
+        *backend = UFS_BACKEND_PREAD;
+    } else if (!strcmp(name, "aio")) {
+        *backend = UFS_BACKEND_AIO;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void
+ufs_geometry_init(struct ufs_geometry *geometry, const struct fs *superblock) {
+    /**
+     * Picks the inode translation for superblock's geometry
+     */
+    uint32_t ipg = superblock->fs_ipg;
+    geometry->ipg = ipg;
+    geometry->ipg_shift = 0;
+    geometry->ipg_reciprocal = 0;
+    geometry->cg_bytes = lfragtosize(superblock, superblock->fs_fpg);
+    geometry->inodes_start = lfragtosize(superblock, superblock->fs_iblkno);
+
+    // Slots only run on across inode blocks when a cg's inodes fill whole blocks
+    if (!ipg || ipg % INOPB(superblock)) {
+        geometry->kind = UFS_GEOMETRY_GENERIC;
+    } else if (!(ipg & (ipg - 1))) {
+        geometry->kind = UFS_GEOMETRY_SHIFT;
+        while ((uint32_t)1 << geometry->ipg_shift < ipg) geometry->ipg_shift++;
+    } else {
+        geometry->kind = UFS_GEOMETRY_RECIPROCAL;
+        geometry->ipg_reciprocal = UINT64_MAX / ipg + 1;
+    }
+}
+
+off_t
+ufs_inode_offset(const struct ufs_image *image, ino_t inode_num) {
+    /**
+     * Byte offset of an inode: its cg's inode blocks start, plus its slot
+     * in the cg. The inode blocks of a cg are contiguous, so the slot is
+     * just the inode's index in the cg times the dinode size
+     */
+    const struct ufs_geometry *geometry = &image->geometry;
+    uint32_t ino = inode_num, cg;
+    uint64_t high, low;
+
+    switch (geometry->kind) {
+    case UFS_GEOMETRY_SHIFT:
+        cg = ino >> geometry->ipg_shift;
+        break;
+    case UFS_GEOMETRY_RECIPROCAL:
+        // High 64 bits of reciprocal * ino, exact for every 32-bit ino (Lemire)
+        high = (geometry->ipg_reciprocal >> 32) * ino;
+        low = (geometry->ipg_reciprocal & 0xffffffff) * ino;
+        cg = (high + (low >> 32)) >> 32;
+        break;
+    default:
+        return ufs_inode_offset_generic(image->superblock, inode_num);
+    }
+    return cg * geometry->cg_bytes + geometry->inodes_start +
+           (off_t)(ino - cg * geometry->ipg) * sizeof(struct ufs2_dinode);
+}
+
+off_t
+ufs_inode_offset_generic(const struct fs *superblock, ino_t inode_num) {
+    /**
+     * ufs_inode_offset straight from the fs.h macros: start of the inode's
+     * block plus its slot in the block
+     */
+    off_t cg_inode_start_offset = lfragtosize(superblock, ino_to_fsba(superblock, inode_num));
+    off_t inode_offset = (off_t)ino_to_fsbo(superblock, inode_num) * sizeof(struct ufs2_dinode);
+
+    return cg_inode_start_offset + inode_offset;
+}
+
+off_t
+ufs_block_offset(const struct fs *superblock, ufs2_daddr_t data_block) {
+    /**
+     * Byte offset of a data block. UFS2 puts no rotation into cgstart, so
+     * cgbase(dtog(b)) + dtogd(b) is b itself and the address is one shift,
+     * whatever the geometry
+     */
+    return lfragtosize(superblock, data_block);
+}
+
+const void *
+ufs_get(const struct ufs_image *image, off_t offset, size_t length, struct ufs_buf **buf) {
+    /**
+     * Pins length bytes at offset and returns them, good until
+     * ufs_put(buf). Through the cache the bytes have to lie within one
+     * file system block: NULL with errno EINVAL if they do not
+     */
+    *buf = NULL;
+    if (image->base) return image->base + offset;
+
+    size_t bsize = image->superblock->fs_bsize;
+    if ((offset & (bsize - 1)) + length > bsize) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ufs_cache_get(image->cache, offset, buf);
+}
+
+void
+ufs_put(const struct ufs_image *image, struct ufs_buf *buf) {
+    if (buf) ufs_cache_put(image->cache, buf);
+}
+
+void
+ufs_read(const struct ufs_image *image, void *buffer, size_t length, off_t offset) {
+    /**
+     * Copies bytes out of the image, past the cache. Past the end of the
+     * image reads as zeros; a read error is fatal
+     */
+    if (image->base) {
+        memcpy(buffer, image->base + offset, length);
+        return;
+    }
+
+    char *data = buffer;
+    ssize_t n;
+    while (length > 0) {
+        n = pread(image->fd, data, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pread");
+            exit(1);
+        }
+        if (!n) break;
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    memset(data, 0, length);
+}
+
+struct ufs2_dinode *
+ufs_inode(const struct ufs_image *image, ino_t inode_num, struct ufs_buf **buf) {
+    /**
+     * Pins an inode (never NULL, inodes do not straddle blocks)
+     */
+    UFS_STAT(inodes, 1);
+    return (struct ufs2_dinode *)ufs_get(image, ufs_inode_offset(image, inode_num),
+                                         sizeof(struct ufs2_dinode), buf);
+}
+
+void *
+ufs_block(const struct ufs_image *image, ufs2_daddr_t data_block, struct ufs_buf **buf) {
+    /**
+     * Pins a whole data block. NULL when a corrupt block number is not
+     * block aligned
+     */
+    return (void *)ufs_get(image, ufs_block_offset(image->superblock, data_block),
+                           image->superblock->fs_bsize, buf);
+}
+
+void
+ufs_prefetch(const struct ufs_image *image, off_t offset, off_t length) {
+    /**
+     * Asks the kernel to start reading a byte range of the image. Only a
+     * hint: errors are ignored and nothing waits for the I/O
+     */
+    static long page_size;
+    if (!page_size) page_size = sysconf(_SC_PAGESIZE);
+
+    off_t start = offset & ~(off_t)(page_size - 1);
+    off_t end = offset + length;
+    if (end > (off_t)image->size) end = image->size;
+    if (end <= start) return;
+
+    if (image->cache) {
+        ufs_cache_prefetch(image->cache, start, end - start);
+        return;
+    }
+    madvise(image->base + start, end - start, MADV_WILLNEED);
+}
+
+void
+ufs_prefetch_inodes(const struct ufs_image *image, ino_t *inodes, size_t count) {
+    /**
+     * Sorts inodes into on-disk order (cylinder group, then inode block)
+     * and prefetches the inode blocks holding them, merging nearby blocks
+     * into one request. The caller gets the sorted array back
+     */
+    struct fs *superblock = image->superblock;
+    if (!count) return;
+    qsort(inodes, count, sizeof(ino_t), compare_inodes);
+
+    off_t start = -1, end = -1, block;
+    for (size_t n = 0; n < count; n++) {
+        block = ufs_inode_offset(image, inodes[n]) -
+                (off_t)(inodes[n] & (INOPB(superblock) - 1)) * sizeof(struct ufs2_dinode);
+        if (start >= 0 && block <= end + PREFETCH_GAP) {
+            if (block + superblock->fs_bsize > end) end = block + superblock->fs_bsize;
+            continue;
+        }
+        if (start >= 0) ufs_prefetch(image, start, end - start);
+        start = block;
+        end = block + superblock->fs_bsize;
+    }
+    ufs_prefetch(image, start, end - start);
+}
+
+void
+ufs_extent_begin(
+    struct ufs_extent_iter *iter,
+    const struct ufs_image *image,
+    const struct ufs2_dinode *inode
+) {
+    /**
+     * Positions iter at the start of inode's data
+     */
+    struct fs *superblock = image->superblock;
+
+    iter->image = image;
+    iter->inode = inode;
+    iter->lbn = 0;
+    iter->num_blocks = lblkno(superblock, (off_t)inode->di_size + superblock->fs_bsize - 1);
+    iter->start = 0;
+    iter->end = inode->di_size;
+    iter->leaf = NULL;
+    iter->leaf_start = 0;
+    iter->leaf_buf = NULL;
+}
+
+int
+ufs_extent_next(struct ufs_extent_iter *iter, struct ufs_extent *extent) {
+    /**
+     * Fills in the next extent, merging blocks that follow each other on
+     * disk. Returns 0 once the file (or the range) is exhausted
+     */
+    struct fs *superblock = iter->image->superblock;
+    off_t file_size = iter->end;
+    ufs2_daddr_t blk;
+    ufs_lbn_t hole_span;
+
+    // Skip holes, a whole unallocated subtree at a time
+    for (;;) {
+        if (iter->lbn >= iter->num_blocks) return 0;
+        blk = lookup_block(iter, iter->lbn, &hole_span);
+        if (blk) break;
+        iter->lbn += hole_span;
+    }
+
+    extent->logical = lblktosize(superblock, iter->lbn);
+    extent->physical = ufs_block_offset(superblock, blk);
+    extent->length = file_size - extent->logical < superblock->fs_bsize
+                    ? file_size - extent->logical
+                    : superblock->fs_bsize;
+    if (ufs_stats_on) count_block(iter, iter->lbn);
+    iter->lbn++;
+
+    // Grow the extent while the next block sits right after it on disk
+    off_t bytes_left;
+    while (iter->lbn < iter->num_blocks) {
+        blk = lookup_block(iter, iter->lbn, &hole_span);
+        if (!blk || ufs_block_offset(superblock, blk) != extent->physical + extent->length) break;
+
+        bytes_left = file_size - lblktosize(superblock, iter->lbn);
+        extent->length += bytes_left < superblock->fs_bsize ? bytes_left : superblock->fs_bsize;
+        if (ufs_stats_on) count_block(iter, iter->lbn);
+        iter->lbn++;
+    }
+
+    // Only a range's first extent can start before it
+    if (extent->logical < iter->start) {
+        extent->physical += iter->start - extent->logical;
+        extent->length -= iter->start - extent->logical;
+        extent->logical = iter->start;
+    }
+    return 1;
+}
+
+void
+ufs_extent_seek(struct ufs_extent_iter *iter, off_t logical) {
+    /**
+     * Moves iter to the block holding byte logical of the file; the next
+     * extent starts there or, past a hole, later. The cached leaf is kept,
+     * lookups check it still covers the block
+     */
+    iter->lbn = lblkno(iter->image->superblock, logical);
+}
+
+void
+ufs_extent_range(struct ufs_extent_iter *iter, off_t start, off_t end) {
+    /**
+     * Limits iter to bytes [start, end) of the file, clipped to its size.
+     * Only the pointers down to start's block are read to get there, and
+     * nothing past end is looked at, so a range costs the depth of the
+     * block tree plus its own length
+     */
+    struct fs *superblock = iter->image->superblock;
+    off_t size = iter->inode->di_size;
+    if (end > size) end = size;
+    if (start > end) start = end;
+
+    iter->start = start;
+    iter->end = end;
+    iter->lbn = lblkno(superblock, start);
+    iter->num_blocks = start == end ? iter->lbn : lblkno(superblock, end + superblock->fs_bsize - 1);
+}
+
+void
+ufs_extent_end(struct ufs_extent_iter *iter) {
+    /**
+     * Unpins the cached leaf; iter can be begun again afterwards
+     */
+    ufs_put(iter->image, iter->leaf_buf);
+    iter->leaf = NULL;
+    iter->leaf_buf = NULL;
+}
+
+void
+ufs_dir_begin(
+    struct ufs_dir_iter *iter,
+    const struct ufs_image *image,
+    const struct ufs2_dinode *inode
+) {
+    ufs_extent_begin(&iter->extents, image, inode);
+    iter->extent.length = 0;
+    iter->done = 0;
+    iter->buf = NULL;
+}
+
+const char *
+ufs_dir_next(struct ufs_dir_iter *iter, off_t *physical, off_t *length) {
+    /**
+     * Unpins the last run and pins the next one, returning it and where it
+     * is in the image. NULL once the directory is exhausted
+     */
+    const struct ufs_image *image = iter->extents.image;
+    ufs_put(image, iter->buf);
+    iter->buf = NULL;
+    if (iter->done == iter->extent.length) {
+        if (!ufs_extent_next(&iter->extents, &iter->extent)) return NULL;
+        iter->done = 0;
+    }
+
+    *physical = iter->extent.physical + iter->done;
+    *length = iter->extent.length - iter->done;
+    if (!image->base) {
+        off_t bsize = image->superblock->fs_bsize;
+        off_t room = bsize - (*physical & (bsize - 1));
+        if (*length > room) *length = room;
+    }
+    iter->done += *length;
+    const char *data = ufs_get(image, *physical, *length, &iter->buf);
+    if (ufs_stats_on) ufs_stats_dir(data, *length, image->superblock->fs_bsize);
+    return data;
+}
+
+void
+ufs_dir_end(struct ufs_dir_iter *iter) {
+    ufs_put(iter->extents.image, iter->buf);
+    iter->buf = NULL;
+    ufs_extent_end(&iter->extents);
+}
+
+size_t
+ufs_normalize_path(char *path) {
+    /**
+     * Drops leading, trailing and doubled slashes in place, giving the
+     * form fs-index stores ("a/b/c"). Returns the new length
+     */
+    char *from = path, *to = path;
+    while (*from) {
+        if (*from == '/' && (to == path || to[-1] == '/')) {
+            from++;
+            continue;
+        }
+        *to++ = *from++;
+    }
+    if (to > path && to[-1] == '/') to--;
+    *to = '\0';
+    return to - path;
+}
+
+static ufs2_daddr_t
+lookup_block(struct ufs_extent_iter *iter, ufs_lbn_t lbn, ufs_lbn_t *hole_span) {
+    /**
+     * Maps a logical block to its disk block. A zero return is a hole, and
+     * hole_span says how many blocks from lbn on are known to be holes
+     */
+    *hole_span = 1;
+    if (lbn < UFS_NDADDR) return iter->inode->di_db[lbn];
+
+    // Sequential access stays inside the cached leaf most of the time
+    ufs_lbn_t nindir = NINDIR(iter->image->superblock);
+    if (iter->leaf && lbn >= iter->leaf_start && lbn < iter->leaf_start + nindir) {
+        return iter->leaf[lbn - iter->leaf_start];
+    }
+
+    // Find which indirect tree covers lbn: single, double or triple
+    ufs_lbn_t rel = lbn - UFS_NDADDR;
+    ufs_lbn_t span = nindir;
+    int level;
+    for (level = 0; level < UFS_NIADDR; level++) {
+        if (rel < span) break;
+        rel -= span;
+        span *= nindir;
+    }
+    if (level == UFS_NIADDR) {
+        *hole_span = iter->num_blocks - lbn;
+        return 0;
+    }
+
+    // Walk down, span being the number of blocks under the current pointer.
+    // Only the block being looked at is pinned; an unreadable one is a hole
+    ufs2_daddr_t ptr = iter->inode->di_ib[level];
+    const ufs2_daddr_t *indirect;
+    struct ufs_buf *buf = NULL;
+    int depth = 0;
+    for (;;) {
+        ufs_put(iter->image, buf);
+        if (!ptr || !(indirect = ufs_block(iter->image, ptr, &buf))) {
+            *hole_span = span - rel % span;
+            return 0;
+        }
+        UFS_STAT(indirect[depth++], 1);
+        span /= nindir;
+        if (span == 1) break;
+        ptr = indirect[(rel / span) % nindir];
+    }
+
+    ufs_put(iter->image, iter->leaf_buf);
+    iter->leaf = indirect;
+    iter->leaf_start = lbn - rel % nindir;
+    iter->leaf_buf = buf;
+    return indirect[rel % nindir];
+}
+
+static void
+count_block(struct ufs_extent_iter *iter, ufs_lbn_t lbn) {
+    /**
+     * Counts a data block under the pointer it hangs off: direct, or the
+     * single, double or triple indirect tree
+     */
+    ufs_lbn_t nindir = NINDIR(iter->image->superblock);
+    ufs_lbn_t rel = lbn - UFS_NDADDR, span = nindir;
+    int level = 0;
+    if (lbn >= UFS_NDADDR) {
+        for (level = 1; level < UFS_NIADDR && rel >= span; level++) {
+            rel -= span;
+            span *= nindir;
+        }
+    }
+    ufs_stats_local()->blocks[level]++;
+}
+
+static int
+device_size(int fd, off_t *size) {
+    /**
+     * Size of a disk device, which has no st_size
+     */
+#if defined(DIOCGMEDIASIZE)
+    return ioctl(fd, DIOCGMEDIASIZE, size);
+#elif defined(BLKGETSIZE64)
+    uint64_t bytes;
+    if (ioctl(fd, BLKGETSIZE64, &bytes) == -1) return -1;
+    *size = bytes;
+    return 0;
+#else
+    *size = lseek(fd, 0, SEEK_END);
+    return *size == -1 ? -1 : 0;
+#endif
+}
+
+static int
+compare_inodes(const void *a, const void *b) {
+    ino_t x = *(const ino_t *)a, y = *(const ino_t *)b;
+    return x < y ? -1 : x > y;
+}
@@ -0,0 +1,144 @@
+/**
+ * ufsread.h
+ *
+ * libufsread: read-only access to a UFS2 partition image, shared by the
+ * fs-* tools. Every offset is a 64-bit byte offset into the image.
+ *
+ * The image is read through a backend: the whole of it mapped (mmap), or
+ * one block at a time into a bounded cache with pread(2), or with the same
+ * cache filled by batches of POSIX aio reads (aio). Disk devices cannot be
+ * mapped on FreeBSD, so those need one of the latter. Whatever the backend,
+ * data is looked at through ufs_get/ufs_put pairs (or the wrappers below),
+ * and a pointer is only good until the put.
+ */
+#ifndef UFSREAD_H
+#define UFSREAD_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>   // size_t
+
+#include </usr/src/sys/ufs/ffs/fs.h>
+#include </usr/src/sys/ufs/ufs/dinode.h>
+#include </usr/src/sys/ufs/ufs/dir.h>
+
+enum ufs_backend {
+    UFS_BACKEND_MMAP,
+    UFS_BACKEND_PREAD,
+    UFS_BACKEND_AIO,
+};
+
+struct ufs_buf;
+
+/*
+ * Inode number -> image offset, worked out once per image. Inode numbers
+ * are divided by fs_ipg: a shift and mask when it is a power of two,
+ * otherwise a multiply by its precomputed reciprocal. A superblock the
+ * shortcuts do not hold for (inodes per group not whole inode blocks)
+ * goes the long way with the fs.h macros
+ */
+enum ufs_geometry_kind {
+    UFS_GEOMETRY_SHIFT,
+    UFS_GEOMETRY_RECIPROCAL,
+    UFS_GEOMETRY_GENERIC,
+};
+
+struct ufs_geometry {
+    enum ufs_geometry_kind kind;
+    uint32_t ipg;
+    int ipg_shift;              // UFS_GEOMETRY_SHIFT
+    uint64_t ipg_reciprocal;    // UFS_GEOMETRY_RECIPROCAL: 2^64 / ipg, rounded up
+    off_t cg_bytes;             // fs_fpg in bytes
+    off_t inodes_start;         // fs_iblkno in bytes, from the start of a cg
+};
+
+struct ufs_image {
+    int fd;
+    char *base;                 // whole image mapped read-only, NULL without mmap
+    size_t size;
+    struct fs *superblock;
+    enum ufs_backend backend;
+    struct ufs_cache *cache;    // pread and aio backends
+    struct ufs_geometry geometry;
+};
+
+/*
+ * A run of a file's blocks that is contiguous both in the file and on disk.
+ * Holes (zero block pointers) are never part of an extent.
+ */
+struct ufs_extent {
+    off_t logical;              // byte offset in the file
+    off_t physical;             // byte offset in the image
+    off_t length;               // bytes, clipped to di_size
+};
+
+struct ufs_extent_iter {
+    const struct ufs_image *image;
+    const struct ufs2_dinode *inode;
+    ufs_lbn_t lbn;              // next logical block to look at
+    ufs_lbn_t num_blocks;       // logical blocks covered by di_size, or the range
+    off_t start, end;           // bytes handed out, [0, di_size) unless ranged
+
+    // Last leaf indirect block looked at, so sequential lookups skip the descent
+    const ufs2_daddr_t *leaf;
+    ufs_lbn_t leaf_start;       // first lbn the leaf maps
+    struct ufs_buf *leaf_buf;
+};
+
+/*
+ * A directory's blocks, pinned one run at a time while the caller goes
+ * through the entries: a whole extent when mapped, a block at most through
+ * the cache. Entries never straddle a block, so either way a run holds
+ * whole entries.
+ */
+struct ufs_dir_iter {
+    struct ufs_extent_iter extents;
+    struct ufs_extent extent;
+    off_t done;                 // bytes of extent handed out so far
+    struct ufs_buf *buf;
+};
+
+int ufs_open(struct ufs_image *image, const char *path, enum ufs_backend backend);
+void ufs_close(struct ufs_image *image);
+int ufs_backend_parse(const char *name, enum ufs_backend *backend);
+
+void ufs_geometry_init(struct ufs_geometry *geometry, const struct fs *superblock);
+off_t ufs_inode_offset(const struct ufs_image *image, ino_t inode_num);
+off_t ufs_inode_offset_generic(const struct fs *superblock, ino_t inode_num);
+off_t ufs_block_offset(const struct fs *superblock, ufs2_daddr_t data_block);
+
+const void *ufs_get(
+    const struct ufs_image *image,
+    off_t offset,
+    size_t length,
+    struct ufs_buf **buf
+);
+void ufs_put(const struct ufs_image *image, struct ufs_buf *buf);
+void ufs_read(const struct ufs_image *image, void *buffer, size_t length, off_t offset);
+struct ufs2_dinode *ufs_inode(const struct ufs_image *image, ino_t inode_num, struct ufs_buf **buf);
+void *ufs_block(const struct ufs_image *image, ufs2_daddr_t data_block, struct ufs_buf **buf);
+
+void ufs_prefetch(const struct ufs_image *image, off_t offset, off_t length);
+void ufs_prefetch_inodes(const struct ufs_image *image, ino_t *inodes, size_t count);
+
+void ufs_extent_begin(
+    struct ufs_extent_iter *iter,
+    const struct ufs_image *image,
+    const struct ufs2_dinode *inode
+);
+int ufs_extent_next(struct ufs_extent_iter *iter, struct ufs_extent *extent);
+void ufs_extent_seek(struct ufs_extent_iter *iter, off_t logical);
+void ufs_extent_range(struct ufs_extent_iter *iter, off_t start, off_t end);
+void ufs_extent_end(struct ufs_extent_iter *iter);
+
+void ufs_dir_begin(
+    struct ufs_dir_iter *iter,
+    const struct ufs_image *image,
+    const struct ufs2_dinode *inode
+);
+const char *ufs_dir_next(struct ufs_dir_iter *iter, off_t *physical, off_t *length);
+void ufs_dir_end(struct ufs_dir_iter *iter);
+
+size_t ufs_normalize_path(char *path);
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * ufsscan.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // calloc
+#include <string.h>   // memcpy
+#include <stddef.h>   // offsetof
+#include <limits.h>   // PATH_MAX
+#include <errno.h>
+
+#include "ufsscan.h"
+#include "ufsstats.h"
+
+#ifndef EFTYPE
+#define EFTYPE EINVAL
+#endif
+
+// Deeper than any real tree; stops a corrupt parent map from looping
+#define MAX_DEPTH (PATH_MAX / 2)
+
+struct cg *
+ufs_cg(const struct ufs_image *image, int cg, struct ufs_buf **buf) {
+    /**
+     * Pins a cylinder group's header. NULL (nothing pinned) when it is not
+     * one
+     */
+    struct fs *superblock = image->superblock;
+    *buf = NULL;
+    if (cg < 0 || cg >= superblock->fs_ncg) return NULL;
+
+    off_t offset = lfragtosize(superblock, cgtod(superblock, cg));
+    if (offset + superblock->fs_cgsize > (off_t)image->size) return NULL;
+
+    struct cg *header = (struct cg *)ufs_get(image, offset, superblock->fs_cgsize, buf);
+    if (header && cg_chkmagic(header)) return header;
+    ufs_put(image, *buf);
+    *buf = NULL;
+    return NULL;
+}
+
+int
+ufs_scan_cg(const struct ufs_image *image, int cg, ufs_scan_func func, void *arg) {
+    /**
+     * Calls func for every allocated inode of a cylinder group, in inode
+     * table order. The table is read sequentially (and prefetched as a
+     * whole), free inodes are skipped a bitmap byte at a time. Returns -1
+     * with errno EFTYPE when the cg header is bad
+     */
+    struct fs *superblock = image->superblock;
+    struct ufs_buf *header_buf, *buf = NULL;
+    struct cg *header = ufs_cg(image, cg, &header_buf);
+    if (!header) {
+        errno = EFTYPE;
+        return -1;
+    }
+
+    // Past cg_initediblk the table was never written
+    ino_t count = header->cg_initediblk;
+    if (count > (ino_t)superblock->fs_ipg) count = superblock->fs_ipg;
+    ino_t first = (ino_t)cg * superblock->fs_ipg;
+    ufs_prefetch(image, ufs_inode_offset(image, first), count * sizeof(struct ufs2_dinode));
+
+    // Inodes come a whole inode block at a time, pinned while in use
+    // (not through ufs_inode, which would count one of them twice)
+    const u_int8_t *used = cg_inosused(header);
+    struct ufs2_dinode *inodes = NULL;
+    ino_t pinned = 0, per_block = INOPB(superblock);
+    for (ino_t i = 0; i < count; i++) {
+        if (!used[i / NBBY]) {
+            i |= NBBY - 1;
+            continue;
+        }
+        if (!(used[i / NBBY] & (1 << (i % NBBY)))) continue;
+        if (!inodes || i - pinned >= per_block) {
+            ufs_put(image, buf);
+            pinned = i - i % per_block;
+            inodes = (struct ufs2_dinode *)ufs_get(image, ufs_inode_offset(image, first + pinned),
+                                                   per_block * sizeof(struct ufs2_dinode), &buf);
+        }
+        UFS_STAT(inodes, 1);
+        func(arg, first + i, inodes + (i - pinned));
+    }
+    ufs_put(image, buf);
+    ufs_put(image, header_buf);
+    return 0;
+}
+
+int
+ufs_parents_init(struct ufs_parents *parents, const struct ufs_image *image) {
+    /**
+     * Sizes the map for every inode the file system can have. Returns -1
+     * with errno set when out of memory
+     */
+    struct fs *superblock = image->superblock;
+    parents->ninodes = (ino_t)superblock->fs_ncg * superblock->fs_ipg;
+    parents->parent = calloc(parents->ninodes, sizeof(*parents->parent));
+    parents->entry = calloc(parents->ninodes, sizeof(off_t));
+    if (!parents->parent || !parents->entry) {
+        ufs_parents_free(parents);
+        return -1;
+    }
+    return 0;
+}
+
+void
+ufs_parents_add_dir(
+    struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t dir_inode,
+    const struct ufs2_dinode *inode
+) {
+    /**
+     * Records a directory as the parent of everything in it. Safe to call
+     * from several threads: a hard linked inode keeps whichever entry was
+     * recorded first
+     */
+    struct ufs_dir_iter iter;
+    const char *data;
+    off_t physical, length;
+    const struct direct *dir;
+    uint32_t none;
+    ufs_dir_begin(&iter, image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+            dir = (const struct direct *)(data + offset);
+            if (!dir->d_reclen) break; // corrupt block, don't spin
+            if (!dir->d_ino || dir->d_ino >= parents->ninodes) continue;
+            if (dir->d_name[0] == '.' &&
+                (dir->d_namlen == 1 || (dir->d_namlen == 2 && dir->d_name[1] == '.'))) {
+                continue;
+            }
+
+            none = 0;
+            if (atomic_compare_exchange_strong_explicit(&parents->parent[dir->d_ino], &none,
+                    dir_inode, memory_order_relaxed, memory_order_relaxed)) {
+                parents->entry[dir->d_ino] = physical + offset;
+            }
+        }
+    }
+    ufs_dir_end(&iter);
+}
+
+const struct direct *
+ufs_parents_entry(
+    const struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    struct ufs_buf **buf
+) {
+    /**
+     * Pins the directory entry naming inode_num. NULL (nothing pinned)
+     * when none was seen
+     */
+    *buf = NULL;
+    if (inode_num >= parents->ninodes || !atomic_load_explicit(&parents->parent[inode_num],
+                                                               memory_order_relaxed)) {
+        return NULL;
+    }
+    // Only the fixed part is asked for: the name follows in the same block
+    return ufs_get(image, parents->entry[inode_num], offsetof(struct direct, d_name), buf);
+}
+
+ssize_t
+ufs_parents_path(
+    const struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    char *path,
+    size_t size,
+    int *depth
+) {
+    /**
+     * Writes inode_num's path from the root ("a/b/c") into path and its
+     * depth (1 for the root's entries). Returns the length, or -1 when the
+     * inode is not reachable from the root or the path does not fit
+     */
+    // Names go in from the end backwards, each entry pinned just for its copy
+    char names[PATH_MAX];
+    size_t start = sizeof(names);
+    int count = 0;
+    struct ufs_buf *buf;
+    while (inode_num != UFS_ROOTINO) {
+        const struct direct *dir = ufs_parents_entry(parents, image, inode_num, &buf);
+        if (!dir || count == MAX_DEPTH || dir->d_namlen + 1 > start) {
+            ufs_put(image, buf);
+            return -1;
+        }
+        if (count++) names[--start] = '/';
+        start -= dir->d_namlen;
+        memcpy(names + start, dir->d_name, dir->d_namlen);
+        ufs_put(image, buf);
+        inode_num = atomic_load_explicit(&parents->parent[inode_num], memory_order_relaxed);
+    }
+
+    size_t len = sizeof(names) - start;
+    if (len + 1 > size) return -1;
+    memcpy(path, names + start, len);
+    path[len] = '\0';
+    *depth = count;
+    return len;
+}
+
+void
+ufs_parents_free(struct ufs_parents *parents) {
+    free(parents->parent);
+    free(parents->entry);
+    parents->parent = NULL;
+    parents->entry = NULL;
+}
@@ -0,0 +1,53 @@
+/**
+ * ufsscan.h
+ *
+ * Attribute queries without the directory walk: the inode table of each
+ * cylinder group is read front to back, and paths are put together
+ * afterwards from a parent map (child inode -> the directory entry naming
+ * it) filled in while the directories go by. Cylinder groups are
+ * independent, so each one can be scanned on its own thread.
+ */
+#ifndef UFSSCAN_H
+#define UFSSCAN_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "ufsread.h"
+
+typedef void (*ufs_scan_func)(void *arg, ino_t inode_num, struct ufs2_dinode *inode);
+
+struct ufs_parents {
+    ino_t ninodes;
+    _Atomic uint32_t *parent;   // 0: no entry seen (yet)
+    off_t *entry;               // image offset of the entry's struct direct
+};
+
+struct cg *ufs_cg(const struct ufs_image *image, int cg, struct ufs_buf **buf);
+int ufs_scan_cg(const struct ufs_image *image, int cg, ufs_scan_func func, void *arg);
+
+int ufs_parents_init(struct ufs_parents *parents, const struct ufs_image *image);
+void ufs_parents_add_dir(
+    struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t dir_inode,
+    const struct ufs2_dinode *inode
+);
+const struct direct *ufs_parents_entry(
+    const struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    struct ufs_buf **buf
+);
+ssize_t ufs_parents_path(
+    const struct ufs_parents *parents,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    char *path,
+    size_t size,
+    int *depth
+);
+void ufs_parents_free(struct ufs_parents *parents);
+
+#endif
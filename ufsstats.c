@@ -0,0 +1,227 @@
+/**
+ * ufsstats.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // calloc, exit
+#include <string.h>   // memset
+#include <unistd.h>   // sysconf
+#include <time.h>     // clock_gettime
+#include <pthread.h>
+#include <sys/mman.h> // mincore
+#include <sys/resource.h>
+
+#include "ufsstats.h"
+
+// Pages looked at per mincore(2) call
+#define RESIDENT_WINDOW 4096
+
+struct phase {
+    const char *name;
+    struct timespec start;
+    double wall_ms;
+    long majflt, minflt;        // at the start, then used during the phase
+};
+
+int ufs_stats_on;
+
+static int stats_residency;
+static int resident_known;
+static size_t resident_before, pages_before;
+
+// Every thread's counters, for the report to add up
+static struct ufs_stats *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct ufs_stats *local_stats;
+
+static struct phase phases[UFS_STATS_PHASES];
+static int nphases, running = -1;
+
+struct ufs_stats *
+ufs_stats_local(void) {
+    /**
+     * The calling thread's counters, made on its first count
+     */
+    if (local_stats) return local_stats;
+
+    local_stats = calloc(1, sizeof(struct ufs_stats));
+    if (!local_stats) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_mutex_lock(&stats_lock);
+    local_stats->next = all_stats;
+    all_stats = local_stats;
+    pthread_mutex_unlock(&stats_lock);
+    return local_stats;
+}
+
+void
+ufs_stats_enable(int residency) {
+    /**
+     * Turns counting on, before any other thread starts. With residency,
+     * the image's pages in memory are counted when it is opened and again
+     * in the report
+     */
+    ufs_stats_on = 1;
+    stats_residency = residency;
+}
+
+void
+ufs_stats_phase(const char *name) {
+    /**
+     * Ends the running phase and starts the one called name (NULL: none).
+     * Faults come from getrusage(2), so they are the whole process's
+     */
+    if (!ufs_stats_on) return;
+
+    struct timespec now;
+    struct rusage usage;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (running >= 0) {
+        struct phase *phase = &phases[running];
+        phase->wall_ms = (now.tv_sec - phase->start.tv_sec) * 1e3 +
+                         (now.tv_nsec - phase->start.tv_nsec) / 1e6;
+        phase->majflt = usage.ru_majflt - phase->majflt;
+        phase->minflt = usage.ru_minflt - phase->minflt;
+        running = -1;
+    }
+    if (!name || nphases == UFS_STATS_PHASES) return;
+
+    running = nphases++;
+    phases[running].name = name;
+    phases[running].start = now;
+    phases[running].majflt = usage.ru_majflt;
+    phases[running].minflt = usage.ru_minflt;
+}
+
+void
+ufs_stats_dir(const char *data, off_t length, int32_t bsize) {
+    /**
+     * Counts a run of directory blocks and sizes up its live entries. Only
+     * called with stats on: it is a second pass over the run
+     */
+    struct ufs_stats *stats = ufs_stats_local();
+    const struct direct *dir;
+    size_t size;
+    int bucket;
+
+    stats->dir_blocks += (length + bsize - 1) / bsize;
+    for (off_t offset = 0; offset < length; offset += dir->d_reclen) {
+        dir = (const struct direct *)(data + offset);
+        if (!dir->d_reclen) break; // corrupt block, don't spin
+        if (!dir->d_ino) continue;
+
+        size = DIRECTSIZ(dir->d_namlen);
+        for (bucket = 0; bucket < UFS_STATS_SIZES - 1 && size > ((size_t)16 << bucket); bucket++);
+        stats->entry_sizes[bucket]++;
+        stats->dir_entries++;
+    }
+}
+
+void
+ufs_stats_opened(const struct ufs_image *image) {
+    /**
+     * Takes the "before" residency of a freshly opened image
+     */
+    if (ufs_stats_on && stats_residency) {
+        resident_known = ufs_stats_resident(image, &resident_before, &pages_before) == 0;
+    }
+}
+
+void
+ufs_stats_report(FILE *out, const struct ufs_image *image) {
+    /**
+     * Ends the last phase and prints everything counted
+     */
+    if (!ufs_stats_on) return;
+    ufs_stats_phase(NULL);
+
+    struct ufs_stats total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    for (struct ufs_stats *stats = all_stats; stats; stats = stats->next) {
+        total.inodes += stats->inodes;
+        total.dir_blocks += stats->dir_blocks;
+        total.dir_entries += stats->dir_entries;
+        for (int i = 0; i < UFS_STATS_SIZES; i++) total.entry_sizes[i] += stats->entry_sizes[i];
+        for (int i = 0; i <= UFS_NIADDR; i++) total.blocks[i] += stats->blocks[i];
+        for (int i = 0; i < UFS_NIADDR; i++) total.indirect[i] += stats->indirect[i];
+        total.bytes_out += stats->bytes_out;
+        total.bytes_skipped += stats->bytes_skipped;
+        total.cache_hits += stats->cache_hits;
+        total.cache_misses += stats->cache_misses;
+        total.aio_batches += stats->aio_batches;
+        total.aio_reads += stats->aio_reads;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(out, "%-16s %10s %8s %8s\n", "phase", "wall ms", "major", "minor");
+    for (int i = 0; i < nphases; i++) {
+        fprintf(out, "%-16s %10.3f %8ld %8ld\n",
+                phases[i].name, phases[i].wall_ms, phases[i].majflt, phases[i].minflt);
+    }
+
+    fprintf(out, "inodes read      %ju\n", (uintmax_t)total.inodes);
+    fprintf(out, "directory blocks %ju, %ju entries\n",
+            (uintmax_t)total.dir_blocks, (uintmax_t)total.dir_entries);
+    fprintf(out, "entry sizes     ");
+    for (int i = 0; i < UFS_STATS_SIZES; i++) {
+        fprintf(out, " <=%d %ju", 16 << i, (uintmax_t)total.entry_sizes[i]);
+    }
+    fprintf(out, "\ndata blocks      direct %ju, single %ju, double %ju, triple %ju\n",
+            (uintmax_t)total.blocks[0], (uintmax_t)total.blocks[1],
+            (uintmax_t)total.blocks[2], (uintmax_t)total.blocks[3]);
+    fprintf(out, "indirect reads   level 1 %ju, level 2 %ju, level 3 %ju\n",
+            (uintmax_t)total.indirect[0], (uintmax_t)total.indirect[1], (uintmax_t)total.indirect[2]);
+    if (image->cache) {
+        fprintf(out, "cache            %ju hits, %ju misses\n",
+                (uintmax_t)total.cache_hits, (uintmax_t)total.cache_misses);
+    }
+    if (image->backend == UFS_BACKEND_AIO) {
+        fprintf(out, "aio              %ju batches, %ju reads\n",
+                (uintmax_t)total.aio_batches, (uintmax_t)total.aio_reads);
+    }
+    fprintf(out, "bytes out        %ju, %ju more in holes\n",
+            (uintmax_t)total.bytes_out, (uintmax_t)total.bytes_skipped);
+
+    size_t resident, pages;
+    if (stats_residency) {
+        if (resident_known && ufs_stats_resident(image, &resident, &pages) == 0) {
+            fprintf(out, "resident pages   %zu of %zu before, %zu after\n",
+                    resident_before, pages_before, resident);
+        } else {
+            fprintf(out, "resident pages   unknown (image cannot be mapped)\n");
+        }
+    }
+}
+
+int
+ufs_stats_resident(const struct ufs_image *image, size_t *resident, size_t *pages) {
+    /**
+     * Counts the image's pages that are in memory with mincore(2), through
+     * a mapping of its own when the backend has none. Returns -1 when the
+     * image cannot be mapped (a disk device)
+     */
+    long page_size = sysconf(_SC_PAGESIZE);
+    char *base = image->base;
+    if (!base) {
+        base = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->fd, 0);
+        if (base == MAP_FAILED) return -1;
+    }
+
+    char vec[RESIDENT_WINDOW];
+    size_t window = (size_t)RESIDENT_WINDOW * page_size, length, count = 0, n;
+    *pages = (image->size + page_size - 1) / page_size;
+    for (size_t offset = 0; offset < image->size; offset += window) {
+        length = image->size - offset < window ? image->size - offset : window;
+        if (mincore(base + offset, length, (void *)vec) == -1) break;
+        n = (length + page_size - 1) / page_size;
+        for (size_t i = 0; i < n; i++) count += vec[i] & 1;
+    }
+    *resident = count;
+
+    if (base != image->base) munmap(base, image->size);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * ufsstats.h
+ *
+ * Opt-in counters for --stats. Every thread counts into its own struct, so
+ * the parallel modes do not share cache lines; the report adds them up.
+ * With stats off a counter is one test of a global flag that never changes
+ * during the run, so the same binary can stay in production.
+ */
+#ifndef UFSSTATS_H
+#define UFSSTATS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ufsread.h"
+
+// Directory entry sizes (DIRECTSIZ) up to 16, 32, ... 512 bytes
+#define UFS_STATS_SIZES 6
+
+#define UFS_STATS_PHASES 16
+
+struct ufs_stats {
+    uint64_t inodes;                    // inodes read
+    uint64_t dir_blocks;                // directory blocks parsed
+    uint64_t dir_entries;               // live entries in them
+    uint64_t entry_sizes[UFS_STATS_SIZES];
+    uint64_t blocks[1 + UFS_NIADDR];    // data blocks mapped: direct, single, double, triple
+    uint64_t indirect[UFS_NIADDR];      // indirect blocks read, by depth below the inode
+    uint64_t bytes_out;                 // written to the output
+    uint64_t bytes_skipped;             // holes seeked over in the output
+    uint64_t cache_hits, cache_misses;  // pread and aio backends
+    uint64_t aio_batches, aio_reads;
+    struct ufs_stats *next;
+};
+
+extern int ufs_stats_on;
+
+// Adds n to one of the calling thread's counters, if stats are on
+#define UFS_STAT(field, n) do { \
+        if (ufs_stats_on) ufs_stats_local()->field += (n); \
+    } while (0)
+
+struct ufs_stats *ufs_stats_local(void);
+void ufs_stats_enable(int residency);
+void ufs_stats_phase(const char *name);
+void ufs_stats_dir(const char *data, off_t length, int32_t bsize);
+void ufs_stats_opened(const struct ufs_image *image);
+void ufs_stats_report(FILE *out, const struct ufs_image *image);
+int ufs_stats_resident(const struct ufs_image *image, size_t *resident, size_t *pages);
+
+#endif
@@ -0,0 +1,484 @@
+/**
+ * ufstar.c
+ */
+#include <stdio.h>
+#include <stdlib.h>   // malloc, exit
+#include <string.h>   // memcpy
+#include <stdint.h>   // uintmax_t
+#include <limits.h>   // PATH_MAX
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h> // major, minor
+#endif
+
+#include "ufstar.h"
+#include "dirscan.h"
+
+// Bytes of a pax extended header's records, before padding
+#define PAX_MAX (3 * PATH_MAX + 256)
+
+static const char zero_blocks[UFS_TAR_RECORD];
+
+struct link {
+    ino_t inode;                // 0: free slot
+    char *path;                 // where the file was archived
+};
+
+struct child {
+    ino_t inode;
+    size_t name;                // offset in the names buffer
+    size_t namlen;
+};
+
+struct tar {
+    struct ufs_out *out;
+    const struct ufs_image *image;
+    off_t written;              // bytes of archive so far
+
+    // Path of the entry being written, without a trailing slash
+    char *path;
+    size_t path_len, path_cap;
+
+    // Hard linked files already archived, open addressing by inode number
+    struct link *links;
+    size_t nlinks, links_cap;
+};
+
+static int tar_entry(struct tar *tar, ino_t inode_num);
+static int tar_directory(struct tar *tar, struct ufs2_dinode *inode);
+static int tar_file(struct tar *tar, struct ufs2_dinode *inode);
+static int tar_header(
+    struct tar *tar,
+    const struct ufs2_dinode *inode,
+    char type,
+    off_t size,
+    const char *linkname,
+    size_t linklen
+);
+static void prefetch_children(struct tar *tar, struct child *children, size_t count);
+static size_t read_symlink(struct tar *tar, const struct ufs2_dinode *inode, char *target);
+static const char *find_link(struct tar *tar, ino_t inode_num);
+static void add_link(struct tar *tar, ino_t inode_num);
+static void set_path(struct tar *tar, size_t len, const char *name, size_t namlen);
+
+int
+ufs_tar_write(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    const char *name
+) {
+    /**
+     * Writes inode_num (a whole subtree if it is a directory) as a tar
+     * archive, its entries named name and name/... Ends the archive and
+     * pads it to a whole record. Returns -1 with errno set when the output
+     * fails
+     */
+    struct tar tar;
+    memset(&tar, 0, sizeof(tar));
+    tar.out = out;
+    tar.image = image;
+    set_path(&tar, 0, name, strlen(name));
+
+    int result = tar_entry(&tar, inode_num);
+    if (result == 0) {
+        // Two zero blocks end it, then zeros up to the record
+        off_t end = tar.written + 2 * UFS_TAR_BLOCK;
+        end += (UFS_TAR_RECORD - end % UFS_TAR_RECORD) % UFS_TAR_RECORD;
+        result = ufs_out_bytes(out, zero_blocks, end - tar.written);
+    }
+
+    for (size_t n = 0; n < tar.links_cap; n++) free(tar.links[n].path);
+    free(tar.links);
+    free(tar.path);
+    return result;
+}
+
+static int
+tar_entry(struct tar *tar, ino_t inode_num) {
+    /**
+     * Archives one inode under tar->path, and what is below it. Sockets and
+     * whiteouts have no tar form and are left out
+     */
+    struct ufs_buf *buf;
+    struct ufs2_dinode *inode = ufs_inode(tar->image, inode_num, &buf);
+    char target[PATH_MAX + 1];
+    const char *first;
+    size_t len;
+    int result = 0;
+
+    switch (inode->di_mode & IFMT) {
+    case IFDIR:
+        // A directory's name ends in a slash
+        set_path(tar, tar->path_len, "/", 1);
+        tar->path_len--;
+        result = tar_header(tar, inode, '5', 0, NULL, 0);
+        if (result == 0) result = tar_directory(tar, inode);
+        break;
+    case IFREG:
+        if (inode->di_nlink > 1 && (first = find_link(tar, inode_num))) {
+            result = tar_header(tar, inode, '1', 0, first, strlen(first));
+            break;
+        }
+        if (inode->di_nlink > 1) add_link(tar, inode_num);
+        result = tar_header(tar, inode, '0', inode->di_size, NULL, 0);
+        if (result == 0) result = tar_file(tar, inode);
+        break;
+    case IFLNK:
+        len = read_symlink(tar, inode, target);
+        result = tar_header(tar, inode, '2', 0, target, len);
+        break;
+    case IFCHR:
+        result = tar_header(tar, inode, '3', 0, NULL, 0);
+        break;
+    case IFBLK:
+        result = tar_header(tar, inode, '4', 0, NULL, 0);
+        break;
+    case IFIFO:
+        result = tar_header(tar, inode, '6', 0, NULL, 0);
+        break;
+    }
+    ufs_put(tar->image, buf);
+    return result;
+}
+
+static int
+tar_directory(struct tar *tar, struct ufs2_dinode *inode) {
+    /**
+     * Archives a directory's entries in directory order. The entries are
+     * copied out first, so no directory block stays pinned below here, and
+     * their inodes and first blocks are prefetched before any is written
+     */
+    struct child *children = NULL;
+    char *names = NULL;
+    size_t count = 0, cap = 0, names_len = 0, names_cap = 0;
+
+    struct ufs_dir_iter iter;
+    struct ufs_dirent entries[UFS_DIRSCAN_BATCH], *dir;
+    const char *data;
+    off_t physical, length, offset;
+    size_t listed;
+    ufs_dir_begin(&iter, tar->image, inode);
+    while ((data = ufs_dir_next(&iter, &physical, &length))) {
+        offset = 0;
+        while ((listed = ufs_dirscan_list(data, length, &offset, entries, UFS_DIRSCAN_BATCH))) {
+            for (dir = entries; dir < entries + listed; dir++) {
+                if (dir->type == DT_WHT) continue;
+                if (dir->name[0] == '.' && (dir->namlen == 1 ||
+                    (dir->namlen == 2 && dir->name[1] == '.'))) continue;
+
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    children = realloc(children, cap * sizeof(struct child));
+                    if (!children) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                if (names_len + dir->namlen > names_cap) {
+                    names_cap = names_cap ? names_cap * 2 : 4096;
+                    if (names_cap < names_len + dir->namlen) names_cap = names_len + dir->namlen;
+                    names = realloc(names, names_cap);
+                    if (!names) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                children[count].inode = dir->inode;
+                children[count].name = names_len;
+                children[count].namlen = dir->namlen;
+                memcpy(names + names_len, dir->name, dir->namlen);
+                names_len += dir->namlen;
+                count++;
+            }
+        }
+    }
+    ufs_dir_end(&iter);
+    prefetch_children(tar, children, count);
+
+    size_t path_len = tar->path_len;
+    int result = 0;
+    for (size_t n = 0; n < count && result == 0; n++) {
+        set_path(tar, path_len, "/", 1);
+        set_path(tar, path_len + 1, names + children[n].name, children[n].namlen);
+        result = tar_entry(tar, children[n].inode);
+    }
+    tar->path_len = path_len;
+    free(children);
+    free(names);
+    return result;
+}
+
+static void
+prefetch_children(struct tar *tar, struct child *children, size_t count) {
+    /**
+     * Gets a directory's entries read ahead of the archive: the inode
+     * blocks in cylinder group order, then each inode's direct blocks (all
+     * of a small file, the first blocks of a directory)
+     */
+    if (!count) return;
+    ino_t *inodes = malloc(count * sizeof(ino_t));
+    if (!inodes) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t n = 0; n < count; n++) inodes[n] = children[n].inode;
+    ufs_prefetch_inodes(tar->image, inodes, count);
+
+    struct fs *superblock = tar->image->superblock;
+    struct ufs_buf *buf;
+    for (size_t n = 0; n < count; n++) {
+        struct ufs2_dinode *child = ufs_inode(tar->image, inodes[n], &buf);
+        int type = child->di_mode & IFMT;
+        if (type == IFDIR || type == IFREG) {
+            ufs_lbn_t blocks = lblkno(superblock, (off_t)child->di_size + superblock->fs_bsize - 1);
+            off_t start = -1, end = -1, block;
+            for (ufs_lbn_t lbn = 0; lbn < blocks && lbn < UFS_NDADDR; lbn++) {
+                if (!child->di_db[lbn]) continue;
+                block = ufs_block_offset(superblock, child->di_db[lbn]);
+                if (block == end) {
+                    end += superblock->fs_bsize;
+                    continue;
+                }
+                if (start >= 0) ufs_prefetch(tar->image, start, end - start);
+                start = block;
+                end = block + superblock->fs_bsize;
+            }
+            if (start >= 0) ufs_prefetch(tar->image, start, end - start);
+        }
+        ufs_put(tar->image, buf);
+    }
+    free(inodes);
+}
+
+static int
+tar_file(struct tar *tar, struct ufs2_dinode *inode) {
+    /**
+     * Writes a regular file's data, one extent at a time with the holes as
+     * zeros, then pads it to a whole block
+     */
+    struct ufs_extent_iter iter;
+    struct ufs_extent extent;
+    off_t written = 0, size = inode->di_size;
+    int result = 0;
+    ufs_extent_begin(&iter, tar->image, inode);
+    while (result == 0 && ufs_extent_next(&iter, &extent)) {
+        result = ufs_out_zeros(tar->out, extent.logical - written);
+        if (result == 0) result = ufs_out_extent(tar->out, tar->image, extent.physical, extent.length);
+        written = extent.logical + extent.length;
+    }
+    ufs_extent_end(&iter);
+    if (result == 0) result = ufs_out_zeros(tar->out, size - written);
+    if (result == 0 && size % UFS_TAR_BLOCK) {
+        result = ufs_out_bytes(tar->out, zero_blocks, UFS_TAR_BLOCK - size % UFS_TAR_BLOCK);
+    }
+    tar->written += (size + UFS_TAR_BLOCK - 1) / UFS_TAR_BLOCK * UFS_TAR_BLOCK;
+    return result;
+}
+
+static int
+octal(char *field, size_t width, uintmax_t value) {
+    /**
+     * Fills a header field with value in octal, zero padded and NUL
+     * terminated. Returns 0 when it does not fit
+     */
+    if (width < 22 && value >> (3 * (width - 1))) return 0;
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; value >>= 3) field[i] = '0' + (value & 7);
+    return 1;
+}
+
+static void
+pax_record(char *pax, size_t *pax_len, const char *key, const char *value, size_t length) {
+    /**
+     * Appends "<length> key=value\n" to a pax header, the length counting
+     * its own digits
+     */
+    size_t body = strlen(key) + length + 3, total = body + 1;
+    while (total < body + snprintf(NULL, 0, "%zu", total)) total++;
+    if (*pax_len + total > PAX_MAX) return;
+
+    char *p = pax + *pax_len;
+    p += sprintf(p, "%zu %s=", total, key);
+    memcpy(p, value, length);
+    p[length] = '\n';
+    *pax_len += total;
+}
+
+static int
+tar_header(
+    struct tar *tar,
+    const struct ufs2_dinode *inode,
+    char type,
+    off_t size,
+    const char *linkname,
+    size_t linklen
+) {
+    /**
+     * Writes the ustar header for tar->path. Whatever does not fit goes in
+     * a pax extended header ('x') in front of it, and the ustar field gets
+     * what does fit
+     */
+    char header[UFS_TAR_BLOCK], pax[PAX_MAX + UFS_TAR_BLOCK], number[32];
+    size_t pax_len = 0, len = tar->path_len;
+    const char *path = tar->path;
+    if (type == '5') len++; // the trailing slash
+    memset(header, 0, sizeof(header));
+
+    // The name is either whole, or split at a slash into prefix and name
+    size_t split = 0;
+    if (len <= 100) {
+        memcpy(header, path, len);
+    } else {
+        for (size_t i = len - 1; i-- > 0;) {
+            if (path[i] == '/' && i <= 155 && len - i - 1 <= 100) {
+                split = i;
+                break;
+            }
+        }
+        if (split) {
+            memcpy(header + 345, path, split);
+            memcpy(header, path + split + 1, len - split - 1);
+        } else {
+            pax_record(pax, &pax_len, "path", path, len);
+            memcpy(header, path, 100);
+        }
+    }
+    if (linkname) {
+        if (linklen > 100) pax_record(pax, &pax_len, "linkpath", linkname, linklen);
+        memcpy(header + 157, linkname, linklen < 100 ? linklen : 100);
+    }
+
+    octal(header + 100, 8, inode->di_mode & 07777);
+    if (!octal(header + 108, 8, inode->di_uid)) {
+        pax_record(pax, &pax_len, "uid", number, sprintf(number, "%ju", (uintmax_t)inode->di_uid));
+    }
+    if (!octal(header + 116, 8, inode->di_gid)) {
+        pax_record(pax, &pax_len, "gid", number, sprintf(number, "%ju", (uintmax_t)inode->di_gid));
+    }
+    if (!octal(header + 124, 12, size)) {
+        pax_record(pax, &pax_len, "size", number, sprintf(number, "%jd", (intmax_t)size));
+    }
+    if (inode->di_mtime < 0 || !octal(header + 136, 12, inode->di_mtime)) {
+        pax_record(pax, &pax_len, "mtime", number, sprintf(number, "%jd", (intmax_t)inode->di_mtime));
+        octal(header + 136, 12, 0);
+    }
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        // di_db[0] holds the device number (di_rdev)
+        dev_t rdev = inode->di_db[0];
+        octal(header + 329, 8, major(rdev));
+        octal(header + 337, 8, minor(rdev));
+    }
+
+    // The checksum is taken with its own field as spaces
+    unsigned sum = 0;
+    memset(header + 148, ' ', 8);
+    for (size_t i = 0; i < sizeof(header); i++) sum += (unsigned char)header[i];
+    octal(header + 148, 7, sum);
+
+    if (pax_len) {
+        // Same header, as type 'x' carrying the records
+        char extended[UFS_TAR_BLOCK];
+        memcpy(extended, header, sizeof(extended));
+        extended[156] = 'x';
+        octal(extended + 124, 12, pax_len);
+        sum = 0;
+        memset(extended + 148, ' ', 8);
+        for (size_t i = 0; i < sizeof(extended); i++) sum += (unsigned char)extended[i];
+        octal(extended + 148, 7, sum);
+
+        size_t padded = (pax_len + UFS_TAR_BLOCK - 1) / UFS_TAR_BLOCK * UFS_TAR_BLOCK;
+        memset(pax + pax_len, 0, padded - pax_len);
+        if (ufs_out_bytes(tar->out, extended, sizeof(extended)) == -1) return -1;
+        if (ufs_out_bytes(tar->out, pax, padded) == -1) return -1;
+        tar->written += sizeof(extended) + padded;
+    }
+    tar->written += sizeof(header);
+    return ufs_out_bytes(tar->out, header, sizeof(header));
+}
+
+static size_t
+read_symlink(struct tar *tar, const struct ufs2_dinode *inode, char *target) {
+    /**
+     * Copies a symlink's target (at most PATH_MAX bytes) into target.
+     * Short ones live in the block pointers, longer ones in a data block
+     */
+    size_t len = inode->di_size < PATH_MAX ? inode->di_size : PATH_MAX;
+    if ((off_t)inode->di_size < tar->image->superblock->fs_maxsymlinklen) {
+        if (len > sizeof(inode->di_db) + sizeof(inode->di_ib)) len = sizeof(inode->di_db) + sizeof(inode->di_ib);
+        memcpy(target, inode->di_db, len);
+    } else {
+        ufs_read(tar->image, target, len, ufs_block_offset(tar->image->superblock, inode->di_db[0]));
+    }
+    target[len] = '\0';
+    return len;
+}
+
+static const char *
+find_link(struct tar *tar, ino_t inode_num) {
+    /**
+     * Where a hard linked file was archived, NULL the first time
+     */
+    if (!tar->links_cap) return NULL;
+    size_t mask = tar->links_cap - 1;
+    for (size_t n = inode_num & mask; tar->links[n].inode; n = (n + 1) & mask) {
+        if (tar->links[n].inode == inode_num) return tar->links[n].path;
+    }
+    return NULL;
+}
+
+static void
+add_link(struct tar *tar, ino_t inode_num) {
+    /**
+     * Remembers tar->path as where inode_num was archived. The table
+     * doubles at half full
+     */
+    if (2 * (tar->nlinks + 1) > tar->links_cap) {
+        size_t old_cap = tar->links_cap;
+        struct link *old = tar->links;
+        tar->links_cap = old_cap ? old_cap * 2 : 64;
+        tar->links = calloc(tar->links_cap, sizeof(struct link));
+        if (!tar->links) {
+            perror("calloc");
+            exit(1);
+        }
+        size_t mask = tar->links_cap - 1, n;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i].inode) continue;
+            for (n = old[i].inode & mask; tar->links[n].inode; n = (n + 1) & mask);
+            tar->links[n] = old[i];
+        }
+        free(old);
+    }
+
+    size_t mask = tar->links_cap - 1, n;
+    for (n = inode_num & mask; tar->links[n].inode; n = (n + 1) & mask);
+    tar->links[n].inode = inode_num;
+    tar->links[n].path = strndup(tar->path, tar->path_len);
+    if (!tar->links[n].path) {
+        perror("strndup");
+        exit(1);
+    }
+    tar->nlinks++;
+}
+
+static void
+set_path(struct tar *tar, size_t len, const char *name, size_t namlen) {
+    /**
+     * Cuts tar->path to len bytes and appends name, growing it as needed
+     */
+    if (len + namlen + 1 > tar->path_cap) {
+        tar->path_cap = (len + namlen + 1) * 2;
+        tar->path = realloc(tar->path, tar->path_cap);
+        if (!tar->path) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(tar->path + len, name, namlen);
+    tar->path_len = len + namlen;
+    tar->path[tar->path_len] = '\0';
+}
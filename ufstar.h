@@ -0,0 +1,29 @@
+/**
+ * ufstar.h
+ *
+ * Writes a subtree of an image as a POSIX (ustar) tar stream, straight
+ * from the inodes: mode, owner and mtime come from the dinode and file
+ * data goes out through ufsout, so it is copied by the kernel where the
+ * output allows. Names, link targets and numbers that do not fit a ustar
+ * header get a pax extended header in front. Hard linked files are
+ * archived once and linked to after that.
+ */
+#ifndef UFSTAR_H
+#define UFSTAR_H
+
+#include <sys/types.h>
+
+#include "ufsread.h"
+#include "ufsout.h"
+
+#define UFS_TAR_BLOCK 512
+#define UFS_TAR_RECORD 10240            // the archive is padded to whole records
+
+int ufs_tar_write(
+    struct ufs_out *out,
+    const struct ufs_image *image,
+    ino_t inode_num,
+    const char *name
+);
+
+#endif